@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+static size_t arena_round(size_t size){
+   return (size + ARENA_ALIGN-1) & ~((size_t)ARENA_ALIGN-1);
+}
+
+static arena_chunk new_chunk(size_t size){
+   arena_chunk chunk = malloc(sizeof(*chunk)+size);
+   assert(chunk != NULL);
+   chunk->next = NULL;
+   chunk->size = size;
+   chunk->used = 0;
+   return chunk;
+}
+
+static void free_arena(arena mem){
+   arena_chunk next;
+   for(arena_chunk chunk = mem->chunks; chunk != NULL; chunk = next){
+      next = chunk->next;
+      free(chunk);
+   }
+   free(mem);
+}
+
+arena_pool new_arena_pool(){
+   arena_pool pool = malloc(sizeof(*pool));
+   assert(pool != NULL);
+   pthread_mutex_init(&pool->lock,NULL);
+   pool->free_list = NULL;
+   pool->outstanding = 0;
+   pool->closed = 0;
+   return pool;
+}
+
+arena get_arena(arena_pool pool){
+   pthread_mutex_lock(&pool->lock);
+   arena mem = pool->free_list;
+   if(mem != NULL) pool->free_list = mem->next;
+   ++pool->outstanding;
+   pthread_mutex_unlock(&pool->lock);
+   if(mem == NULL){
+      mem = malloc(sizeof(*mem));
+      assert(mem != NULL);
+      mem->chunks = new_chunk(ARENA_MIN_CHUNK);
+      mem->total = ARENA_MIN_CHUNK;
+      mem->pool = pool;
+   }
+   mem->next = NULL;
+   return mem;
+}
+
+void *arena_alloc(arena mem, size_t size){
+   size = arena_round(size);
+   arena_chunk chunk = mem->chunks;
+   if(chunk->size - chunk->used < size){
+      size_t chunk_size = 2*chunk->size;
+      while(chunk_size < size) chunk_size *= 2;
+      chunk = new_chunk(chunk_size);
+      chunk->next = mem->chunks;
+      mem->chunks = chunk;
+      mem->total += chunk_size;
+   }
+   void *ptr = chunk->data+chunk->used;
+   chunk->used += size;
+   return ptr;
+}
+
+void *arena_calloc(arena mem, size_t size){
+   void *ptr = arena_alloc(mem,size);
+   memset(ptr,0,size);
+   return ptr;
+}
+
+//Grow an allocation, extending it in place when it is the most recent
+//allocation in the current chunk and copying it otherwise. The old
+//space is not reclaimed until the arena is reset.
+void *arena_grow(arena mem, void *ptr, size_t old_size, size_t new_size){
+   arena_chunk chunk = mem->chunks;
+   old_size = arena_round(old_size);
+   new_size = arena_round(new_size);
+   if((char *)ptr+old_size == chunk->data+chunk->used
+         && chunk->size-chunk->used >= new_size-old_size){
+      chunk->used += new_size-old_size;
+      return ptr;
+   }
+   void *new_ptr = arena_alloc(mem,new_size);
+   memcpy(new_ptr,ptr,old_size);
+   return new_ptr;
+}
+
+char *arena_strndup(arena mem, const char *str, size_t len){
+   char *copy = arena_alloc(mem,len+1);
+   memcpy(copy,str,len);
+   copy[len] = '\0';
+   return copy;
+}
+
+//Empty the arena. If the last use spilled into more than one chunk,
+//replace them with a single chunk big enough to hold all of it, so
+//the next block of the same size fits without growing.
+void reset_arena(arena mem){
+   if(mem->chunks->next != NULL){
+      arena_chunk next;
+      for(arena_chunk chunk = mem->chunks; chunk != NULL; chunk = next){
+         next = chunk->next;
+         free(chunk);
+      }
+      mem->chunks = new_chunk(mem->total);
+   }
+   mem->chunks->used = 0;
+}
+
+void release_arena(arena mem){
+   if(mem == NULL) return;
+   arena_pool pool = mem->pool;
+   reset_arena(mem);
+   pthread_mutex_lock(&pool->lock);
+   --pool->outstanding;
+   if(pool->closed){
+      int last = pool->outstanding == 0;
+      pthread_mutex_unlock(&pool->lock);
+      free_arena(mem);
+      if(last){
+         pthread_mutex_destroy(&pool->lock);
+         free(pool);
+      }
+      return;
+   }
+   mem->next = pool->free_list;
+   pool->free_list = mem;
+   pthread_mutex_unlock(&pool->lock);
+}
+
+//Free the pool's idle arenas. Arenas still held by live blocks are
+//freed as they are released, and the pool itself with the last one.
+void free_arena_pool(arena_pool pool){
+   if(pool == NULL) return;
+   pthread_mutex_lock(&pool->lock);
+   arena idle = pool->free_list;
+   pool->free_list = NULL;
+   pool->closed = 1;
+   int last = pool->outstanding == 0;
+   pthread_mutex_unlock(&pool->lock);
+   arena next;
+   for(arena mem = idle; mem != NULL; mem = next){
+      next = mem->next;
+      free_arena(mem);
+   }
+   if(last){
+      pthread_mutex_destroy(&pool->lock);
+      free(pool);
+   }
+}
@@ -0,0 +1,47 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+//Bump allocator backing a single alignment block. Everything allocated
+//for the block comes from the arena's chunks and is released at once
+//when the block is freed. Released arenas go back to the pool they came
+//from, so steady state parsing does no malloc/free per block.
+//Size of an arena's first chunk, so the least memory any block takes.
+#define ARENA_MIN_CHUNK 16384
+
+typedef struct _arena_chunk{
+   struct _arena_chunk *next;
+   size_t size;
+   size_t used;
+   char data[] __attribute__((aligned(16)));
+}*arena_chunk;
+
+typedef struct _arena{
+   arena_chunk chunks;
+   size_t total;
+   struct _arena_pool *pool;
+   struct _arena *next;
+}*arena;
+
+//Blocks may be parsed and freed on different threads, so the pool is
+//guarded by a mutex.
+typedef struct _arena_pool{
+   pthread_mutex_t lock;
+   arena free_list;
+   int outstanding;
+   int closed;
+}*arena_pool;
+
+arena_pool new_arena_pool();
+arena get_arena(arena_pool pool);
+void *arena_alloc(arena mem, size_t size);
+void *arena_calloc(arena mem, size_t size);
+void *arena_grow(arena mem, void *ptr, size_t old_size, size_t new_size);
+char *arena_strndup(arena mem, const char *str, size_t len);
+void reset_arena(arena mem);
+void release_arena(arena mem);
+void free_arena_pool(arena_pool pool);
+
+#endif
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "bgzf.h"
+
+static inline uint32_t read_le16(const unsigned char *data){
+   return data[0] | data[1]<<8;
+}
+
+static inline uint32_t read_le32(const unsigned char *data){
+   return data[0] | data[1]<<8 | data[2]<<16 | (uint32_t)data[3]<<24;
+}
+
+//Check for a gzip header with the BC extra field that marks BGZF.
+int is_bgzf(const unsigned char *data, size_t len){
+   return len >= BGZF_HEADER && data[0] == 31 && data[1] == 139
+      && data[2] == 8 && (data[3] & 4) && read_le16(data+10) >= 6
+      && data[12] == 'B' && data[13] == 'C' && read_le16(data+14) == 2;
+}
+
+int bgzf_default_threads(){
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   if(cpus < 1) return 1;
+   return cpus < BGZF_MAX_THREADS ? cpus : BGZF_MAX_THREADS;
+}
+
+static void init_stream(z_stream *stream){
+   memset(stream,0,sizeof(*stream));
+   if(inflateInit2(stream,-15) != Z_OK){
+      fprintf(stderr,"Failed to initialise zlib: %s\n",stream->msg);
+      exit(1);
+   }
+}
+
+//Read len bytes, taking any pending bytes first.
+static size_t read_raw(bgzf_reader reader, unsigned char *buf, size_t len){
+   size_t n = 0;
+   if(reader->pending_pos < reader->pending_len){
+      n = reader->pending_len-reader->pending_pos;
+      if(n > len) n = len;
+      memcpy(buf,reader->pending+reader->pending_pos,n);
+      reader->pending_pos += n;
+   }
+   if(n < len) n += fread(buf+n,1,len-n,reader->file);
+   return n;
+}
+
+static int invalid_block(bgzf_reader reader){
+   fprintf(stderr, "Invalid BGZF block at offset %llu in file: %s\n",
+      (unsigned long long)reader->coffset,reader->filename);
+   return -1;
+}
+
+//Size of a block from the BC subfield of its header's xlen bytes of
+//extra fields, 0 if there isn't one.
+static size_t block_size(const unsigned char *data, size_t xlen){
+   for(size_t pos = 12; pos+4 <= 12+xlen; pos += 4+read_le16(data+pos+2)){
+      if(data[pos] == 'B' && data[pos+1] == 'C' && read_le16(data+pos+2) == 2
+            && pos+6 <= 12+xlen)
+         return read_le16(data+pos+4)+1;
+   }
+   return 0;
+}
+
+//Read the next compressed block into block. Returns 1 if a block was
+//read, 0 at the end of the file and -1 on error.
+static int read_compressed(bgzf_reader reader, bgzf_block block){
+   unsigned char *data = block->cdata;
+   size_t n = read_raw(reader,data,12);
+   if(ferror(reader->file) != 0){
+      fprintf(stderr, "File stream error: %s\nError: %s\n",
+         reader->filename,strerror(errno));
+      return -1;
+   }
+   if(n == 0) return 0;
+   if(n < 12 || data[0] != 31 || data[1] != 139 || data[2] != 8
+         || !(data[3] & 4))
+      return invalid_block(reader);
+   size_t xlen = read_le16(data+10);
+   if(12+xlen+8 > BGZF_MAX_BLOCK || read_raw(reader,data+12,xlen) != xlen)
+      return invalid_block(reader);
+   size_t size = block_size(data,xlen);
+   if(size < 12+xlen+8
+         || read_raw(reader,data+12+xlen,size-12-xlen) != size-12-xlen)
+      return invalid_block(reader);
+   block->csize = size;
+   block->usize = read_le32(data+size-4);
+   if(block->usize > BGZF_MAX_BLOCK) return invalid_block(reader);
+   block->coffset = reader->coffset;
+   block->ustart = reader->next_ustart;
+   reader->coffset += size;
+   reader->next_ustart += block->usize;
+   return 1;
+}
+
+//Inflate a block read by read_compressed, returning 0 on success.
+static int inflate_block(bgzf_block block, z_stream *stream){
+   size_t xlen = read_le16(block->cdata+10);
+   if(inflateReset(stream) != Z_OK) return -1;
+   stream->next_in = block->cdata+12+xlen;
+   stream->avail_in = block->csize-12-xlen-8;
+   stream->next_out = (unsigned char *)block->udata;
+   stream->avail_out = BGZF_MAX_BLOCK;
+   if(inflate(stream,Z_FINISH) != Z_STREAM_END
+         || stream->total_out != block->usize)
+      return -1;
+   uint32_t crc = crc32(0L,(unsigned char *)block->udata,block->usize);
+   return crc == read_le32(block->cdata+block->csize-8) ? 0 : -1;
+}
+
+static void *inflate_worker(void *arg){
+   bgzf_reader reader = arg;
+   z_stream stream;
+   init_stream(&stream);
+   pthread_mutex_lock(&reader->lock);
+   while(1){
+      while(!reader->stop && reader->next_inflate == reader->tail)
+         pthread_cond_wait(&reader->work,&reader->lock);
+      if(reader->stop) break;
+      bgzf_block block = &reader->slots[reader->next_inflate++
+         % reader->num_slots];
+      pthread_mutex_unlock(&reader->lock);
+      int error = inflate_block(block,&stream);
+      pthread_mutex_lock(&reader->lock);
+      block->error = error;
+      block->state = BGZF_DONE;
+      pthread_cond_broadcast(&reader->done);
+   }
+   pthread_mutex_unlock(&reader->lock);
+   inflateEnd(&stream);
+   return NULL;
+}
+
+//Remember where block's data is, growing the history once it holds
+//every block not yet released.
+static void add_history(bgzf_reader reader, bgzf_block block){
+   if(reader->num_history-reader->history_start == reader->history_max){
+      uint64_t max = 2*reader->history_max;
+      bgzf_history history = malloc(max*sizeof(*history));
+      assert(history != NULL);
+      for(uint64_t i = reader->history_start; i < reader->num_history; ++i)
+         history[i % max] = reader->history[i % reader->history_max];
+      free(reader->history);
+      reader->history = history;
+      reader->history_max = max;
+   }
+   bgzf_history entry = &reader->history[reader->num_history++
+      % reader->history_max];
+   entry->ustart = block->ustart;
+   entry->usize = block->usize;
+   entry->coffset = block->coffset;
+}
+
+//Read blocks into free slots until the ring is full or the file ends.
+//Without worker threads a single block is read and inflated in place.
+static void read_ahead(bgzf_reader reader){
+   uint64_t max = reader->num_threads < 2 ? 1 : reader->num_slots;
+   while(!reader->eof && reader->tail-reader->head < max){
+      bgzf_block block = &reader->slots[reader->tail % reader->num_slots];
+      int check = read_compressed(reader,block);
+      if(check <= 0){
+         if(check < 0) reader->error = 1;
+         reader->eof = 1;
+         break;
+      }
+      add_history(reader,block);
+      if(reader->num_threads < 2){
+         block->error = inflate_block(block,&reader->stream);
+         block->state = BGZF_DONE;
+         reader->next_inflate = ++reader->tail;
+         continue;
+      }
+      pthread_mutex_lock(&reader->lock);
+      block->state = BGZF_READ;
+      ++reader->tail;
+      pthread_cond_signal(&reader->work);
+      pthread_mutex_unlock(&reader->lock);
+   }
+}
+
+//Reader for the BGZF file, whose first pending_len bytes have already
+//been read into pending. Blocks are inflated on num_threads workers
+//while the caller consumes earlier ones.
+bgzf_reader get_bgzf_reader(FILE *file, char *filename, const char *pending,
+      size_t pending_len, int num_threads){
+   bgzf_reader reader = calloc(1,sizeof(*reader));
+   assert(reader != NULL);
+   reader->file = file;
+   reader->filename = strdup(filename);
+   assert(reader->filename != NULL);
+   reader->pending = malloc(pending_len+1);
+   assert(reader->pending != NULL);
+   if(pending_len > 0) memcpy(reader->pending,pending,pending_len);
+   reader->pending_len = pending_len;
+   reader->pending_pos = 0;
+   reader->threads = NULL;
+   reader->num_threads = num_threads < 2 ? 1 : num_threads;
+   reader->num_slots = reader->num_threads < 2 ? 1 : 4*reader->num_threads;
+   reader->slots = calloc(reader->num_slots,sizeof(*reader->slots));
+   assert(reader->slots != NULL);
+   for(int i = 0; i < reader->num_slots; ++i){
+      reader->slots[i].cdata = malloc(BGZF_MAX_BLOCK);
+      reader->slots[i].udata = malloc(BGZF_MAX_BLOCK);
+      assert(reader->slots[i].cdata != NULL && reader->slots[i].udata != NULL);
+   }
+   reader->history_max = BGZF_HISTORY;
+   reader->history = malloc(reader->history_max*sizeof(*reader->history));
+   assert(reader->history != NULL);
+   init_stream(&reader->stream);
+   pthread_mutex_init(&reader->lock,NULL);
+   pthread_cond_init(&reader->work,NULL);
+   pthread_cond_init(&reader->done,NULL);
+   if(reader->num_threads > 1){
+      reader->threads = malloc(reader->num_threads*sizeof(pthread_t));
+      assert(reader->threads != NULL);
+      for(int i = 0; i < reader->num_threads; ++i)
+         if(pthread_create(&reader->threads[i],NULL,inflate_worker,reader)!=0){
+            fprintf(stderr,"Failed to create thread: %s\n",strerror(errno));
+            exit(1);
+         }
+      reader->started = 1;
+   }
+   return reader;
+}
+
+//Read up to len uncompressed bytes into buf. Returns the number of bytes
+//read, which is less than len at the end of the file or on error, when
+//reader->error is set.
+size_t bgzf_read(bgzf_reader reader, char *buf, size_t len){
+   size_t copied = 0;
+   while(copied < len && !reader->error){
+      read_ahead(reader);
+      if(reader->head == reader->tail) break;
+      bgzf_block block = &reader->slots[reader->head % reader->num_slots];
+      pthread_mutex_lock(&reader->lock);
+      while(block->state != BGZF_DONE)
+         pthread_cond_wait(&reader->done,&reader->lock);
+      pthread_mutex_unlock(&reader->lock);
+      if(block->error){
+         fprintf(stderr, "Corrupt BGZF block at offset %llu in file: %s\n",
+            (unsigned long long)block->coffset,reader->filename);
+         reader->error = 1;
+         break;
+      }
+      if(reader->skip > 0){
+         if(reader->skip > block->usize){
+            fprintf(stderr, "Invalid BGZF virtual offset in file: %s\n",
+               reader->filename);
+            reader->error = 1;
+            break;
+         }
+         reader->block_pos = reader->skip;
+         reader->skip = 0;
+      }
+      size_t n = block->usize-reader->block_pos;
+      if(n > len-copied) n = len-copied;
+      memcpy(buf+copied,block->udata+reader->block_pos,n);
+      copied += n;
+      reader->block_pos += n;
+      if(reader->block_pos == block->usize){
+         block->state = BGZF_EMPTY;
+         ++reader->head;
+         reader->block_pos = 0;
+      }
+   }
+   return copied;
+}
+
+//Read up to len bytes at offset of fd, fewer only at the end of the
+//file. Returns the bytes read, or -1 on error.
+static ssize_t pread_full(int fd, void *buf, size_t len, uint64_t offset){
+   size_t got = 0;
+   while(got < len){
+      ssize_t n = pread(fd,(char *)buf+got,len-got,offset+got);
+      if(n < 0 && errno == EINTR) continue;
+      if(n < 0) return -1;
+      if(n == 0) break;
+      got += n;
+   }
+   return got;
+}
+
+//Read the compressed block at coffset of fd into block with pread.
+//Returns 1 if a block was read, 0 at the end of the file and -1 on
+//error.
+static int pread_compressed(int fd, char *filename, uint64_t coffset,
+      bgzf_block block){
+   unsigned char *data = block->cdata;
+   ssize_t n = pread_full(fd,data,12,coffset);
+   if(n < 0){
+      fprintf(stderr, "File read error: %s\nError: %s\n",filename,
+         strerror(errno));
+      return -1;
+   }
+   if(n == 0) return 0;
+   size_t xlen = read_le16(data+10);
+   size_t size = 0;
+   if(n == 12 && data[0] == 31 && data[1] == 139 && data[2] == 8
+         && (data[3] & 4) && 12+xlen+8 <= BGZF_MAX_BLOCK
+         && pread_full(fd,data+12,xlen,coffset+12) == (ssize_t)xlen)
+      size = block_size(data,xlen);
+   if(size < 12+xlen+8 || pread_full(fd,data+12+xlen,size-12-xlen,
+         coffset+12+xlen) != (ssize_t)(size-12-xlen)){
+      fprintf(stderr, "Invalid BGZF block at offset %llu in file: %s\n",
+         (unsigned long long)coffset,filename);
+      return -1;
+   }
+   block->csize = size;
+   block->usize = read_le32(data+size-4);
+   block->coffset = coffset;
+   return 1;
+}
+
+//Read len bytes of uncompressed data from virtual_offset of the BGZF
+//file open on fd, inflating the blocks they span into buf. Nothing is
+//shared with a reader, so any number of threads may read one file this
+//way at once. Sets got to the bytes read, fewer than len at the end of
+//the file. Returns 0 on success and -1 on error.
+int bgzf_pread(int fd, char *filename, uint64_t virtual_offset, char *buf,
+      size_t len, size_t *got){
+   struct _bgzf_block block;
+   block.cdata = malloc(BGZF_MAX_BLOCK);
+   block.udata = malloc(BGZF_MAX_BLOCK);
+   assert(block.cdata != NULL && block.udata != NULL);
+   z_stream stream;
+   init_stream(&stream);
+   uint64_t coffset = virtual_offset >> 16;
+   size_t skip = virtual_offset & 0xffff;
+   int ret = 0;
+   *got = 0;
+   while(*got < len){
+      int check = pread_compressed(fd,filename,coffset,&block);
+      if(check < 0) ret = -1;
+      if(check <= 0) break;
+      if(block.usize > BGZF_MAX_BLOCK || inflate_block(&block,&stream) != 0){
+         fprintf(stderr, "Invalid BGZF block at offset %llu in file: %s\n",
+            (unsigned long long)coffset,filename);
+         ret = -1;
+         break;
+      }
+      if(skip < block.usize){
+         size_t n = block.usize-skip;
+         if(n > len-*got) n = len-*got;
+         memcpy(buf+*got,block.udata+skip,n);
+         *got += n;
+         skip = 0;
+      }else skip -= block.usize;
+      coffset += block.csize;
+   }
+   inflateEnd(&stream);
+   free(block.cdata);
+   free(block.udata);
+   return ret;
+}
+
+//Position the reader at a virtual offset. Returns 0 on success and -1
+//on error.
+int bgzf_seek(bgzf_reader reader, uint64_t virtual_offset){
+//Wait for blocks still being inflated before dropping them.
+   pthread_mutex_lock(&reader->lock);
+   for(uint64_t i = reader->head; i < reader->tail; ++i){
+      bgzf_block block = &reader->slots[i % reader->num_slots];
+      while(block->state == BGZF_READ)
+         pthread_cond_wait(&reader->done,&reader->lock);
+      block->state = BGZF_EMPTY;
+   }
+   reader->head = reader->tail = reader->next_inflate = 0;
+   pthread_mutex_unlock(&reader->lock);
+   reader->block_pos = 0;
+   reader->pending_pos = reader->pending_len;
+   reader->eof = reader->error = 0;
+   reader->coffset = virtual_offset >> 16;
+   reader->next_ustart = 0;
+   reader->history_start = reader->num_history;
+   reader->skip = virtual_offset & 0xffff;
+   if(fseeko(reader->file,reader->coffset,SEEK_SET) != 0){
+      fprintf(stderr,"File seek error: %s\nError: %s\n",reader->filename,
+         strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+//Virtual offset of the byte uoffset bytes into the uncompressed data
+//read so far. Returns UINT64_MAX if uoffset is in a block already
+//released by bgzf_release_history, or hasn't been read.
+uint64_t bgzf_virtual_offset(bgzf_reader reader, uint64_t uoffset){
+//Blocks are remembered in file order, so search for the last one that
+//starts at or before uoffset.
+   uint64_t low = reader->history_start, high = reader->num_history;
+   while(low < high){
+      uint64_t mid = low+(high-low)/2;
+      if(reader->history[mid % reader->history_max].ustart <= uoffset)
+         low = mid+1;
+      else high = mid;
+   }
+   if(low > reader->history_start){
+      bgzf_history entry = &reader->history[(low-1) % reader->history_max];
+      if(uoffset < entry->ustart+entry->usize)
+         return entry->coffset << 16 | (uoffset-entry->ustart);
+   }
+//The end of the data read so far starts the next block.
+   if(uoffset == reader->next_ustart) return reader->coffset << 16;
+   return UINT64_MAX;
+}
+
+//Forget the blocks wholly before uoffset, which the caller will never
+//ask bgzf_virtual_offset about again.
+void bgzf_release_history(bgzf_reader reader, uint64_t uoffset){
+   while(reader->history_start < reader->num_history){
+      bgzf_history entry = &reader->history[reader->history_start
+         % reader->history_max];
+      if(entry->ustart+entry->usize > uoffset) break;
+      ++reader->history_start;
+   }
+}
+
+void free_bgzf_reader(bgzf_reader reader){
+   if(reader == NULL) return;
+   if(reader->started){
+      pthread_mutex_lock(&reader->lock);
+      reader->stop = 1;
+      pthread_cond_broadcast(&reader->work);
+      pthread_mutex_unlock(&reader->lock);
+      for(int i = 0; i < reader->num_threads; ++i)
+         pthread_join(reader->threads[i],NULL);
+   }
+   for(int i = 0; i < reader->num_slots; ++i){
+      free(reader->slots[i].cdata);
+      free(reader->slots[i].udata);
+   }
+   inflateEnd(&reader->stream);
+   pthread_mutex_destroy(&reader->lock);
+   pthread_cond_destroy(&reader->work);
+   pthread_cond_destroy(&reader->done);
+   free(reader->slots);
+   free(reader->threads);
+   free(reader->history);
+   free(reader->pending);
+   free(reader->filename);
+   free(reader);
+}
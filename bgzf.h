@@ -0,0 +1,90 @@
+#ifndef __BGZF_H
+#define __BGZF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+
+//BGZF files are a series of gzip members of at most 64KB uncompressed
+//each, so blocks can be inflated independently. A position in the
+//file is a virtual offset, the block's file offset shifted left 16
+//bits plus the offset within its uncompressed data.
+#define BGZF_MAX_BLOCK 65536
+#define BGZF_HEADER 18
+#define BGZF_MAX_THREADS 8
+//Blocks remembered for bgzf_virtual_offset to start with. The history
+//grows to hold every block the caller hasn't released, however many of
+//them a long line spans.
+#define BGZF_HISTORY 1024
+
+enum bgzf_state{ BGZF_EMPTY, BGZF_READ, BGZF_DONE };
+
+typedef struct _bgzf_block{
+	unsigned char *cdata;
+	size_t csize;
+	char *udata;
+	size_t usize;
+	uint64_t coffset;
+	uint64_t ustart;
+	enum bgzf_state state;
+	int error;
+}*bgzf_block;
+
+typedef struct _bgzf_history{
+	uint64_t ustart;
+	uint64_t usize;
+	uint64_t coffset;
+}*bgzf_history;
+
+typedef struct _bgzf_reader{
+	FILE *file;
+	char *filename;
+//Bytes already read from file by the caller, consumed before it.
+	char *pending;
+	size_t pending_len;
+	size_t pending_pos;
+	uint64_t coffset;
+	uint64_t next_ustart;
+	int eof;
+	int error;
+//Ring of blocks read ahead of the consumer. Blocks head to tail-1 are
+//read from the file, next_inflate onwards are waiting for a worker.
+	struct _bgzf_block *slots;
+	int num_slots;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t next_inflate;
+	size_t block_pos;
+//Bytes of the next block to skip after a seek.
+	size_t skip;
+	int num_threads;
+	pthread_t *threads;
+	int started;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+//Inflater used when there are no worker threads.
+	z_stream stream;
+//Ring of the blocks read from history_start to num_history-1, in
+//history_max slots.
+	struct _bgzf_history *history;
+	uint64_t history_start;
+	uint64_t num_history;
+	uint64_t history_max;
+}*bgzf_reader;
+
+int is_bgzf(const unsigned char *data, size_t len);
+int bgzf_default_threads();
+bgzf_reader get_bgzf_reader(FILE *file, char *filename, const char *pending,
+      size_t pending_len, int num_threads);
+size_t bgzf_read(bgzf_reader reader, char *buf, size_t len);
+int bgzf_seek(bgzf_reader reader, uint64_t virtual_offset);
+int bgzf_pread(int fd, char *filename, uint64_t virtual_offset, char *buf,
+      size_t len, size_t *got);
+uint64_t bgzf_virtual_offset(bgzf_reader reader, uint64_t uoffset);
+void bgzf_release_history(bgzf_reader reader, uint64_t uoffset);
+void free_bgzf_reader(bgzf_reader reader);
+
+#endif
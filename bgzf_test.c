@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bgzf.h"
+
+//Largest input bgzip puts in a block, leaving room for data that
+//doesn't compress.
+#define BGZF_BLOCK_INPUT 0xff00
+
+static void write_le16(unsigned char *data, uint32_t value){
+   data[0] = value;
+   data[1] = value >> 8;
+}
+
+static void write_le32(unsigned char *data, uint32_t value){
+   write_le16(data,value);
+   write_le16(data+2,value >> 16);
+}
+
+//Compress len bytes of data as one BGZF block with stream, a raw
+//deflate stream. Returns 0 on success.
+static int write_block(FILE *out, z_stream *stream, const char *data,
+      size_t len){
+   unsigned char block[BGZF_MAX_BLOCK];
+   static const unsigned char header[BGZF_HEADER] = {31,139,8,4,0,0,0,0,0,
+      255,6,0,'B','C',2,0,0,0};
+   memcpy(block,header,BGZF_HEADER);
+   if(deflateReset(stream) != Z_OK) return -1;
+   stream->next_in = (unsigned char *)data;
+   stream->avail_in = len;
+   stream->next_out = block+BGZF_HEADER;
+   stream->avail_out = BGZF_MAX_BLOCK-BGZF_HEADER-8;
+   if(deflate(stream,Z_FINISH) != Z_STREAM_END) return -1;
+   size_t csize = stream->total_out;
+   size_t size = BGZF_HEADER+csize+8;
+   write_le16(block+16,size-1);
+   write_le32(block+size-8,crc32(0L,(const unsigned char *)data,len));
+   write_le32(block+size-4,len);
+   return fwrite(block,1,size,out) == size ? 0 : -1;
+}
+
+//Compress a file to BGZF for testing the BGZF reader, in blocks of at
+//most -b bytes of input, small ones giving files of many blocks. The
+//file ends with the empty block bgzip writes.
+int main(int argc, char **argv){
+   size_t block_input = BGZF_BLOCK_INPUT;
+   int c;
+   while((c = getopt(argc,argv,"b:")) != -1){
+      if(c != 'b') return 1;
+      block_input = strtoul(optarg,NULL,10);
+      if(block_input < 1 || block_input > BGZF_BLOCK_INPUT){
+         fprintf(stderr, "Invalid block size: %s\n",optarg);
+         return 1;
+      }
+   }
+   if(argc-optind != 2){
+      fprintf(stderr,"Usage: %s [-b block bytes] <file> <BGZF file>\n",
+         argv[0]);
+      return 1;
+   }
+   FILE *in, *out;
+   if((in = fopen(argv[optind],"rb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s\n",
+         argv[optind],strerror(errno));
+      return 1;
+   }
+   if((out = fopen(argv[optind+1],"wb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s\n",
+         argv[optind+1],strerror(errno));
+      return 1;
+   }
+   z_stream stream;
+   memset(&stream,0,sizeof(stream));
+   if(deflateInit2(&stream,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,
+         Z_DEFAULT_STRATEGY) != Z_OK){
+      fprintf(stderr,"Failed to initialise zlib: %s\n",stream.msg);
+      return 1;
+   }
+   char data[BGZF_BLOCK_INPUT];
+   size_t len;
+   while((len = fread(data,1,block_input,in)) > 0){
+      if(write_block(out,&stream,data,len) != 0){
+         fprintf(stderr, "Failed to write BGZF file: %s\n",argv[optind+1]);
+         return 1;
+      }
+   }
+   if(ferror(in) || write_block(out,&stream,data,0) != 0 || fclose(out) != 0){
+      fprintf(stderr, "Failed to write BGZF file: %s\n",argv[optind+1]);
+      return 1;
+   }
+   deflateEnd(&stream);
+   fclose(in);
+   return 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "blockcache.h"
+#include "mafparser.h"
+
+static inline uint64_t block_hash(uint64_t block){
+   block *= 0x9e3779b97f4a7c15ULL;
+   return block ^ block >> 32;
+}
+
+block_cache new_block_cache(size_t max_bytes){
+   block_cache cache = calloc(1,sizeof(*cache));
+   assert(cache != NULL);
+   pthread_mutex_init(&cache->lock,NULL);
+   cache->num_buckets = 256;
+   cache->buckets = calloc(cache->num_buckets,sizeof(*cache->buckets));
+   assert(cache->buckets != NULL);
+   cache->max_bytes = max_bytes;
+   return cache;
+}
+
+//Link in the hash chain holding block, or the empty link at its end.
+static cache_entry *find_entry(block_cache cache, uint64_t block){
+   cache_entry *link = &cache->buckets[block_hash(block)
+      & (cache->num_buckets-1)];
+   while(*link != NULL && (*link)->block != block) link = &(*link)->chain;
+   return link;
+}
+
+static void grow_buckets(block_cache cache){
+   uint64_t num_buckets = 2*cache->num_buckets;
+   cache_entry *buckets = calloc(num_buckets,sizeof(*buckets));
+   assert(buckets != NULL);
+   for(uint64_t i = 0; i < cache->num_buckets; ++i){
+      cache_entry entry = cache->buckets[i];
+      while(entry != NULL){
+         cache_entry chain = entry->chain;
+         uint64_t bucket = block_hash(entry->block) & (num_buckets-1);
+         entry->chain = buckets[bucket];
+         buckets[bucket] = entry;
+         entry = chain;
+      }
+   }
+   free(cache->buckets);
+   cache->buckets = buckets;
+   cache->num_buckets = num_buckets;
+}
+
+static void unlink_entry(block_cache cache, cache_entry entry){
+   if(entry->prev != NULL) entry->prev->next = entry->next;
+   else cache->head = entry->next;
+   if(entry->next != NULL) entry->next->prev = entry->prev;
+   else cache->tail = entry->prev;
+}
+
+static void push_entry(block_cache cache, cache_entry entry){
+   entry->prev = NULL;
+   entry->next = cache->head;
+   if(cache->head != NULL) cache->head->prev = entry;
+   else cache->tail = entry;
+   cache->head = entry;
+}
+
+//Take entry out of the cache, releasing its block now unless a caller
+//still holds it. Called with the lock held.
+static void evict(block_cache cache, cache_entry entry){
+   *find_entry(cache,entry->block) = entry->chain;
+   unlink_entry(cache,entry);
+   cache->bytes -= entry->bytes;
+   --cache->size;
+   entry->cached = 0;
+   if(entry->refs == 0){
+      release_arena(entry->aln->mem);
+      free(entry);
+   }
+}
+
+//The cached block, held until the caller frees it, or NULL on a miss.
+alignment_block cache_lookup(block_cache cache, uint64_t block){
+   pthread_mutex_lock(&cache->lock);
+   cache_entry entry = *find_entry(cache,block);
+   if(entry == NULL){
+      ++cache->misses;
+      pthread_mutex_unlock(&cache->lock);
+      return NULL;
+   }
+   ++cache->hits;
+   ++entry->refs;
+   unlink_entry(cache,entry);
+   push_entry(cache,entry);
+   pthread_mutex_unlock(&cache->lock);
+   return entry->aln;
+}
+
+//Cache aln, just decoded, as block, evicting the least recently used
+//blocks until the cache is back within budget, which may be aln itself.
+//Returns the block the caller now holds. If another thread cached the
+//block first that one is returned and aln is released.
+alignment_block cache_insert(block_cache cache, uint64_t block,
+      alignment_block aln){
+   pthread_mutex_lock(&cache->lock);
+   cache_entry entry = *find_entry(cache,block);
+   if(entry != NULL){
+      ++entry->refs;
+      unlink_entry(cache,entry);
+      push_entry(cache,entry);
+      pthread_mutex_unlock(&cache->lock);
+      release_arena(aln->mem);
+      return entry->aln;
+   }
+   entry = malloc(sizeof(*entry));
+   assert(entry != NULL);
+   entry->block = block;
+   entry->aln = aln;
+   entry->bytes = aln->mem->total;
+   entry->refs = 1;
+   entry->cached = 1;
+   entry->cache = cache;
+   if(cache->size >= cache->num_buckets) grow_buckets(cache);
+   cache_entry *link = find_entry(cache,block);
+   entry->chain = NULL;
+   *link = entry;
+   push_entry(cache,entry);
+   ++cache->size;
+   cache->bytes += entry->bytes;
+   aln->cached = entry;
+   while(cache->bytes > cache->max_bytes) evict(cache,cache->tail);
+   pthread_mutex_unlock(&cache->lock);
+   return aln;
+}
+
+//Drop a caller's hold on a block from the cache, releasing it if it has
+//been evicted and this was the last hold.
+void cache_release(alignment_block aln){
+   cache_entry entry = aln->cached;
+   block_cache cache = entry->cache;
+   pthread_mutex_lock(&cache->lock);
+   int last = --entry->refs == 0 && !entry->cached;
+   pthread_mutex_unlock(&cache->lock);
+   if(last){
+      release_arena(aln->mem);
+      free(entry);
+   }
+}
+
+void cache_stats(block_cache cache, uint64_t *hits, uint64_t *misses){
+   pthread_mutex_lock(&cache->lock);
+   *hits = cache->hits;
+   *misses = cache->misses;
+   pthread_mutex_unlock(&cache->lock);
+}
+
+//Blocks from the cache must all be freed first.
+void free_block_cache(block_cache cache){
+   if(cache == NULL) return;
+   while(cache->tail != NULL) evict(cache,cache->tail);
+   pthread_mutex_destroy(&cache->lock);
+   free(cache->buckets);
+   free(cache);
+}
@@ -0,0 +1,55 @@
+#ifndef __BLOCKCACHE_H
+#define __BLOCKCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//Budget of the cache tools put in front of an array parser.
+#ifndef BLOCK_CACHE_BYTES
+#define BLOCK_CACHE_BYTES (256<<20)
+#endif
+
+//A block in the cache, or one evicted while still in use. refs counts
+//the callers holding the block, which is only released once it's out of
+//the cache and the last of them frees it.
+typedef struct _cache_entry{
+	uint64_t block;
+	struct _alignment_block *aln;
+	size_t bytes;
+	int refs;
+	int cached;
+	struct _block_cache *cache;
+//Least recently used list, most recent first, and the hash chain.
+	struct _cache_entry *prev;
+	struct _cache_entry *next;
+	struct _cache_entry *chain;
+}*cache_entry;
+
+//Decoded blocks of one file keyed by their index in it, up to max_bytes
+//of the blocks' arenas. A block is charged the memory its arena holds,
+//at least ARENA_MIN_CHUNK however small the block, so max_bytes bounds
+//what the cache really takes. Readers on any thread share it under
+//lock, hits and misses counting the lookups.
+typedef struct _block_cache{
+	pthread_mutex_t lock;
+	cache_entry *buckets;
+	uint64_t num_buckets;
+	uint64_t size;
+	cache_entry head;
+	cache_entry tail;
+	size_t bytes;
+	size_t max_bytes;
+	uint64_t hits;
+	uint64_t misses;
+}*block_cache;
+
+block_cache new_block_cache(size_t max_bytes);
+struct _alignment_block *cache_lookup(block_cache cache, uint64_t block);
+struct _alignment_block *cache_insert(block_cache cache, uint64_t block,
+      struct _alignment_block *aln);
+void cache_release(struct _alignment_block *aln);
+void cache_stats(block_cache cache, uint64_t *hits, uint64_t *misses);
+void free_block_cache(block_cache cache);
+
+#endif
@@ -0,0 +1,326 @@
+#!/bin/bash
+# Regression checks: every way of reading a MAF must give the same output
+# as reading the plain text file on one thread. Run from the source
+# directory after building, or through make check.
+
+MAF=larger_artificial.maf
+COPIES=2000
+CONSARGS="--in-group amaVit1 croPor2 Anc05 Anc14 Anc21 --out-group Anc10 Anc09 Anc07 Anc18 --in-thresh=0.8 --out-thresh=0.7 --output-genomes amaVit1 croPor2 Anc05"
+SRC=$(pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf ${WORK}' EXIT
+FAILED=0
+
+fail(){
+   echo "FAIL: $1"
+   FAILED=1
+}
+
+# Run conservomatic in its own directory, since it writes its FASTA files
+# to the working directory.
+run_cons(){
+   local name=$1; shift
+   mkdir -p ${WORK}/${name}
+   (cd ${WORK}/${name} && ${SRC}/conservomatic ${CONSARGS} "$@" > cons.out) \
+      || fail "conservomatic $name exited nonzero"
+   rm -f ${WORK}/${name}/cons.out
+}
+
+# maf_stats without the Filename lines, which name the input.
+run_stats(){
+   local name=$1; shift
+   ${SRC}/maf_stats "$@" > ${WORK}/${name}.stats \
+      || fail "maf_stats $name exited nonzero"
+   sed -i '/^Filename: /d' ${WORK}/${name}.stats
+}
+
+same_cons(){
+   diff -r ${WORK}/text ${WORK}/$1 > /dev/null \
+      && echo "ok: conservomatic $1" || fail "conservomatic $1 differs from text"
+}
+
+same_stats(){
+   cmp -s ${WORK}/text.stats ${WORK}/$1.stats \
+      && echo "ok: maf_stats $1" || fail "maf_stats $1 differs from text"
+}
+
+# Input that must be rejected rather than read as far as the error.
+must_fail(){
+   local name=$1; shift
+   (cd ${WORK} && "$@" > /dev/null 2>&1) \
+      && fail "$name exited 0" || echo "ok: $name fails"
+}
+
+# Copies of the sample with their scaffolds renamed, so that every block
+# is different and the output depends on their order. At about 10MB it
+# is split into several ranges when parsed on threads.
+awk -v copies=${COPIES} '{line[NR] = $0}
+END{
+   for(i = 1; i <= copies; ++i)
+      for(j = 1; j <= NR; ++j){
+         l = line[j]
+         if(match(l,/^s[ \t]+[^ \t]+/))
+            l = substr(l,1,RLENGTH) "_" i substr(l,RLENGTH+1)
+         print l
+      }
+}' ${MAF} > ${WORK}/input.maf
+run_cons text ${WORK}/input.maf
+run_stats text ${WORK}/input.maf
+
+run_cons threads -t 4 ${WORK}/input.maf
+same_cons threads
+run_stats threads -t 4 ${WORK}/input.maf
+same_stats threads
+
+./maf2bin ${WORK}/input.maf ${WORK}/input.mafbin > /dev/null \
+   || fail "maf2bin exited nonzero"
+run_cons mafbin ${WORK}/input.mafbin
+same_cons mafbin
+run_stats mafbin ${WORK}/input.mafbin
+same_stats mafbin
+
+# BGZF, in bgzip's blocks and in blocks small enough that each buffer
+# fill spans hundreds of them. Threads go to inflating.
+./bgzf_test ${WORK}/input.maf ${WORK}/input.maf.gz \
+   || fail "bgzf_test exited nonzero"
+./bgzf_test -b 200 ${WORK}/input.maf ${WORK}/small.maf.gz \
+   || fail "bgzf_test exited nonzero"
+run_cons bgzf ${WORK}/input.maf.gz
+same_cons bgzf
+run_cons bgzf_threads -t 4 ${WORK}/input.maf.gz
+same_cons bgzf_threads
+run_cons bgzf_small ${WORK}/small.maf.gz
+same_cons bgzf_small
+run_stats bgzf ${WORK}/input.maf.gz
+same_stats bgzf
+run_stats bgzf_threads -t 4 ${WORK}/input.maf.gz
+same_stats bgzf_threads
+run_stats bgzf_small ${WORK}/small.maf.gz
+same_stats bgzf_small
+
+# The input split in two and read as several files, directly and from a
+# list naming them relative to the list.
+LINES=$(($(wc -l < ${MAF})*COPIES/2))
+head -n ${LINES} ${WORK}/input.maf > ${WORK}/part1.maf
+tail -n +$((LINES+1)) ${WORK}/input.maf > ${WORK}/part2.maf
+printf 'part1.maf\n# second half\npart2.maf\n' > ${WORK}/parts
+run_cons files ${WORK}/part1.maf ${WORK}/part2.maf
+same_cons files
+run_cons files_threads -t 4 @${WORK}/parts
+same_cons files_threads
+run_stats files ${WORK}/part1.maf ${WORK}/part2.maf
+same_stats files
+run_stats files_threads -t 4 @${WORK}/parts
+same_stats files_threads
+
+# The input with 'i' lines after its rows, 'q' lines after some and an
+# 'e' line in every block, which are kept with the block rather than
+# ending it, so the output is that of the input without them. Mapped,
+# on threads, in BGZF and piped.
+awk '/^a/{rows = 0}
+/^s/{
+   print
+   q = $7
+   gsub(/[^-]/,"9",q)
+   if(++rows % 2) print "q " $2 " " q
+   print "i " $2 " C 0 I " rows
+   if(rows == 2) print "e panTro4.chr" rows " 100 20 + 5000 I"
+   next
+}
+{print}' ${WORK}/input.maf > ${WORK}/ieq.maf
+grep -v '^[ieq] ' ${WORK}/ieq.maf | cmp -s - ${WORK}/input.maf \
+   || fail "ieq.maf isn't input.maf with lines added"
+./bgzf_test ${WORK}/ieq.maf ${WORK}/ieq.maf.gz || fail "bgzf_test exited nonzero"
+run_cons ieq ${WORK}/ieq.maf
+same_cons ieq
+run_cons ieq_threads -t 4 ${WORK}/ieq.maf
+same_cons ieq_threads
+run_cons ieq_bgzf ${WORK}/ieq.maf.gz
+same_cons ieq_bgzf
+run_cons ieq_pipe -t 1 /dev/stdin < ${WORK}/ieq.maf
+same_cons ieq_pipe
+run_stats ieq ${WORK}/ieq.maf
+same_stats ieq
+run_stats ieq_threads -t 4 ${WORK}/ieq.maf
+same_stats ieq_threads
+run_stats ieq_bgzf ${WORK}/ieq.maf.gz
+same_stats ieq_bgzf
+run_stats ieq_pipe /dev/stdin < ${WORK}/ieq.maf
+same_stats ieq_pipe
+./parser_test spans && echo "ok: decoding 'i', 'e' and 'q' lines" \
+   || fail "decoding 'i', 'e' and 'q' lines"
+
+# Blocks refilled in place, plain and sorted, must be the blocks newly
+# allocated for each, with none of the lines of the block before.
+for f in ${SRC}/${MAF} ${WORK}/input.maf ${WORK}/ieq.maf; do
+   ./parser_test refill ${f} && echo "ok: refilled blocks of ${f##*/}" \
+      || fail "refilled blocks of ${f##*/}"
+done
+
+# Hash blocks of more species than the table starts with, then of fewer,
+# new and refilled, must each find the rows of their own species only.
+./parser_test hash && echo "ok: species rows of hash blocks" \
+   || fail "species rows of hash blocks"
+
+# Files that can't be mapped are streamed by a worker each, so however
+# big they are only a few blocks of them are held at once. Fully parsed,
+# the two copies here take well over 100MB.
+peak_kb(){
+   "$@" &
+   local pid=$! peak=0 hwm
+   while kill -0 ${pid} 2> /dev/null; do
+      hwm=$(awk '/^VmHWM:/{print $2}' /proc/${pid}/status 2> /dev/null)
+      [ -n "${hwm}" ] && peak=${hwm}
+      sleep 0.02
+   done
+   wait ${pid} || fail "$1 exited nonzero"
+   PEAK=${peak}
+}
+cp ${WORK}/input.maf.gz ${WORK}/copy.maf.gz
+peak_kb ${SRC}/maf_stats -t 4 ${WORK}/input.maf.gz ${WORK}/copy.maf.gz \
+   > ${WORK}/files_bgzf.stats
+[ ${PEAK} -lt 65536 ] && echo "ok: maf_stats files_bgzf in ${PEAK}kB" \
+   || fail "maf_stats files_bgzf took ${PEAK}kB"
+${SRC}/maf_stats ${WORK}/input.maf.gz ${WORK}/copy.maf.gz \
+   > ${WORK}/files_bgzf_seq.stats || fail "maf_stats exited nonzero"
+cmp -s ${WORK}/files_bgzf_seq.stats ${WORK}/files_bgzf.stats \
+   && echo "ok: maf_stats files_bgzf" \
+   || fail "maf_stats files_bgzf differs from one thread"
+
+# Input that can't be mapped is read through the buffered parser, with
+# a read-ahead thread when given threads. conservomatic only takes
+# names without .maf as files after an option.
+run_cons pipe -t 1 /dev/stdin < ${WORK}/input.maf
+same_cons pipe
+run_cons pipe_threads -t 4 /dev/stdin < ${WORK}/input.maf
+same_cons pipe_threads
+run_stats pipe /dev/stdin < ${WORK}/input.maf
+same_stats pipe
+run_stats pipe_threads -t 4 /dev/stdin < ${WORK}/input.maf
+same_stats pipe_threads
+run_stats pipe_bgzf -t 4 /dev/stdin < ${WORK}/input.maf.gz
+same_stats pipe_bgzf
+
+# Blocks of rows far longer than the BGZF history first kept, where an
+# 'a' line is more than a thousand small blocks before the end of the
+# buffer fill it's in. The blocks found must be the same as in the text.
+awk 'BEGIN{
+   srand(1)
+   for(i = 0; i < 1024; ++i) bases = bases substr("ACGT",int(rand()*4)+1,1)
+   for(i = 0; i < 11; ++i) bases = bases bases
+   n = length(bases)
+   print "##maf version=1"
+   for(b = 0; b < 4; ++b){
+      printf "\na score=%d\n", b
+      printf "s hg38.chr1 %d %d + 100000000 %s\n", b*n, n, bases
+      printf "s mm10.chr2 %d %d + 100000000 %s\n", b*n, n, bases
+   }
+}' > ${WORK}/long.maf
+./bgzf_test -b 200 ${WORK}/long.maf ${WORK}/long.maf.gz \
+   || fail "bgzf_test exited nonzero"
+for f in long.maf long.maf.gz; do
+   ./maf_region -c 0 ${WORK}/$f hg38.chr1:5000000-5000010 \
+      mm10.chr2:1-10 > ${WORK}/$f.region 2> /dev/null \
+      || fail "maf_region $f exited nonzero"
+done
+cmp -s ${WORK}/long.maf.region ${WORK}/long.maf.gz.region \
+   && echo "ok: maf_region long BGZF" || fail "maf_region long BGZF differs from text"
+
+# Region queries through the array parser: read one block at a time or
+# through io_uring, with the block cache or without, from text or BGZF,
+# with the index built in memory or loaded from a .mafidx.
+REGIONS="Anc05.Anc05refChr2221_1:1-80 Anc05.Anc05refChr2221_500:1-40
+   croPor2.scaffold-1580_1000:20-60 Anc05.Anc05refChr2221_500:10-30
+   amaVit1.AOCU01257236_2000:1-80"
+run_region(){
+   local name=$1; shift
+   ./maf_region "$@" ${REGIONS} > ${WORK}/${name}.region \
+      || fail "maf_region $name exited nonzero"
+}
+same_region(){
+   cmp -s ${WORK}/text.region ${WORK}/$1.region \
+      && echo "ok: maf_region $1" || fail "maf_region $1 differs from text"
+}
+run_region text -c 0 ${WORK}/input.maf
+[ -s ${WORK}/text.region ] || fail "maf_region found no blocks"
+run_region cache ${WORK}/input.maf
+same_region cache
+# Blocks the overlapping regions share are read once, then come from
+# the cache.
+./maf_region -c 16 ${WORK}/input.maf ${REGIONS} 2>&1 > /dev/null \
+   | grep -q '^Block cache: [1-9][0-9]* hits, [1-9][0-9]* misses$' \
+   && echo "ok: maf_region cache hits" || fail "maf_region cache had no hits"
+./maf_region -c 0 ${WORK}/input.maf ${REGIONS} 2>&1 > /dev/null \
+   | grep -q '^Block cache' && fail "maf_region -c 0 printed cache stats"
+run_region bgzf -c 0 ${WORK}/input.maf.gz
+same_region bgzf
+run_region bgzf_cache ${WORK}/input.maf.gz
+same_region bgzf_cache
+./maf_index ${WORK}/input.maf > /dev/null || fail "maf_index exited nonzero"
+./maf_index ${WORK}/input.maf.gz > /dev/null || fail "maf_index exited nonzero"
+run_region index ${WORK}/input.maf
+same_region index
+run_region bgzf_index ${WORK}/input.maf.gz
+same_region bgzf_index
+rm -f ${WORK}/input.maf.mafidx ${WORK}/input.maf.gz.mafidx
+
+# Blocks read a batch at a time, by block count, by bytes and by both,
+# must be the blocks read one at a time.
+for limits in "1 0" "1024 0" "0 4096" "0 1048576" "100 65536"; do
+   ./parser_test batch ${WORK}/input.maf ${limits} \
+      && ./parser_test batch ${WORK}/long.maf ${limits} \
+      && echo "ok: batches of ${limits% *} blocks, ${limits#* } bytes" \
+      || fail "batches of ${limits% *} blocks, ${limits#* } bytes"
+done
+
+# Random blocks decoded on eight threads sharing one parser, from text
+# and BGZF, with a cache small enough to evict blocks still in use and
+# without, must be the blocks read in order. Also built with
+# ThreadSanitizer, which fails on any data race.
+head -n $(($(wc -l < ${MAF})*200)) ${WORK}/input.maf > ${WORK}/decode.maf
+./bgzf_test -b 2000 ${WORK}/decode.maf ${WORK}/decode.maf.gz \
+   || fail "bgzf_test exited nonzero"
+for f in decode.maf decode.maf.gz; do
+   for cache in 0 1048576; do
+      ./parser_test decode ${WORK}/${f} 8 ${cache} \
+         && TSAN_OPTIONS=halt_on_error=1 \
+            ./parser_test_tsan decode ${WORK}/${f} 8 ${cache} \
+         && echo "ok: decode_block on threads, ${f}, ${cache} byte cache" \
+         || fail "decode_block on threads, ${f}, ${cache} byte cache"
+   done
+done
+
+# With an index, conservomatic skips blocks without a row of the in
+# group genomes it writes out, which every fifth copy here lacks. The
+# output must be the same as reading every block without an index.
+awk '!/^s[ \t]+(amaVit1|croPor2|Anc05)\.[^ \t]*_[0-9]*[05][ \t]/' \
+   ${WORK}/input.maf > ${WORK}/skip.maf
+run_cons skip -t 1 ${WORK}/skip.maf
+./maf_index ${WORK}/skip.maf > /dev/null || fail "maf_index exited nonzero"
+for name in skip_index skip_index_threads; do
+   if [ ${name} = skip_index ]; then run_cons ${name} -t 1 ${WORK}/skip.maf
+   else run_cons ${name} -t 4 ${WORK}/skip.maf; fi
+   diff -r ${WORK}/skip ${WORK}/${name} > /dev/null \
+      && echo "ok: conservomatic ${name}" \
+      || fail "conservomatic ${name} differs from reading every block"
+done
+
+# A row cut short halfway through the file.
+BAD=$(grep -n '^s[[:space:]]*amaVit1' ${WORK}/input.maf \
+   | sed -n "$((COPIES*2))p" | cut -d: -f1)
+sed "${BAD}s/^.*\$/s amaVit1.broken 1/" ${WORK}/input.maf > ${WORK}/bad.maf
+must_fail "conservomatic bad row" ${SRC}/conservomatic ${CONSARGS} bad.maf
+must_fail "conservomatic -t 4 bad row" ${SRC}/conservomatic ${CONSARGS} -t 4 bad.maf
+must_fail "maf_stats bad row" ${SRC}/maf_stats bad.maf
+must_fail "maf_stats -t 4 bad row" ${SRC}/maf_stats -t 4 bad.maf
+
+# A corrupt BGZF block halfway through the file.
+cp ${WORK}/input.maf.gz ${WORK}/bad.maf.gz
+SIZE=$(wc -c < ${WORK}/bad.maf.gz)
+printf '\377' | dd of=${WORK}/bad.maf.gz bs=1 seek=$((SIZE/2)) conv=notrunc \
+   2> /dev/null
+must_fail "conservomatic corrupt BGZF" ${SRC}/conservomatic ${CONSARGS} bad.maf.gz
+must_fail "maf_stats corrupt BGZF" ${SRC}/maf_stats bad.maf.gz
+must_fail "maf_stats -t 4 corrupt BGZF" ${SRC}/maf_stats -t 4 bad.maf.gz
+
+exit ${FAILED}
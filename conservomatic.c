@@ -9,6 +9,8 @@
 #include <getopt.h>
 
 #include "mafparser.h"
+#include "parallel.h"
+#include "mafbin.h"
 
 typedef struct _genome{
    int num_scaffolds;
@@ -36,6 +38,11 @@ char **genome_names;
 int genomes_size;
 int genomes_max;
 hash genomes;
+//Scaffolds by the src IDs of rows, NULL for species not outputted.
+scaffold *scaffolds_by_id;
+char *scaffolds_seen;
+uint32_t scaffolds_by_id_max;
+int num_threads;
 
 //Define long options, note that options with 'no_argument'
 //specified do require arguments, no_argument specification
@@ -46,6 +53,7 @@ static struct option long_options[]={
 {"out-group",no_argument,0,'o'},
 {"in-group",no_argument,0,'i'},
 {"output-genomes",no_argument,0,'g'},
+{"threads",required_argument,0,'t'},
 {0,0,0,0}
   };
  
@@ -105,35 +113,28 @@ void clean_up(){
    hdestroy_r(genomes);
    free(genomes);
    free(genome_names);
+   free(scaffolds_by_id);
+   free(scaffolds_seen);
 }
 
 
 void species_filter(alignment_block aln, char **species, 
              int num_species){
    if(aln==NULL) return;
-   seq *new_sequences = malloc(sizeof(**new_sequences)*num_species);
-   assert(new_sequences!=NULL);
+//Sequences stay in the block's arena, only the array is rebuilt.
+   seq *new_sequences = arena_alloc(aln->mem,sizeof(*new_sequences)*num_species);
    int size=0;
-   char *species_name;
-   char *temp;
-   int cmp;
+   seq curr_seq;
    for(int i=0; i < num_species;++i){
       for(int j = 0; j < aln->size;++j){
-         temp=strdup(aln->sequences[j]->src);
-         assert(temp!=NULL);
-         species_name=strtok(temp,".");
-         cmp=strcmp(species_name,species[i]);
-         free(temp);
-         if(cmp==0){
-            new_sequences[size++]=copy_sequence(aln->sequences[j]);
+         curr_seq=aln->sequences[j];
+         if(in_list_n(curr_seq->species,curr_seq->species_len,
+               &species[i],1)){
+            new_sequences[size++]=curr_seq;
             break;
          }
       }
    }
-   for(int i =0; i < aln->size; ++i){
-      free_sequence(aln->sequences[i]);
-   }
-   free(aln->sequences);
    aln->sequences=new_sequences;
    aln->size = size;
    aln->max = num_species;
@@ -147,7 +148,7 @@ void parse_args(int argc, char **argv){
    }
    char c;
    int option_index=0;
-   while((c=getopt_long(argc,argv,"x:z:iog",long_options,&option_index))!= -1){
+   while((c=getopt_long(argc,argv,"x:z:iogt:",long_options,&option_index))!= -1){
       switch(c){
          case 'i':
             if(argv[optind][0]=='-'){
@@ -155,7 +156,9 @@ void parse_args(int argc, char **argv){
                exit(1);
             }
             do{
-               if(strcasestr(argv[optind],".maf")!=NULL) return;
+//The genomes end at the first MAF file or @ file list.
+               if(strcasestr(argv[optind],".maf")!=NULL
+                     || argv[optind][0]=='@') return;
                if(in_size == in_max){
                   in_max*=2;
                   in_group=realloc(in_group,
@@ -170,7 +173,9 @@ void parse_args(int argc, char **argv){
                exit(1);
             }
             do{
-               if(strcasestr(argv[optind],".maf")!=NULL) return;
+//The genomes end at the first MAF file or @ file list.
+               if(strcasestr(argv[optind],".maf")!=NULL
+                     || argv[optind][0]=='@') return;
                if(out_size == out_max){
                   out_max *=2;
                   out_group=realloc(out_group,
@@ -185,7 +190,9 @@ void parse_args(int argc, char **argv){
                exit(1);
             }
             do{
-               if(strcasestr(argv[optind],".maf")!=NULL) return;
+//The genomes end at the first MAF file or @ file list.
+               if(strcasestr(argv[optind],".maf")!=NULL
+                     || argv[optind][0]=='@') return;
                if(genomes_size == genomes_max){
                   genomes_max *=2;
                   genome_names=realloc(genome_names,
@@ -216,6 +223,17 @@ void parse_args(int argc, char **argv){
                exit(1);
             }
             break;
+         case 't':
+            if(optarg==NULL || optarg[0]=='-'){
+               fprintf(stderr, "--threads parameter requires one argument\n");
+               exit(1);
+            }
+            num_threads=atoi(optarg);
+            if(num_threads < 1){
+               fprintf(stderr, "Invalid number of threads: %s\n",optarg);
+               exit(1);
+            }
+            break;
          case '?':
 	   //	   if(optopt == NULL) fprintf(stderr,"Invalid long option: %s\n",argv[optind-1]);
 	   //           else fprintf(stderr, "Invalid short option: %s\n", optopt);
@@ -225,16 +243,112 @@ void parse_args(int argc, char **argv){
 }
 
 
+//Scaffold a sequence's conservation is written to, adding it to its
+//genome on first sight, or NULL if its species isn't being outputted.
+scaffold find_scaffold(seq curr_seq){
+   ENTRY *ret_val;
+   int hc;
+   if(!in_list_n(curr_seq->species,curr_seq->species_len,genome_names,
+          genomes_size)) return NULL;
+//Sequences are views into the mapped file, so copy the names out
+//before using them as hash keys.
+   char species_name[curr_seq->species_len+1];
+   memcpy(species_name,curr_seq->species,curr_seq->species_len);
+   species_name[curr_seq->species_len]='\0';
+   char scaffold_name[curr_seq->scaffold_len+1];
+   memcpy(scaffold_name,curr_seq->scaffold,curr_seq->scaffold_len);
+   scaffold_name[curr_seq->scaffold_len]='\0';
+//If so, get scaffold name and genome struct.
+   ret_val=search_hash(species_name,ret_val,genomes);
+   genome curr_gen = ret_val->data;
+//Check if scaffold is in species genome struct already.
+   ret_val=search_hash(scaffold_name,ret_val,curr_gen->scaffolds);
+   if(ret_val != NULL) return ret_val->data;
+//If ret_val is NULL, need to add entry for this scaffold
+   if(curr_gen->num_scaffolds >= curr_gen->max_scaffolds){
+      fprintf(stderr, "WARNING: Scaffold hash table over half full"
+                      " consider increasing max alignment hash size"
+                      " to avoid decreased performance or crashes.\n"
+                      "Species: %s\nCurrent size: %d\nMax size: %d\n"
+                      ,curr_gen->species,curr_gen->num_scaffolds
+                      ,curr_gen->max_scaffolds);
+   }
+   scaffold new_scaf= malloc(sizeof(*new_scaf));
+   assert(new_scaf != NULL);
+   new_scaf->length = curr_seq->srcSize;
+   new_scaf->sequence =  malloc(new_scaf->length*sizeof(char));
+   assert(new_scaf->sequence != NULL);
+   memset(new_scaf->sequence,48,new_scaf->length*sizeof(char));
+   ENTRY search={strdup(scaffold_name),new_scaf};
+   assert(search.key != NULL);
+   hc=hsearch_r(search,ENTER,&ret_val,curr_gen->scaffolds);
+   if(hc == 0){
+      fprintf(stderr,"Error inserting into hash table: %s\n", strerror(errno));
+      exit(1);
+   }
+   curr_gen->scaffold_names[curr_gen->num_scaffolds++]=
+         strdup(scaffold_name);
+   assert(curr_gen->scaffold_names[curr_gen->num_scaffolds-1] != NULL);
+   return new_scaf;
+}
+
+//Same as find_scaffold, but the result is kept in a flat array indexed
+//by the row's src ID, so each species.scaffold is hashed only once.
+scaffold get_scaffold(seq curr_seq){
+   uint32_t id = curr_seq->src_id;
+   if(id == NO_ID) return find_scaffold(curr_seq);
+   if(id >= scaffolds_by_id_max){
+      uint32_t new_max = scaffolds_by_id_max ? scaffolds_by_id_max : 256;
+      while(new_max <= id) new_max *= 2;
+      scaffolds_by_id = realloc(scaffolds_by_id,
+         new_max*sizeof(*scaffolds_by_id));
+      scaffolds_seen = realloc(scaffolds_seen,new_max);
+      assert(scaffolds_by_id != NULL && scaffolds_seen != NULL);
+      memset(scaffolds_seen+scaffolds_by_id_max,0,
+         new_max-scaffolds_by_id_max);
+      scaffolds_by_id_max = new_max;
+   }
+   if(!scaffolds_seen[id]){
+      scaffolds_by_id[id] = find_scaffold(curr_seq);
+      scaffolds_seen[id] = 1;
+   }
+   return scaffolds_by_id[id];
+}
+
+//What each base counts towards when scoring a column: A, G, C, T and gaps
+//have counts of their own, other bases are observed without adding to a
+//count and Ns are ignored.
+enum base_class{ CLASS_A, CLASS_G, CLASS_C, CLASS_T, CLASS_GAP, CLASS_OTHER,
+      CLASS_N };
+
+static const unsigned char code_classes[16] = {
+   [BASE_A] = CLASS_A, [BASE_C] = CLASS_C, [BASE_G] = CLASS_G,
+   [BASE_T] = CLASS_T, [BASE_N] = CLASS_N, [BASE_GAP] = CLASS_GAP,
+   [BASE_R ... BASE_V] = CLASS_OTHER
+};
+
+//Class of a row's base, read straight from the packed form when the row
+//was packed.
+static inline int base_class(seq row, unsigned int base){
+   if(row->packed != NULL) return code_classes[base_at(row,base)];
+   switch(toupper(row->sequence[base])){
+      case 'A': return CLASS_A;
+      case 'G': return CLASS_G;
+      case 'C': return CLASS_C;
+      case 'T': return CLASS_T;
+      case '-': return CLASS_GAP;
+      case 'N': return CLASS_N;
+      default: return CLASS_OTHER;
+   }
+}
+
 void process_block(sorted_alignment_block aln){
-   int counts[5] = {0};
+   int counts[CLASS_N] = {0};
    int itor;
-   int hc = 0;
    int num_found;
    int offset;
    double in_score;
    double out_score;
-   ENTRY *ret_val;
-   char c;
    char cons_string[aln->seq_length];
 //   memset(cons_string,0,aln->seq_length*sizeof(int));
 //Check conservation base by base, starting with in group species.
@@ -245,30 +359,9 @@ void process_block(sorted_alignment_block aln){
       in_score=0.0;
       out_score=0.0;
       for(;itor < aln->in_size;++itor){
-         c=toupper(aln->in_sequences[itor]->sequence[base]);
-         switch(c){
-            case 'A':
-                     ++counts[0];
-                     break;
-            case 'G':
-                     ++counts[1];
-                     break;
-            case 'C':
-                     ++counts[2];
-                     break;
-            case 'T':
-                     ++counts[3];
-                     break;
-            case '-':
-                     ++counts[4];
-                     break;
-            case 'N':
-                     continue;
-            default:
-	      //fprintf(stderr,"Nonstandard base encountered: %c\n",c);
-  	      //return;
-                     break;        
-         }                   
+         int class = base_class(aln->in_sequences[itor],base);
+         if(class == CLASS_N) continue;
+         ++counts[class];
          ++num_found;
       }  
 //Get highest count found in this position, check if highest count over
@@ -288,30 +381,9 @@ void process_block(sorted_alignment_block aln){
       num_found = 0;
       memset(counts,0,sizeof(counts));
       for(itor=0;itor < aln->out_size;++itor){
-         c=toupper(aln->out_sequences[itor]->sequence[base]);
-         switch(c){
-            case 'A':
-                     ++counts[0];
-                     break;
-            case 'G':
-                     ++counts[1];
-                     break;
-            case 'C':
-                     ++counts[2];
-                     break;
-            case 'T':
-                     ++counts[3];
-                     break;
-            case '-':
-                     ++counts[4];
-                     break;
-            case 'N':
-                     continue;
-            default:
-	      //fprintf(stderr,"Nonstandard base encountered: %c\n",c);
-	      //return;
-	      break;
-         }
+         int class = base_class(aln->out_sequences[itor],base);
+         if(class == CLASS_N) continue;
+         ++counts[class];
          ++num_found;
       }
       if(num_found < 1){
@@ -325,42 +397,9 @@ void process_block(sorted_alignment_block aln){
 //Now that we have the completed conservation string, we can add it
 //to the appropriate scaffold in the corresponding genome.
    for(itor=0; itor < aln->in_size; ++itor){
-//First check if species genome is being outputted.
-//If not, continue.
-      if(!in_list(aln->in_sequences[itor]->species,genome_names,
-             genomes_size)) continue;
-//If so, get scaffold name and genome struct.
-      ret_val=search_hash(aln->in_sequences[itor]->species,ret_val,genomes);
-      genome curr_gen = ret_val->data;
-//Check if scaffold is in species genome struct already.
-      ret_val=search_hash(aln->in_sequences[itor]->scaffold,ret_val,curr_gen->scaffolds);
-//If ret_val is NULL, need to add entry for this scaffold
-      if(ret_val == NULL){
-         if(curr_gen->num_scaffolds >= curr_gen->max_scaffolds){
-            fprintf(stderr, "WARNING: Scaffold hash table over half full"
-                            " consider increasing max alignment hash size"
-                            " to avoid decreased performance or crashes.\n"
-                            "Species: %s\nCurrent size: %d\nMax size: %d\n"
-                            ,curr_gen->species,curr_gen->num_scaffolds
-                            ,curr_gen->max_scaffolds);
-         }
-         scaffold new_scaf= malloc(sizeof(*new_scaf));
-         assert(new_scaf != NULL);
-         new_scaf->length = aln->in_sequences[itor]->srcSize;
-         new_scaf->sequence =  malloc(new_scaf->length*sizeof(char));
-         assert(new_scaf->sequence != NULL);
-         memset(new_scaf->sequence,48,new_scaf->length*sizeof(char));
-         ENTRY search={strdup(aln->in_sequences[itor]->scaffold),new_scaf};
-	 assert(search.key != NULL);
-         hc=hsearch_r(search,ENTER,&ret_val,curr_gen->scaffolds);
-         if(hc == 0){
-            fprintf(stderr,"Error inserting into hash table: %s\n", strerror(errno));
-            exit(1);
-         }
-         curr_gen->scaffold_names[curr_gen->num_scaffolds++]=
-               strdup(aln->in_sequences[itor]->scaffold);
-         assert(curr_gen->scaffold_names[curr_gen->num_scaffolds-1] != NULL);
-      }
+      scaffold curr_scaf = get_scaffold(aln->in_sequences[itor]);
+//If species genome isn't being outputted, continue.
+      if(curr_scaf == NULL) continue;
 //If scaffold entry already present, or after inserting new entry,
 //write to scaffold stream in appropriate position.
 //      print_sequence(aln->in_sequences[itor]);
@@ -370,11 +409,11 @@ void process_block(sorted_alignment_block aln){
 //copy over those numbers that correspond to existing bases.
       offset=0;
       if(aln->in_sequences[itor]->size == aln->seq_length)
-            memcpy(((scaffold)ret_val->data)->sequence+insert_pos,
+            memcpy(curr_scaf->sequence+insert_pos,
                    cons_string,aln->seq_length*sizeof(char));
       else for(int i = 0; i < aln->seq_length; ++i){
 	  if(aln->in_sequences[itor]->sequence[i] != '-'){
-	     memcpy(((scaffold)ret_val->data)->sequence+insert_pos+offset,
+	     memcpy(curr_scaf->sequence+insert_pos+offset,
                    cons_string+i,sizeof(char));
 	     ++offset;
 	  }
@@ -444,16 +483,25 @@ int main(int argc, char **argv){
    genome_names = malloc(sizeof(char *)*2);
    genomes_size=0;
    genomes_max=2;
+   num_threads=1;
    parse_args(argc,argv);
    if(optind >= argc){
       fprintf(stderr, "Missing required MAF filename\n");
       exit(1);
    }
-   char *filename = argv[optind];
-   FILE *maf_file;
-   if((maf_file= fopen(filename, "rb")) == NULL){
+//Every argument left is a MAF file, or @ and a file listing them. Many
+//files are parsed as one, their conservation going to the same tracks.
+   int num_files;
+   char **filenames = read_file_args(argv+optind,argc-optind,&num_files);
+   if(filenames == NULL) exit(1);
+   if(num_files == 0){
+      fprintf(stderr, "Missing required MAF filename\n");
+      exit(1);
+   }
+   FILE *maf_file = NULL;
+   if(num_files == 1 && (maf_file= fopen(filenames[0], "rb")) == NULL){
       fprintf(stderr, "Unable to open file: %s\nError: %s",
-         filename,strerror(errno));
+         filenames[0],strerror(errno));
       return 1;
    }
    for(int i = 0; i < in_size; ++i) printf("%s\n", in_group[i]);
@@ -461,7 +509,7 @@ int main(int argc, char **argv){
    for(int i = 0; i < genomes_size; ++i) printf("%s\n", genome_names[i]);
    printf("In Group Threshold: %g\n", in_cons_thresh);
    printf("Out Group Threshold: %g\n", out_cons_thresh);
-   printf("Filename: %s\n",filename);
+   for(int i = 0; i < num_files; ++i) printf("Filename: %s\n",filenames[i]);
    genomes = calloc(1,sizeof(struct hsearch_data));
    assert(genomes != NULL);
    int hc = hcreate_r(16,genomes);
@@ -494,14 +542,37 @@ int main(int argc, char **argv){
         }
        printf("Entry inserted: %s\n", genome_names[i]);
    }
-   maf_linear_parser parser = get_linear_parser(maf_file,filename);
+//Binary MAFs written by maf2bin are read in place, text MAFs are
+//parsed on num_threads threads.
+   mafbin_reader bin_reader = NULL;
+   maf_parallel_parser parser = NULL;
+   if(maf_file != NULL && is_mafbin(maf_file)){
+      bin_reader = get_mafbin_reader(maf_file,filenames[0]);
+      if(bin_reader == NULL) exit(1);
+   }else{
+      parser = maf_file != NULL
+         ? get_parallel_parser(maf_file,filenames[0],num_threads,1)
+         : get_parallel_files(filenames,num_files,num_threads,1);
+      if(parser == NULL) exit(1);
+      parallel_pack_sequences(parser,1);
+//Only in group rows of the genomes written out are ever stored, so
+//with an index, blocks with none of those species are skipped unread.
+      char *wanted[in_size+1];
+      int num_wanted = 0;
+      for(int i = 0; i < in_size; ++i)
+         if(in_list(in_group[i],genome_names,genomes_size))
+            wanted[num_wanted++] = in_group[i];
+      parallel_block_filter(parser,wanted,num_wanted);
+   }
    while(1){
-      sorted_alignment_block aln = get_sorted_alignment(parser,in_group
-                  ,in_size,out_group,out_size);
+      sorted_alignment_block aln = bin_reader != NULL
+         ? mafbin_next_sorted(bin_reader,in_group,in_size,out_group,out_size)
+         : parallel_next_sorted(parser,in_group,in_size,out_group,out_size);
       if(aln==NULL)break;
       process_block(aln);
       free_sorted_alignment(aln);
    }
+   if(parser != NULL && parser->error) exit(1);
   // print_genomes();
    write_genomes();
 /*   for(int i = 0; i < genomes_size; ++i){
@@ -513,8 +584,10 @@ int main(int argc, char **argv){
            printf("\t%s   %s\n",ret_val->key,(char *)ret_val->data);
       }
    }*/
-   free_linear_parser(parser);
-   fclose(maf_file);
+   if(parser != NULL) free_parallel_parser(parser);
+   free_mafbin_reader(bin_reader);
+   if(maf_file != NULL) fclose(maf_file);
+   free_file_args(filenames,num_files);
    clean_up();
    return 0;
 }
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "intern.h"
+
+static inline uint32_t intern_hash(const char *str, size_t len){
+   uint32_t hash = 2166136261u;
+   for(size_t i = 0; i < len; ++i) hash = (hash^(unsigned char)str[i])*16777619u;
+   return hash;
+}
+
+intern_table new_intern_table(){
+   intern_table table = malloc(sizeof(*table));
+   assert(table != NULL);
+   pthread_rwlock_init(&table->lock,NULL);
+   table->num_slots = 256;
+   table->slots = calloc(table->num_slots,sizeof(*table->slots));
+   assert(table->slots != NULL);
+   table->size = 0;
+   table->max = 64;
+   table->strings = malloc(table->max*sizeof(*table->strings));
+   table->lens = malloc(table->max*sizeof(*table->lens));
+   table->hashes = malloc(table->max*sizeof(*table->hashes));
+   assert(table->strings != NULL && table->lens != NULL
+      && table->hashes != NULL);
+   return table;
+}
+
+//Slot holding str, or the empty slot it would go in.
+static uint32_t find_slot(intern_table table, const char *str, size_t len,
+      uint32_t hash){
+   uint32_t mask = table->num_slots-1;
+   uint32_t slot = hash & mask;
+   while(table->slots[slot] != 0){
+      uint32_t id = table->slots[slot]-1;
+      if(table->hashes[id] == hash && table->lens[id] == len
+            && !memcmp(table->strings[id],str,len))
+         return slot;
+      slot = (slot+1) & mask;
+   }
+   return slot;
+}
+
+static void grow_slots(intern_table table){
+   table->num_slots *= 2;
+   free(table->slots);
+   table->slots = calloc(table->num_slots,sizeof(*table->slots));
+   assert(table->slots != NULL);
+   uint32_t mask = table->num_slots-1;
+   for(uint32_t id = 0; id < table->size; ++id){
+      uint32_t slot = table->hashes[id] & mask;
+      while(table->slots[slot] != 0) slot = (slot+1) & mask;
+      table->slots[slot] = id+1;
+   }
+}
+
+//ID of the string of len bytes, which need not be NUL terminated,
+//interning it if it's new.
+uint32_t intern_string(intern_table table, const char *str, size_t len){
+   uint32_t hash = intern_hash(str,len);
+   pthread_rwlock_rdlock(&table->lock);
+   uint32_t id = table->slots[find_slot(table,str,len,hash)];
+   pthread_rwlock_unlock(&table->lock);
+   if(id != 0) return id-1;
+//Another thread may have added it before the write lock was taken.
+   pthread_rwlock_wrlock(&table->lock);
+   uint32_t slot = find_slot(table,str,len,hash);
+   if(table->slots[slot] != 0){
+      id = table->slots[slot]-1;
+      pthread_rwlock_unlock(&table->lock);
+      return id;
+   }
+   if(table->size == table->max){
+      table->max *= 2;
+      table->strings = realloc(table->strings,table->max*sizeof(*table->strings));
+      table->lens = realloc(table->lens,table->max*sizeof(*table->lens));
+      table->hashes = realloc(table->hashes,table->max*sizeof(*table->hashes));
+      assert(table->strings != NULL && table->lens != NULL
+         && table->hashes != NULL);
+   }
+   id = table->size++;
+   table->strings[id] = strndup(str,len);
+   assert(table->strings[id] != NULL);
+   table->lens[id] = len;
+   table->hashes[id] = hash;
+   table->slots[slot] = id+1;
+   if(2*table->size > table->num_slots) grow_slots(table);
+   pthread_rwlock_unlock(&table->lock);
+   return id;
+}
+
+//The NUL terminated string interned as id, valid until the table is
+//freed.
+char *interned_string(intern_table table, uint32_t id){
+   pthread_rwlock_rdlock(&table->lock);
+   char *str = id < table->size ? table->strings[id] : NULL;
+   pthread_rwlock_unlock(&table->lock);
+   return str;
+}
+
+uint32_t intern_size(intern_table table){
+   pthread_rwlock_rdlock(&table->lock);
+   uint32_t size = table->size;
+   pthread_rwlock_unlock(&table->lock);
+   return size;
+}
+
+void free_intern_table(intern_table table){
+   if(table == NULL) return;
+   for(uint32_t id = 0; id < table->size; ++id) free(table->strings[id]);
+   free(table->strings);
+   free(table->lens);
+   free(table->hashes);
+   free(table->slots);
+   pthread_rwlock_destroy(&table->lock);
+   free(table);
+}
@@ -0,0 +1,33 @@
+#ifndef __INTERN_H
+#define __INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//ID of names that were never interned, e.g. rows from get_sequence.
+#define NO_ID UINT32_MAX
+
+//Table giving each distinct string a dense ID, 0 for the first string
+//interned, 1 for the next and so on. Parsers of one file share a table
+//across threads, so lookups take a read lock and only new strings take
+//the write lock.
+typedef struct _intern_table{
+	pthread_rwlock_t lock;
+//Open addressing table of ID+1, 0 for an empty slot.
+	uint32_t *slots;
+	uint32_t num_slots;
+	char **strings;
+	uint32_t *lens;
+	uint32_t *hashes;
+	uint32_t size;
+	uint32_t max;
+}*intern_table;
+
+intern_table new_intern_table();
+uint32_t intern_string(intern_table table, const char *str, size_t len);
+char *interned_string(intern_table table, uint32_t id);
+uint32_t intern_size(intern_table table);
+void free_intern_table(intern_table table);
+
+#endif
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "mafparser.h"
+#include "mafbin.h"
+
+//Convert a MAF file to the binary format read by get_mafbin_reader,
+//written to <file>.mafbin unless another filename is given.
+int main(int argc, char **argv){
+   if(argc < 2){
+      fprintf(stderr,"Usage: %s <maf file> [binary file]\n",argv[0]);
+      return 1;
+   }
+   char *filename = argv[1];
+   FILE *maf_file;
+   if((maf_file= fopen(filename, "rb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s",
+         filename,strerror(errno));
+      return 1;
+   }
+   char *bin_filename;
+   if(argc > 2) bin_filename = strdup(argv[2]);
+   else{
+      bin_filename = malloc(strlen(filename)+strlen(MAFBIN_EXTENSION)+1);
+      if(bin_filename != NULL){
+         strcpy(bin_filename,filename);
+         strcat(bin_filename,MAFBIN_EXTENSION);
+      }
+   }
+   if(bin_filename == NULL){
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   maf_linear_parser parser = get_mmap_parser(maf_file,filename);
+   if(write_mafbin(parser,bin_filename) != 0) return 1;
+   printf("Converted: %s\n",bin_filename);
+   free_linear_parser(parser);
+   free(bin_filename);
+   fclose(maf_file);
+   return 0;
+}
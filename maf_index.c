@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "mafparser.h"
+#include "mafindex.h"
+
+//Build the block index for a MAF file, written to <file>.mafidx unless
+//another index filename is given.
+int main(int argc, char **argv){
+   if(argc < 2){
+      fprintf(stderr,"Usage: %s <maf file> [index file]\n",argv[0]);
+      return 1;
+   }
+   char *filename = argv[1];
+   FILE *maf_file;
+   if((maf_file= fopen(filename, "rb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s",
+         filename,strerror(errno));
+      return 1;
+   }
+   char *index_filename = argc > 2 ? strdup(argv[2]) : get_index_filename(filename);
+   maf_index index = build_maf_index(maf_file,filename);
+   if(index == NULL || write_maf_index(index,index_filename) != 0) return 1;
+   printf("Indexed %llu blocks: %s\n",(unsigned long long)index->num_blocks,
+      index_filename);
+   free_maf_index(index);
+   free(index_filename);
+   fclose(maf_file);
+   return 0;
+}
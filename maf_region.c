@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mafparser.h"
+#include "blockcache.h"
+#include "arena.h"
+
+//Print the blocks of a MAF file overlapping each region given, as
+//species.scaffold:start-end with 1-based inclusive coordinates. Blocks
+//are cached, up to -c megabytes of them, so regions that overlap don't
+//read their shared blocks again. -c 0 reads every block from the file.
+//Given -c, the cache's hits and misses are printed to stderr at the end.
+int main(int argc, char **argv){
+   size_t cache_bytes = BLOCK_CACHE_BYTES;
+   int print_stats = 0;
+   int c;
+   while((c = getopt(argc,argv,"c:")) != -1){
+      if(c != 'c'){
+         optind = argc;
+         break;
+      }
+      char *end;
+      unsigned long long megabytes = strtoull(optarg,&end,10);
+      if(*end != '\0' || end == optarg){
+         fprintf(stderr, "Invalid cache size: %s\n",optarg);
+         return 1;
+      }
+      cache_bytes = megabytes << 20;
+      print_stats = 1;
+   }
+   if(argc-optind < 2){
+      fprintf(stderr,"Usage: %s [-c cache MB] <maf file> <region> "
+         "[region ...]\n"
+         "Each cached block takes at least %dKB of the cache.\n",argv[0],
+         ARENA_MIN_CHUNK >> 10);
+      return 1;
+   }
+   char *filename = argv[optind];
+   FILE *maf_file;
+   if((maf_file= fopen(filename, "rb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s",
+         filename,strerror(errno));
+      return 1;
+   }
+   maf_array_parser parser = get_array_parser(maf_file,filename);
+   if(parser == NULL) return 1;
+   set_block_cache(parser,cache_bytes);
+   for(int i = optind+1; i < argc; ++i){
+      maf_region_query query = get_region_query(parser,argv[i]);
+      if(query == NULL) continue;
+      alignment_block aln;
+      while((aln = region_next_alignment(query)) != NULL){
+         print_alignment(aln);
+         free_alignment_block(aln);
+      }
+      free_region_query(query);
+   }
+   if(print_stats && parser->cache != NULL){
+      uint64_t hits, misses;
+      cache_stats(parser->cache,&hits,&misses);
+      fprintf(stderr,"Block cache: %llu hits, %llu misses\n",
+         (unsigned long long)hits,(unsigned long long)misses);
+   }
+   free_array_parser(parser);
+   fclose(maf_file);
+   return 0;
+}
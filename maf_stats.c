@@ -9,6 +9,8 @@
 #include <getopt.h>
 
 #include "mafparser.h"
+#include "parallel.h"
+#include "mafbin.h"
 
 typedef struct _block{
    unsigned int num_blocks;
@@ -34,19 +36,25 @@ hash total_species_stats;
 char **species_in_stats;
 int num_spec;
 block_stats block;
-hash temp_counts;
-char **species_seen;
+//Rows of the current block and stats of each species, indexed by the
+//parser's species IDs.
+unsigned int *counts_by_id;
+species_stats *stats_by_id;
+uint32_t max_ids;
+//Species IDs of the current block in the order first seen, with its
+//row count and length.
+uint32_t *species_seen;
 unsigned int num_species_seen;
+unsigned int max_species_seen;
+unsigned int block_rows;
+unsigned int block_length;
+int num_threads;
 
 //Define long options, note that options with 'no_argument'
 //specified do require arguments, no_argument specification
 //necessary for reading in variable size list of arguments.
 static struct option long_options[]={
-{"in-thresh",required_argument,0,'x'},
-{"out-thresh",required_argument,0,'z'},
-{"out-group",no_argument,0,'o'},
-{"in-group",no_argument,0,'i'},
-{"output-genomes",no_argument,0,'g'},
+{"threads",required_argument,0,'t'},
 {0,0,0,0}
   };
  
@@ -65,10 +73,10 @@ block_stats new_block_stats(){
    return block;
 }
 
-species_stats new_species_stats(char *species_name){
+species_stats new_species_stats(char *species_name, size_t len){
    species_stats species = malloc(sizeof(struct _species));
    assert(species != NULL);
-   species->species = strdup(species_name);
+   species->species = strndup(species_name,len);
    assert(species->species != NULL);
    species->seqs_per_block = malloc(sizeof(unsigned int) * 256);
    assert(species->seqs_per_block != NULL);
@@ -94,58 +102,72 @@ ENTRY *search_hash(char *key, ENTRY *ret_val, hash table){
 
 
 
-void process_block(alignment_block aln){
+//Make room in the per species ID arrays for id.
+void grow_ids(uint32_t id){
+   uint32_t new_max = max_ids ? max_ids : 256;
+   while(new_max <= id) new_max *= 2;
+   counts_by_id = realloc(counts_by_id,new_max*sizeof(*counts_by_id));
+   stats_by_id = realloc(stats_by_id,new_max*sizeof(*stats_by_id));
+   assert(counts_by_id != NULL && stats_by_id != NULL);
+   memset(counts_by_id+max_ids,0,(new_max-max_ids)*sizeof(*counts_by_id));
+   memset(stats_by_id+max_ids,0,(new_max-max_ids)*sizeof(*stats_by_id));
+   max_ids = new_max;
+}
+
+void begin_block(){
+   num_species_seen = 0;
+   block_rows = 0;
+   block_length = 0;
+}
+
+//Count the rows of each species in flat arrays indexed by the species
+//IDs the parser gives rows, remembering the order species were seen.
+//Rows may be views that don't outlive the call, so a species' stats are
+//made, with a copy of its name, from its first row.
+void count_row(seq curr_seq){
+   if(block_rows++ == 0) block_length = curr_seq->sequence_len;
+   uint32_t id = curr_seq->species_id;
+   if(id >= max_ids) grow_ids(id);
+   if(counts_by_id[id]++ != 0) return;
+   if(num_species_seen == max_species_seen){
+      max_species_seen = max_species_seen ? 2*max_species_seen : 256;
+      species_seen = realloc(species_seen,max_species_seen*sizeof(uint32_t));
+      assert(species_seen != NULL);
+   }
+   species_seen[num_species_seen++] = id;
+   if(stats_by_id[id] == NULL)
+      stats_by_id[id] = new_species_stats(curr_seq->species,
+            curr_seq->species_len);
+}
+
+void end_block(){
    ENTRY *ret_val;
    species_stats curr_stats;
-   seq curr_seq;
    unsigned int curr_count;
-   num_species_seen=0;
-   int hc = hcreate_r(256,temp_counts);
-   if(hc == 0){
-      fprintf(stderr,"Failed to create hash table: %s\n", strerror(errno));
-      exit(1);
-   }
-   printf("%d\n",aln->size);
-   for(int i = 0; i < aln->size; ++i){
-      curr_seq = aln->sequences[i];
-//Check if species already has an entry in counts table, if not, add one
-      ret_val = search_hash(curr_seq->species,ret_val,temp_counts);
-      if(ret_val == NULL){
-          unsigned int *count;
-          *count=0;
-          ENTRY insert={curr_seq->species,count};
-          hc = hsearch_r(insert,ENTER,&ret_val,temp_counts);
-          if(hc == 0){
-             fprintf(stderr,"Error inserting into hash table: %s\n", strerror(errno));
-             exit(1);
-          }
-          species_seen[num_species_seen++]=curr_seq->species;
-        //  printf("Entry inserted for species: %s\n", curr_seq->species);    
-      }
-      ++(*((unsigned int *)ret_val->data));
-    //  printf("%u\n",(*((unsigned int *)ret_val->data)));
-   }
+   int hc;
+   printf("%u\n",block_rows);
 //Next we need to add the temp counts to our overall counts.
    for(unsigned int i = 0; i < num_species_seen; ++i){
-//First get the count.
-      printf("%s\n",species_seen[i]);
-      ret_val = search_hash(species_seen[i],ret_val,temp_counts);
-      curr_count = (*(unsigned int *)ret_val->data);
-//Check if species already has an entry in stats hash table, if not, add an entry
-      ret_val = search_hash(species_seen[i],ret_val,total_species_stats);
-      if(ret_val == NULL){
-          species_stats stats = new_species_stats(curr_seq->species);
-          ENTRY insert={strdup(species_seen[i]),stats};
+//First get the count, and reset it for the next block.
+      uint32_t id = species_seen[i];
+      curr_count = counts_by_id[id];
+      counts_by_id[id] = 0;
+      curr_stats = stats_by_id[id];
+      char *species_name = curr_stats->species;
+      printf("%s\n",species_name);
+//Stats with no blocks yet were made for this block, so add an entry to
+//the stats hash table.
+      if(curr_stats->num_seqs == 0){
+          ENTRY insert={strdup(species_name),curr_stats};
           hc = hsearch_r(insert,ENTER,&ret_val,total_species_stats);
           if(hc == 0){
              fprintf(stderr,"Error inserting into hash table: %s\n", strerror(errno));
              exit(1);
           }
-          species_in_stats[num_spec++]=strdup(species_seen[i]);
+          species_in_stats[num_spec++]=strdup(species_name);
           printf("New species found: %s\n", species_in_stats[num_spec-1]);
       }
-      else printf("Already in there: %s\n", species_seen[i]);
-      curr_stats = ((species_stats)ret_val->data);
+      else printf("Already in there: %s\n", species_name);
 //Insert new count of sequences in block to end of array,
 //doubling array if necessary
       if(curr_stats->num_seqs == curr_stats->max_seqs){
@@ -160,23 +182,48 @@ void process_block(alignment_block aln){
         curr_stats->length_per_block=realloc(curr_stats->length_per_block, 
            curr_stats->max_lengths*sizeof(unsigned int));
      }
-     curr_stats->length_per_block[curr_stats->num_lengths++]=aln->seq_length;
+     curr_stats->length_per_block[curr_stats->num_lengths++]=block_length;
    }
-//Adjust block stats, and destroy current temp count table.
+//Adjust block stats.
    ++block->num_blocks;
    if(block->num_counts == block->max_counts){
      block->max_counts *= 2;
      block->sequence_counts=realloc(block->sequence_counts,
         block->max_counts*sizeof(unsigned int));
    }
-   block->sequence_counts[block->num_counts++] = aln->size;
+   block->sequence_counts[block->num_counts++] = block_rows;
    if(block->num_species == block->max_species){
       block->max_species *= 2;
       block->species_counts=realloc(block->species_counts,
          block->max_species*sizeof(unsigned int));
    }
    block->species_counts[block->num_species++] = num_species_seen;
-   hdestroy_r(temp_counts);
+}
+
+void process_block(alignment_block aln){
+   begin_block();
+   for(int i = 0; i < aln->size; ++i) count_row(aln->sequences[i]);
+   end_block();
+}
+
+//Callbacks for parsing on one thread, where rows are counted straight
+//from the parser without building blocks.
+int on_block_begin(char *line, size_t len, void *data){
+   (void)line; (void)len; (void)data;
+   begin_block();
+   return 0;
+}
+
+int on_row(seq row, void *data){
+   (void)data;
+   count_row(row);
+   return 0;
+}
+
+int on_block_end(void *data){
+   (void)data;
+   end_block();
+   return 0;
 }
 
 double get_variance(unsigned int *values, 
@@ -234,15 +281,47 @@ void print_species_stats(species_stats stats){
       get_variance(stats->length_per_block,stats->num_lengths,length_average));
 }
 
+void parse_args(int argc, char **argv){
+   int c;
+   int option_index=0;
+   while((c=getopt_long(argc,argv,"t:",long_options,&option_index))!= -1){
+      switch(c){
+         case 't':
+            num_threads=atoi(optarg);
+            if(num_threads < 1){
+               fprintf(stderr, "Invalid number of threads: %s\n",optarg);
+               exit(1);
+            }
+            break;
+         case '?':
+            exit(1);
+      }
+   }
+}
+
 int main(int argc, char **argv){
-   char *filename = argv[1];
-   FILE *maf_file;
-   if((maf_file= fopen(filename, "rb")) == NULL){
+   num_threads=1;
+   parse_args(argc,argv);
+   if(optind >= argc){
+      fprintf(stderr, "Missing required MAF filename\n");
+      exit(1);
+   }
+//Every argument left is a MAF file, or @ and a file listing them. Many
+//files are parsed as one, adding up to one set of stats.
+   int num_files;
+   char **filenames = read_file_args(argv+optind,argc-optind,&num_files);
+   if(filenames == NULL) exit(1);
+   if(num_files == 0){
+      fprintf(stderr, "Missing required MAF filename\n");
+      exit(1);
+   }
+   FILE *maf_file = NULL;
+   if(num_files == 1 && (maf_file= fopen(filenames[0], "rb")) == NULL){
       fprintf(stderr, "Unable to open file: %s\nError: %s",
-         filename,strerror(errno));
+         filenames[0],strerror(errno));
       return 1;
    }
-   printf("Filename: %s\n",filename);
+   for(int i = 0; i < num_files; ++i) printf("Filename: %s\n",filenames[i]);
    block = new_block_stats();
    total_species_stats = calloc(1, sizeof(struct hsearch_data));
    assert(total_species_stats != NULL);
@@ -251,19 +330,41 @@ int main(int argc, char **argv){
       fprintf(stderr,"Failed to create hash table: %s\n", strerror(errno));
       exit(1);
    }
-   temp_counts = calloc(1,sizeof(struct hsearch_data));
-   assert(temp_counts != NULL);
-   species_seen = calloc(100,sizeof(char *));
+   species_seen = NULL;
    num_species_seen = 0;
+   max_species_seen = 0;
    species_in_stats=calloc(100,sizeof(char *));
    num_spec=0;
-   maf_linear_parser parser = get_linear_parser(maf_file,filename);
-   while(1){
-      alignment_block aln = linear_next_alignment_buffer(parser);
+//Binary MAFs written by maf2bin are read in place, text MAFs are
+//parsed on num_threads threads.
+   mafbin_reader bin_reader = NULL;
+   maf_parallel_parser parser = NULL;
+   if(maf_file != NULL && is_mafbin(maf_file)){
+      bin_reader = get_mafbin_reader(maf_file,filenames[0]);
+      if(bin_reader == NULL) exit(1);
+   }else{
+      parser = maf_file != NULL
+         ? get_parallel_parser(maf_file,filenames[0],num_threads,1)
+         : get_parallel_files(filenames,num_files,num_threads,1);
+      if(parser == NULL) exit(1);
+//Only the species and lengths of rows are counted, so the sequence text
+//is skipped.
+      parallel_parse_fields(parser,FIELD_SRC | FIELD_SEQUENCE_LEN);
+   }
+   if(parser != NULL && parser->num_threads < 2){
+      struct _maf_callbacks callbacks = {on_block_begin,on_row,NULL,
+         on_block_end,NULL};
+      for(int i = 0; i < parser->num_files; ++i)
+         if(parse_maf(parser->parsers[i],&callbacks) < 0) exit(1);
+   }
+   else while(1){
+      alignment_block aln = bin_reader != NULL
+         ? mafbin_next_alignment(bin_reader) : parallel_next_alignment(parser);
       if(aln==NULL)break;
       process_block(aln);
       free_alignment_block(aln);
    }
+   if(parser != NULL && parser->error) exit(1);
    print_block_stats(block);
    ENTRY *ret_val;
    for(int i = 0; i < num_spec; ++i){
@@ -271,8 +372,10 @@ int main(int argc, char **argv){
       print_species_stats((species_stats)ret_val->data);
   //    printf("%s\n",species_in_stats[i]);
    }
-   free_linear_parser(parser);
-   fclose(maf_file);
+   if(parser != NULL) free_parallel_parser(parser);
+   free_mafbin_reader(bin_reader);
+   if(maf_file != NULL) fclose(maf_file);
+   free_file_args(filenames,num_files);
    //clean_up();
    return 0;
 }
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mafparser.h"
+#include "mafbin.h"
+#include "speciesset.h"
+
+static const char padding[8];
+
+//Bytes to pad len to a multiple of 8.
+static inline size_t pad_size(uint64_t len){
+   return (8-len%8)%8;
+}
+
+static int write_bytes(FILE *bin_file, const void *data, size_t len,
+      uint64_t *pos){
+   if(len != 0 && fwrite(data,1,len,bin_file) != len) return -1;
+   *pos += len;
+   return 0;
+}
+
+static int write_names(FILE *bin_file, intern_table table, uint64_t *pos){
+   uint32_t size = intern_size(table);
+   for(uint32_t id = 0; id < size; ++id){
+      char *name = interned_string(table,id);
+      if(write_bytes(bin_file,name,strlen(name)+1,pos) != 0) return -1;
+   }
+   return 0;
+}
+
+//Convert the blocks read by parser into a binary MAF. Rows keep the
+//species and src IDs the parser interned them as, so the parser's
+//tables become the file's name table.
+int write_mafbin(maf_linear_parser parser, char *bin_filename){
+   FILE *bin_file;
+   if((bin_file = fopen(bin_filename,"wb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s\n",
+         bin_filename,strerror(errno));
+      return -1;
+   }
+   uint64_t pos = 0;
+   uint64_t num_blocks = 0;
+   uint64_t max_blocks = 1024;
+   uint64_t *offsets = malloc(max_blocks*sizeof(*offsets));
+   assert(offsets != NULL);
+   uint32_t max_rows = 16;
+   mafbin_row rows = malloc(max_rows*sizeof(*rows));
+   assert(rows != NULL);
+   struct _mafbin_header header;
+   memset(&header,0,sizeof(header));
+   memcpy(header.magic,MAFBIN_MAGIC,sizeof(header.magic));
+   header.version = MAFBIN_VERSION;
+   int error = write_bytes(bin_file,&header,sizeof(header),&pos);
+   alignment_block aln = get_reusable_alignment(parser);
+   int rc = 0;
+   while(!error && (rc = linear_refill_alignment(parser,aln)) > 0){
+      if(num_blocks == max_blocks){
+         max_blocks *= 2;
+         offsets = realloc(offsets,max_blocks*sizeof(*offsets));
+         assert(offsets != NULL);
+      }
+      offsets[num_blocks++] = pos;
+      if((uint32_t)aln->size > max_rows){
+         while((uint32_t)aln->size > max_rows) max_rows *= 2;
+         rows = realloc(rows,max_rows*sizeof(*rows));
+         assert(rows != NULL);
+      }
+//Sequences are stored as fixed width columns, so every row of a block
+//must be as long as the first.
+      struct _mafbin_block block = {aln->size,aln->seq_length};
+      for(int i = 0; i < aln->size; ++i){
+         seq row = aln->sequences[i];
+         if(row->sequence_len != aln->seq_length){
+            fprintf(stderr, "Rows of differing lengths in block %llu: %.*s\n",
+               (unsigned long long)num_blocks,(int)row->src_len,row->src);
+            fclose(bin_file);
+            free_alignment_block(aln);
+            free(offsets);
+            free(rows);
+            return -1;
+         }
+         rows[i].start = row->start;
+         rows[i].src_size = row->srcSize;
+         rows[i].size = row->size;
+         rows[i].strand = row->strand;
+         rows[i].species = row->species_id;
+         rows[i].src = row->src_id;
+      }
+      error = write_bytes(bin_file,&block,sizeof(block),&pos)
+         || write_bytes(bin_file,rows,aln->size*sizeof(*rows),&pos);
+      for(int i = 0; !error && i < aln->size; ++i)
+         error = write_bytes(bin_file,aln->sequences[i]->sequence,
+            aln->seq_length,&pos);
+      error = error || write_bytes(bin_file,padding,pad_size(pos),&pos);
+   }
+   free_alignment_block(aln);
+   free(rows);
+   if(!error && rc < 0){
+      fclose(bin_file);
+      free(offsets);
+      return -1;
+   }
+//The name table is every species name in ID order, then every src.
+   struct _mafbin_footer footer;
+   memset(&footer,0,sizeof(footer));
+   footer.num_blocks = num_blocks;
+   footer.names_offset = pos;
+   footer.num_species = intern_size(parser->species_ids);
+   footer.num_srcs = intern_size(parser->src_ids);
+   error = error || write_names(bin_file,parser->species_ids,&pos)
+      || write_names(bin_file,parser->src_ids,&pos);
+   footer.names_size = pos-footer.names_offset;
+   error = error || write_bytes(bin_file,padding,pad_size(pos),&pos);
+   footer.index_offset = pos;
+   memcpy(footer.magic,MAFBIN_MAGIC,sizeof(footer.magic));
+   error = error || write_bytes(bin_file,offsets,num_blocks*sizeof(*offsets),
+         &pos)
+      || write_bytes(bin_file,&footer,sizeof(footer),&pos);
+   free(offsets);
+   if(fclose(bin_file) != 0) error = 1;
+   if(error){
+      fprintf(stderr, "Error writing binary MAF: %s\nError: %s\n",
+         bin_filename,strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+//Check whether an open file is a binary MAF rather than text.
+int is_mafbin(FILE *maf_file){
+   char magic[8];
+   return pread(fileno(maf_file),magic,sizeof(magic),0) == sizeof(magic)
+      && memcmp(magic,MAFBIN_MAGIC,sizeof(magic)) == 0;
+}
+
+//Split the name table into species and srcs. Returns -1 if the table
+//doesn't hold as many names as the footer says.
+static int load_names(mafbin_reader reader, mafbin_footer footer){
+   char *name = reader->map+footer->names_offset;
+   char *end = name+footer->names_size;
+   reader->num_species = footer->num_species;
+   reader->num_srcs = footer->num_srcs;
+   reader->species = malloc((reader->num_species+1)*sizeof(char *));
+   reader->species_lens = malloc((reader->num_species+1)*sizeof(uint32_t));
+   reader->srcs = malloc((reader->num_srcs+1)*sizeof(char *));
+   reader->src_lens = malloc((reader->num_srcs+1)*sizeof(uint32_t));
+   assert(reader->species != NULL && reader->species_lens != NULL
+      && reader->srcs != NULL && reader->src_lens != NULL);
+   for(uint64_t i = 0; i < (uint64_t)footer->num_species+footer->num_srcs; ++i){
+      char *nul = memchr(name,'\0',end-name);
+      if(nul == NULL) return -1;
+      if(i < footer->num_species){
+         reader->species[i] = name;
+         reader->species_lens[i] = nul-name;
+      }else{
+         reader->srcs[i-footer->num_species] = name;
+         reader->src_lens[i-footer->num_species] = nul-name;
+      }
+      name = nul+1;
+   }
+   return 0;
+}
+
+//Reader over a binary MAF written by write_mafbin. The file is mapped
+//and blocks are read in place, so their sequences must not be used
+//after the reader is freed. Returns NULL if the file isn't a valid
+//binary MAF.
+mafbin_reader get_mafbin_reader(FILE *maf_file, char *filename){
+   struct stat st;
+   if(fstat(fileno(maf_file),&st) != 0){
+      fprintf(stderr, "Unable to stat file: %s\nError: %s\n",
+         filename,strerror(errno));
+      return NULL;
+   }
+   size_t size = st.st_size;
+   if(size < sizeof(struct _mafbin_header)+sizeof(struct _mafbin_footer)){
+      fprintf(stderr, "Invalid binary MAF: %s\n",filename);
+      return NULL;
+   }
+   char *map = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fileno(maf_file),0);
+   if(map == MAP_FAILED){
+      fprintf(stderr, "Unable to map file: %s\nError: %s\n",
+         filename,strerror(errno));
+      return NULL;
+   }
+   mafbin_header header = (mafbin_header)map;
+   mafbin_footer footer = (mafbin_footer)(map+size-sizeof(*footer));
+   if(memcmp(header->magic,MAFBIN_MAGIC,sizeof(header->magic)) != 0
+         || header->version != MAFBIN_VERSION
+         || memcmp(footer->magic,MAFBIN_MAGIC,sizeof(footer->magic)) != 0
+         || footer->names_offset > footer->index_offset
+         || footer->names_size > footer->index_offset-footer->names_offset
+         || footer->index_offset > size-sizeof(*footer)
+         || footer->num_blocks != (size-sizeof(*footer)-footer->index_offset)
+               /sizeof(uint64_t)){
+      fprintf(stderr, "Invalid binary MAF: %s\n",filename);
+      munmap(map,size);
+      return NULL;
+   }
+   mafbin_reader reader = calloc(1,sizeof(*reader));
+   assert(reader != NULL);
+   reader->maf_file = maf_file;
+   reader->filename = strdup(filename);
+   assert(reader->filename != NULL);
+   reader->map = map;
+   reader->map_size = size;
+   reader->offsets = (uint64_t *)(map+footer->index_offset);
+   reader->num_blocks = footer->num_blocks;
+   reader->curr_block = 0;
+   reader->pool = new_arena_pool();
+   if(load_names(reader,footer) != 0){
+      fprintf(stderr, "Invalid binary MAF name table: %s\n",filename);
+      free_mafbin_reader(reader);
+      return NULL;
+   }
+   return reader;
+}
+
+//Locate the block'th block, checking it fits before the name table.
+//Returns NULL if it doesn't.
+static mafbin_block find_block(mafbin_reader reader, uint64_t block,
+      uint64_t *length){
+   mafbin_footer footer = (mafbin_footer)(reader->map+reader->map_size
+      -sizeof(*footer));
+   uint64_t offset = reader->offsets[block];
+   uint64_t end = block+1 < reader->num_blocks ? reader->offsets[block+1]
+      : footer->names_offset;
+   if(offset < sizeof(struct _mafbin_header) || offset > end
+         || end > footer->names_offset
+         || end-offset < sizeof(struct _mafbin_block)){
+      fprintf(stderr, "Invalid binary MAF block %llu: %s\n",
+         (unsigned long long)block,reader->filename);
+      return NULL;
+   }
+   mafbin_block header = (mafbin_block)(reader->map+offset);
+   if((end-offset-sizeof(*header))/(sizeof(struct _mafbin_row)
+         +(uint64_t)header->columns) < header->rows){
+      fprintf(stderr, "Invalid binary MAF block %llu: %s\n",
+         (unsigned long long)block,reader->filename);
+      return NULL;
+   }
+   *length = end-offset;
+   return header;
+}
+
+//Point the fields of sequence at the row's names and bases in the
+//mapping. Returns -1 if the row's IDs are out of range.
+static int load_row(mafbin_reader reader, seq sequence, mafbin_row row,
+      char *bases, uint32_t columns){
+   if(row->species >= reader->num_species || row->src >= reader->num_srcs)
+      return -1;
+   sequence->src = reader->srcs[row->src];
+   sequence->src_len = reader->src_lens[row->src];
+   sequence->species = reader->species[row->species];
+   sequence->species_len = reader->species_lens[row->species];
+   sequence->scaffold = sequence->src+sequence->species_len;
+   if(sequence->src_len > sequence->species_len) ++sequence->scaffold;
+   sequence->scaffold_len = sequence->src+sequence->src_len
+      -sequence->scaffold;
+   sequence->start = row->start;
+   sequence->size = row->size;
+   sequence->strand = row->strand;
+   sequence->srcSize = row->src_size;
+   sequence->sequence = bases;
+   sequence->sequence_len = columns;
+   sequence->species_id = row->species;
+   sequence->src_id = row->src;
+//Rows come from an arena that isn't zeroed, and binary rows are never
+//packed, so tools fall back to the text.
+   sequence->packed = sequence->soft_mask = NULL;
+   sequence->view = 1;
+   sequence->owned = 0;
+   return 0;
+}
+
+alignment_block mafbin_read_block(mafbin_reader reader, uint64_t block){
+   if(block >= reader->num_blocks) return NULL;
+   uint64_t length;
+   mafbin_block header = find_block(reader,block,&length);
+   if(header == NULL) return NULL;
+   mafbin_row rows = (mafbin_row)(header+1);
+   char *bases = (char *)(rows+header->rows);
+   arena mem = get_arena(reader->pool);
+   alignment_block new_align = arena_alloc(mem,sizeof(*new_align));
+   new_align->mem = mem;
+   new_align->reusable = 0;
+   new_align->cached = NULL;
+   new_align->data = NULL;
+   new_align->max = header->rows > 0 ? header->rows : 1;
+   new_align->sequences = arena_alloc(mem,new_align->max*sizeof(seq));
+   new_align->size = new_align->curr_seq = 0;
+   new_align->seq_length = header->columns;
+   new_align->offset = reader->offsets[block];
+   new_align->length = length;
+//Binary MAFs don't keep 'i', 'e' or 'q' lines.
+   new_align->lines.spans = NULL;
+   new_align->lines.size = new_align->lines.max = 0;
+   seq sequences = arena_alloc(mem,new_align->max*sizeof(*sequences));
+   for(uint32_t i = 0; i < header->rows; ++i){
+      if(load_row(reader,&sequences[i],&rows[i],
+            bases+(uint64_t)i*header->columns,header->columns) != 0){
+         fprintf(stderr, "Invalid binary MAF row in block %llu: %s\n",
+            (unsigned long long)block,reader->filename);
+         release_arena(mem);
+         return NULL;
+      }
+      new_align->sequences[new_align->size++] = &sequences[i];
+   }
+   return new_align;
+}
+
+alignment_block mafbin_next_alignment(mafbin_reader reader){
+   if(reader->curr_block >= reader->num_blocks) return NULL;
+   return mafbin_read_block(reader,reader->curr_block++);
+}
+
+//Group of every species ID for the groups, worked out once per species
+//set rather than once per row.
+static enum species_group *reader_groups(mafbin_reader reader,
+      char **in_group, int in_size, char **out_group, int out_size){
+   if(reader->groups != NULL && species_set_matches(reader->groups,
+         in_group,in_size,out_group,out_size))
+      return reader->species_groups;
+   free_species_set(reader->groups);
+   reader->groups = get_species_set(in_group,in_size,out_group,out_size);
+   free(reader->species_groups);
+   reader->species_groups = malloc((reader->num_species+1)
+      *sizeof(*reader->species_groups));
+   assert(reader->species_groups != NULL);
+   for(uint32_t i = 0; i < reader->num_species; ++i)
+      reader->species_groups[i] = find_species(reader->groups,
+         reader->species[i],reader->species_lens[i]);
+   return reader->species_groups;
+}
+
+//Next block with its rows sorted into in and out groups, rows of other
+//species are left out without being loaded.
+sorted_alignment_block mafbin_next_sorted(mafbin_reader reader,
+      char **in_group, int in_size, char **out_group, int out_size){
+   if(reader->curr_block >= reader->num_blocks) return NULL;
+   uint64_t block = reader->curr_block++;
+   uint64_t length;
+   mafbin_block header = find_block(reader,block,&length);
+   if(header == NULL) return NULL;
+   enum species_group *groups = reader_groups(reader,in_group,in_size,
+      out_group,out_size);
+   mafbin_row rows = (mafbin_row)(header+1);
+   char *bases = (char *)(rows+header->rows);
+   arena mem = get_arena(reader->pool);
+   sorted_alignment_block new_align = arena_alloc(mem,sizeof(*new_align));
+   new_align->mem = mem;
+   new_align->reusable = 0;
+   new_align->data = NULL;
+   new_align->seq_length = header->columns;
+   new_align->in_max = new_align->out_max = header->rows > 0 ? header->rows : 1;
+   new_align->in_sequences = arena_alloc(mem,new_align->in_max*sizeof(seq));
+   new_align->out_sequences = arena_alloc(mem,new_align->out_max*sizeof(seq));
+   new_align->in_size = new_align->out_size = 0;
+   new_align->lines.spans = NULL;
+   new_align->lines.size = new_align->lines.max = 0;
+   for(uint32_t i = 0; i < header->rows; ++i){
+      enum species_group group = rows[i].species < reader->num_species
+         ? groups[rows[i].species] : NO_GROUP;
+      if(group == NO_GROUP) continue;
+      seq sequence = arena_alloc(mem,sizeof(*sequence));
+      if(load_row(reader,sequence,&rows[i],bases+(uint64_t)i*header->columns,
+            header->columns) != 0){
+         fprintf(stderr, "Invalid binary MAF row in block %llu: %s\n",
+            (unsigned long long)block,reader->filename);
+         release_arena(mem);
+         return NULL;
+      }
+      if(group == IN_GROUP)
+         new_align->in_sequences[new_align->in_size++] = sequence;
+      else new_align->out_sequences[new_align->out_size++] = sequence;
+   }
+   return new_align;
+}
+
+void free_mafbin_reader(mafbin_reader reader){
+   if(reader == NULL) return;
+   munmap(reader->map,reader->map_size);
+   free(reader->species);
+   free(reader->species_lens);
+   free(reader->srcs);
+   free(reader->src_lens);
+   free_species_set(reader->groups);
+   free(reader->species_groups);
+   free_arena_pool(reader->pool);
+   free(reader->filename);
+   free(reader);
+}
@@ -0,0 +1,84 @@
+#ifndef __MAFBIN_H
+#define __MAFBIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mafparser.h"
+#include "speciesset.h"
+
+#define MAFBIN_MAGIC "MAFBIN\0\0"
+#define MAFBIN_VERSION 1
+#define MAFBIN_EXTENSION ".mafbin"
+
+//On disk a binary MAF is a mafbin_header, the blocks, a table of NUL
+//terminated names, an array of num_blocks block offsets and a
+//mafbin_footer, all in host (little endian) order. The footer is at a
+//fixed place from the end, so a reader maps the file and goes straight
+//to the index without reading the blocks.
+typedef struct _mafbin_header{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+}*mafbin_header;
+
+//A block is a mafbin_block, rows mafbin_rows and then the sequence of
+//each row, columns bytes apiece, padded to 8 bytes. The sequences are
+//used in place, so loading a block only sets pointers.
+typedef struct _mafbin_block{
+	uint32_t rows;
+	uint32_t columns;
+}*mafbin_block;
+
+//One 's' row. species and src are IDs in the name table, the first
+//num_species names are species and the rest species.scaffold srcs.
+typedef struct _mafbin_row{
+	uint64_t start;
+	uint64_t src_size;
+	uint32_t size;
+	uint32_t strand;
+	uint32_t species;
+	uint32_t src;
+}*mafbin_row;
+
+typedef struct _mafbin_footer{
+	uint64_t num_blocks;
+	uint64_t names_offset;
+	uint64_t names_size;
+	uint64_t index_offset;
+	uint32_t num_species;
+	uint32_t num_srcs;
+	char magic[8];
+}*mafbin_footer;
+
+typedef struct _mafbin_reader{
+	FILE *maf_file;
+	char *filename;
+	char *map;
+	size_t map_size;
+	uint64_t *offsets;
+	uint64_t num_blocks;
+	uint64_t curr_block;
+//Names by ID, with their lengths and the length of each src's species.
+	char **species;
+	uint32_t *species_lens;
+	uint32_t num_species;
+	char **srcs;
+	uint32_t *src_lens;
+	uint32_t num_srcs;
+//Group of each species ID for the species set last asked for.
+	struct _species_set *groups;
+	enum species_group *species_groups;
+	arena_pool pool;
+}*mafbin_reader;
+
+int is_mafbin(FILE *maf_file);
+int write_mafbin(maf_linear_parser parser, char *bin_filename);
+mafbin_reader get_mafbin_reader(FILE *maf_file, char *filename);
+alignment_block mafbin_read_block(mafbin_reader reader, uint64_t block);
+alignment_block mafbin_next_alignment(mafbin_reader reader);
+sorted_alignment_block mafbin_next_sorted(mafbin_reader reader,
+      char **in_group, int in_size, char **out_group, int out_size);
+void free_mafbin_reader(mafbin_reader reader);
+
+#endif
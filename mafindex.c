@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "mafparser.h"
+#include "mafindex.h"
+#include "intern.h"
+
+char *get_index_filename(char *maf_filename){
+   char *index_filename = malloc(strlen(maf_filename)+strlen(INDEX_EXTENSION)+1);
+   assert(index_filename != NULL);
+   strcpy(index_filename,maf_filename);
+   strcat(index_filename,INDEX_EXTENSION);
+   return index_filename;
+}
+
+static maf_index new_maf_index(){
+   maf_index index = calloc(1,sizeof(*index));
+   assert(index != NULL);
+   index->max_blocks = 1024;
+   index->entries = malloc(index->max_blocks*sizeof(*index->entries));
+   assert(index->entries != NULL);
+   index->max_rows = 4096;
+   index->rows = malloc(index->max_rows*sizeof(*index->rows));
+   assert(index->rows != NULL);
+   index->max_strings = 4096;
+   index->strings = malloc(index->max_strings);
+   assert(index->strings != NULL);
+   index->num_slots = 1024;
+   index->string_slots = calloc(index->num_slots,sizeof(uint32_t));
+   assert(index->string_slots != NULL);
+   return index;
+}
+
+static uint32_t hash_string(const char *str, size_t len){
+   uint32_t hash = 2166136261u;
+   for(size_t i = 0; i < len; ++i) hash = (hash^(unsigned char)str[i])*16777619u;
+   return hash;
+}
+
+static void grow_string_slots(maf_index index){
+   uint32_t num_slots = 2*index->num_slots;
+   uint32_t *slots = calloc(num_slots,sizeof(uint32_t));
+   assert(slots != NULL);
+   for(uint32_t i = 0; i < index->num_slots; ++i){
+      if(index->string_slots[i] == 0) continue;
+      char *str = index->strings+index->string_slots[i]-1;
+      uint32_t slot = hash_string(str,strlen(str)) & (num_slots-1);
+      while(slots[slot] != 0) slot = (slot+1) & (num_slots-1);
+      slots[slot] = index->string_slots[i];
+   }
+   free(index->string_slots);
+   index->string_slots = slots;
+   index->num_slots = num_slots;
+}
+
+//Add a string of len bytes to the string table, returning its offset.
+//Strings already in the table are shared.
+static uint32_t add_string(maf_index index, const char *str, size_t len){
+   if(2*(index->used_slots+1) > index->num_slots) grow_string_slots(index);
+   uint32_t slot = hash_string(str,len) & (index->num_slots-1);
+   while(index->string_slots[slot] != 0){
+      char *existing = index->strings+index->string_slots[slot]-1;
+      if(!strncmp(existing,str,len) && existing[len] == '\0')
+         return index->string_slots[slot]-1;
+      slot = (slot+1) & (index->num_slots-1);
+   }
+   while(index->strings_size+len+1 > index->max_strings){
+      index->max_strings *= 2;
+      index->strings = realloc(index->strings,index->max_strings);
+      assert(index->strings != NULL);
+   }
+   uint32_t offset = index->strings_size;
+   memcpy(index->strings+offset,str,len);
+   index->strings[offset+len] = '\0';
+   index->strings_size += len+1;
+   index->string_slots[slot] = offset+1;
+   ++index->used_slots;
+   return offset;
+}
+
+static index_entry add_entry(maf_index index){
+   if(index->num_blocks == index->max_blocks){
+      index->max_blocks *= 2;
+      index->entries = realloc(index->entries,
+         index->max_blocks*sizeof(*index->entries));
+      assert(index->entries != NULL);
+   }
+   return &index->entries[index->num_blocks++];
+}
+
+static index_row add_row(maf_index index){
+   if(index->num_rows == index->max_rows){
+      index->max_rows *= 2;
+      index->rows = realloc(index->rows,index->max_rows*sizeof(*index->rows));
+      assert(index->rows != NULL);
+   }
+   return &index->rows[index->num_rows++];
+}
+
+static void set_source(maf_index index, FILE *maf_file){
+   struct stat st;
+   if(fstat(fileno(maf_file),&st) != 0) return;
+   index->source_size = st.st_size;
+   index->source_mtime = st.st_mtime;
+}
+
+//Give the species of each row, its src up to the first '.', an ID in
+//the order first seen, and set the bits of each block's species.
+static void build_species_bits(maf_index index){
+   intern_table species_ids = new_intern_table();
+   uint32_t *row_species = malloc((index->num_rows+1)*sizeof(uint32_t));
+   assert(row_species != NULL);
+   for(uint64_t i = 0; i < index->num_rows; ++i){
+      char *src = index->strings+index->rows[i].src;
+      char *dot = strchr(src,'.');
+      row_species[i] = intern_string(species_ids,src,
+            dot != NULL ? (size_t)(dot-src) : strlen(src));
+   }
+   index->num_species = intern_size(species_ids);
+   index->species = malloc((index->num_species+1)*sizeof(*index->species));
+   assert(index->species != NULL);
+   for(uint64_t i = 0; i < index->num_species; ++i){
+      char *name = interned_string(species_ids,i);
+      index->species[i] = add_string(index,name,strlen(name));
+   }
+   index->species_words = (index->num_species+63)/64;
+   index->species_bits = calloc(index->num_blocks*index->species_words+1,
+         sizeof(*index->species_bits));
+   assert(index->species_bits != NULL);
+   for(uint64_t block = 0; block < index->num_blocks; ++block){
+      index_entry entry = &index->entries[block];
+      uint64_t *bits = index->species_bits+block*index->species_words;
+      for(uint64_t i = entry->first_row; i < entry->first_row+entry->rows; ++i)
+         bits[row_species[i]/64] |= 1ULL << (row_species[i]%64);
+   }
+   free(row_species);
+   free_intern_table(species_ids);
+}
+
+//Scan a MAF file with the mapped parser and record every block. The
+//file is read from the start, whatever its current position.
+maf_index build_maf_index(FILE *maf_file, char *filename){
+   if(fseeko(maf_file,0,SEEK_SET) != 0){
+      fprintf(stderr,"File seek error: %s\nError: %s\n",filename,strerror(errno));
+      return NULL;
+   }
+   maf_index index = new_maf_index();
+   set_source(index,maf_file);
+   maf_linear_parser parser = get_mmap_parser(maf_file,filename);
+//Blocks are located by their rows' coordinates, never their text.
+   set_parse_fields(parser,HEADER_FIELDS);
+   alignment_block aln;
+   while((aln = linear_next_alignment_buffer(parser)) != NULL){
+      index_entry entry = add_entry(index);
+      entry->offset = aln->offset;
+      entry->length = aln->length;
+      entry->rows = aln->size;
+      entry->columns = aln->seq_length;
+      entry->ref_start = 0;
+      entry->ref_size = 0;
+      entry->ref_src = add_string(index,"",0);
+      entry->first_row = index->num_rows;
+      for(int i = 0; i < aln->size; ++i){
+         seq sequence = aln->sequences[i];
+         index_row row = add_row(index);
+         row->src = add_string(index,sequence->src,sequence->src_len);
+         row->size = sequence->size;
+         row->start = sequence->start;
+         if(sequence->strand == '-')
+            row->start = sequence->srcSize-sequence->start-sequence->size;
+      }
+      if(aln->size > 0){
+         seq ref = aln->sequences[0];
+         entry->ref_start = ref->start;
+         entry->ref_size = ref->size;
+         entry->ref_src = index->rows[entry->first_row].src;
+      }
+      free_alignment_block(aln);
+   }
+   if(parser->error){
+      free_linear_parser(parser);
+      free_maf_index(index);
+      return NULL;
+   }
+   if(parser->bgzf != NULL) index->flags |= INDEX_BGZF;
+   free_linear_parser(parser);
+   build_species_bits(index);
+   return index;
+}
+
+int write_maf_index(maf_index index, char *index_filename){
+   FILE *index_file;
+   if((index_file = fopen(index_filename,"wb")) == NULL){
+      fprintf(stderr, "Unable to open file: %s\nError: %s\n",
+         index_filename,strerror(errno));
+      return -1;
+   }
+   struct _index_header header;
+   memset(&header,0,sizeof(header));
+   memcpy(header.magic,INDEX_MAGIC,sizeof(header.magic));
+   header.version = INDEX_VERSION;
+   header.flags = index->flags;
+   header.source_size = index->source_size;
+   header.source_mtime = index->source_mtime;
+   header.num_blocks = index->num_blocks;
+   header.num_rows = index->num_rows;
+   header.num_species = index->num_species;
+   header.strings_size = index->strings_size;
+   uint64_t num_bits = index->num_blocks*index->species_words;
+   if(fwrite(&header,sizeof(header),1,index_file) != 1
+         || fwrite(index->entries,sizeof(*index->entries),index->num_blocks,
+               index_file) != index->num_blocks
+         || fwrite(index->rows,sizeof(*index->rows),index->num_rows,
+               index_file) != index->num_rows
+         || fwrite(index->species_bits,sizeof(*index->species_bits),num_bits,
+               index_file) != num_bits
+         || fwrite(index->species,sizeof(*index->species),index->num_species,
+               index_file) != index->num_species
+         || fwrite(index->strings,1,index->strings_size,index_file)
+               != index->strings_size){
+      fprintf(stderr, "Error writing index: %s\nError: %s\n",
+         index_filename,strerror(errno));
+      fclose(index_file);
+      return -1;
+   }
+   if(fclose(index_file) != 0){
+      fprintf(stderr, "Error writing index: %s\nError: %s\n",
+         index_filename,strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+//Load an index written by write_maf_index. Returns NULL if there is no
+//such file or it isn't a valid index.
+maf_index load_maf_index(char *index_filename){
+   FILE *index_file;
+   if((index_file = fopen(index_filename,"rb")) == NULL) return NULL;
+   struct stat st;
+   if(fstat(fileno(index_file),&st) != 0
+         || (size_t)st.st_size < sizeof(struct _index_header)){
+      fclose(index_file);
+      return NULL;
+   }
+   char *data = malloc(st.st_size);
+   assert(data != NULL);
+   if(fread(data,1,st.st_size,index_file) != (size_t)st.st_size){
+      fprintf(stderr, "Error reading index: %s\nError: %s\n",
+         index_filename,strerror(errno));
+      free(data);
+      fclose(index_file);
+      return NULL;
+   }
+   fclose(index_file);
+   index_header header = (index_header)data;
+   uint64_t species_words = (header->num_species+63)/64;
+   if(memcmp(header->magic,INDEX_MAGIC,sizeof(header->magic)) != 0
+         || header->version != INDEX_VERSION
+         || sizeof(*header)+header->num_blocks*sizeof(struct _index_entry)
+               +header->num_rows*sizeof(struct _index_row)
+               +header->num_blocks*species_words*sizeof(uint64_t)
+               +header->num_species*sizeof(uint32_t)
+               +header->strings_size != (uint64_t)st.st_size){
+      fprintf(stderr, "Invalid index file: %s\n",index_filename);
+      free(data);
+      return NULL;
+   }
+   maf_index index = calloc(1,sizeof(*index));
+   assert(index != NULL);
+   index->data = data;
+   index->source_size = header->source_size;
+   index->source_mtime = header->source_mtime;
+   index->flags = header->flags;
+   index->num_blocks = index->max_blocks = header->num_blocks;
+   index->entries = (index_entry)(data+sizeof(*header));
+   index->num_rows = index->max_rows = header->num_rows;
+   index->rows = (index_row)(index->entries+index->num_blocks);
+   index->num_species = header->num_species;
+   index->species_words = species_words;
+   index->species_bits = (uint64_t *)(index->rows+index->num_rows);
+   index->species = (uint32_t *)(index->species_bits
+      +index->num_blocks*species_words);
+   index->strings_size = index->max_strings = header->strings_size;
+   index->strings = (char *)(index->species+index->num_species);
+   return index;
+}
+
+//Check the index was built from the file as it is now.
+int index_matches(maf_index index, FILE *maf_file){
+   struct stat st;
+   if(fstat(fileno(maf_file),&st) != 0) return 0;
+   return index->source_size == (uint64_t)st.st_size
+      && index->source_mtime == st.st_mtime;
+}
+
+char *index_string(maf_index index, uint32_t offset){
+   return index->strings+offset;
+}
+
+static int compare_srcs(const void *a, const void *b, void *strings){
+   return strcmp((char *)strings+((index_src)a)->src,
+      (char *)strings+((index_src)b)->src);
+}
+
+static int compare_intervals(const void *a, const void *b, void *rows){
+   index_row row_a = (index_row)rows+((index_interval)a)->max_end;
+   index_row row_b = (index_row)rows+((index_interval)b)->max_end;
+   if(row_a->src != row_b->src) return row_a->src < row_b->src ? -1 : 1;
+   if(row_a->start != row_b->start) return row_a->start < row_b->start ? -1 : 1;
+   return 0;
+}
+
+//Sort every row into per src runs of intervals ordered by start.
+static void build_intervals(maf_index index){
+   index->intervals = malloc((index->num_rows+1)*sizeof(*index->intervals));
+   assert(index->intervals != NULL);
+   for(uint64_t block = 0; block < index->num_blocks; ++block){
+      index_entry entry = &index->entries[block];
+      for(uint64_t i = entry->first_row; i < entry->first_row+entry->rows; ++i){
+         index_interval interval = &index->intervals[i];
+         interval->start = index->rows[i].start;
+         interval->end = index->rows[i].start+index->rows[i].size;
+         interval->block = block;
+//Sort on the row, max_end is filled in afterwards.
+         interval->max_end = i;
+      }
+   }
+   qsort_r(index->intervals,index->num_rows,sizeof(*index->intervals),
+      compare_intervals,index->rows);
+   index->srcs = malloc((index->num_rows+1)*sizeof(*index->srcs));
+   assert(index->srcs != NULL);
+   index->num_srcs = 0;
+   uint64_t max_end = 0;
+   for(uint64_t i = 0; i < index->num_rows; ++i){
+      uint32_t src = index->rows[index->intervals[i].max_end].src;
+      if(index->num_srcs == 0 || index->srcs[index->num_srcs-1].src != src){
+         index_src run = &index->srcs[index->num_srcs++];
+         run->src = src;
+         run->first = i;
+         run->count = 0;
+         max_end = 0;
+      }
+      ++index->srcs[index->num_srcs-1].count;
+      if(index->intervals[i].end > max_end) max_end = index->intervals[i].end;
+      index->intervals[i].max_end = max_end;
+   }
+   qsort_r(index->srcs,index->num_srcs,sizeof(*index->srcs),compare_srcs,
+      index->strings);
+}
+
+static index_src find_src(maf_index index, char *src, size_t src_len){
+   uint64_t low = 0, high = index->num_srcs;
+   while(low < high){
+      uint64_t mid = low+(high-low)/2;
+      char *name = index->strings+index->srcs[mid].src;
+      int cmp = strncmp(name,src,src_len);
+      if(cmp == 0 && name[src_len] != '\0') cmp = 1;
+      if(cmp == 0) return &index->srcs[mid];
+      if(cmp < 0) low = mid+1;
+      else high = mid;
+   }
+   return NULL;
+}
+
+static int compare_blocks(const void *a, const void *b){
+   uint64_t block_a = *(uint64_t *)a, block_b = *(uint64_t *)b;
+   return block_a < block_b ? -1 : block_a > block_b;
+}
+
+//Find the blocks with a row of src overlapping the forward strand
+//interval [start,end). Returns a malloc'd array of *count block numbers
+//in file order, or NULL if there are none.
+uint64_t *index_overlaps(maf_index index, char *src, size_t src_len,
+      uint64_t start, uint64_t end, uint64_t *count){
+   *count = 0;
+   if(index->intervals == NULL) build_intervals(index);
+   index_src run = find_src(index,src,src_len);
+   if(run == NULL || start >= end) return NULL;
+   index_interval intervals = index->intervals+run->first;
+//First interval starting at or after the end of the query.
+   uint64_t low = 0, high = run->count;
+   while(low < high){
+      uint64_t mid = low+(high-low)/2;
+      if(intervals[mid].start < end) low = mid+1;
+      else high = mid;
+   }
+   uint64_t max = 16;
+   uint64_t *blocks = malloc(max*sizeof(*blocks));
+   assert(blocks != NULL);
+   for(uint64_t i = low; i-- > 0 && intervals[i].max_end > start;){
+      if(intervals[i].end <= start) continue;
+      if(*count == max){
+         max *= 2;
+         blocks = realloc(blocks,max*sizeof(*blocks));
+         assert(blocks != NULL);
+      }
+      blocks[(*count)++] = intervals[i].block;
+   }
+   if(*count == 0){
+      free(blocks);
+      return NULL;
+   }
+//A src can appear more than once in a block.
+   qsort(blocks,*count,sizeof(*blocks),compare_blocks);
+   uint64_t unique = 1;
+   for(uint64_t i = 1; i < *count; ++i)
+      if(blocks[i] != blocks[unique-1]) blocks[unique++] = blocks[i];
+   *count = unique;
+   return blocks;
+}
+
+//Bitmap of the species named, for index_block_has_species. Species the
+//index has never seen are left out.
+uint64_t *index_species_mask(maf_index index, char **species, int num_species){
+   uint64_t *mask = calloc(index->species_words+1,sizeof(*mask));
+   assert(mask != NULL);
+   for(int i = 0; i < num_species; ++i)
+      for(uint64_t id = 0; id < index->num_species; ++id)
+         if(!strcmp(index->strings+index->species[id],species[i]))
+            mask[id/64] |= 1ULL << (id%64);
+   return mask;
+}
+
+//Whether the block has a row of any species in mask.
+int index_block_has_species(maf_index index, uint64_t block,
+      const uint64_t *mask){
+   uint64_t *bits = index->species_bits+block*index->species_words;
+   for(uint64_t i = 0; i < index->species_words; ++i)
+      if(bits[i] & mask[i]) return 1;
+   return 0;
+}
+
+//Number of the block at offset, checking block hint first since readers
+//mostly go through blocks in order. -1 if no block starts there.
+int64_t index_find_block(maf_index index, uint64_t offset, uint64_t hint){
+   if(hint < index->num_blocks && index->entries[hint].offset == offset)
+      return hint;
+   uint64_t low = 0, high = index->num_blocks;
+   while(low < high){
+      uint64_t mid = low+(high-low)/2;
+      if(index->entries[mid].offset < offset) low = mid+1;
+      else high = mid;
+   }
+   if(low < index->num_blocks && index->entries[low].offset == offset)
+      return low;
+   return -1;
+}
+
+void free_maf_index(maf_index index){
+   if(index == NULL) return;
+   free(index->intervals);
+   free(index->srcs);
+   if(index->data != NULL) free(index->data);
+   else{
+      free(index->entries);
+      free(index->rows);
+      free(index->strings);
+      free(index->string_slots);
+      free(index->species);
+      free(index->species_bits);
+   }
+   free(index);
+}
@@ -0,0 +1,118 @@
+#ifndef __MAFINDEX_H
+#define __MAFINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define INDEX_MAGIC "MAFIDX\0\0"
+#define INDEX_VERSION 4
+#define INDEX_EXTENSION ".mafidx"
+//Set when the MAF file is BGZF compressed and offsets are virtual.
+#define INDEX_BGZF 1
+
+//On disk an index is an index_header, num_blocks index_entries,
+//num_rows index_rows, the species bitmaps of the blocks, num_species
+//species names and a table of NUL terminated strings, all in host
+//(little endian) order. Entries, rows and species refer to strings by
+//their offset in the table.
+typedef struct _index_header{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t num_blocks;
+	uint64_t num_rows;
+	uint64_t num_species;
+	uint64_t strings_size;
+}*index_header;
+
+//One block: where it is in the MAF file (a virtual offset for BGZF
+//files, the length is always uncompressed), its shape, and the src, start
+//and size of its first (reference) row. Its rows are index_rows
+//first_row to first_row+rows-1.
+typedef struct _index_entry{
+	uint64_t offset;
+	uint64_t length;
+	uint32_t rows;
+	uint32_t columns;
+	uint64_t ref_start;
+	uint32_t ref_size;
+	uint32_t ref_src;
+	uint64_t first_row;
+}*index_entry;
+
+//One 's' row of a block, start is on the forward strand whatever the
+//strand of the row.
+typedef struct _index_row{
+	uint64_t start;
+	uint32_t size;
+	uint32_t src;
+}*index_row;
+
+//Rows of one src as intervals sorted by start. max_end is the largest
+//end of this and every earlier interval of the src, so a search can
+//stop once no earlier interval reaches the query.
+typedef struct _index_interval{
+	uint64_t start;
+	uint64_t end;
+	uint64_t max_end;
+	uint64_t block;
+}*index_interval;
+
+//The intervals of one src, srcs are sorted by name.
+typedef struct _index_src{
+	uint32_t src;
+	uint64_t first;
+	uint64_t count;
+}*index_src;
+
+typedef struct _maf_index{
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint32_t flags;
+	uint64_t num_blocks;
+	uint64_t max_blocks;
+	index_entry entries;
+	uint64_t num_rows;
+	uint64_t max_rows;
+	index_row rows;
+	char *strings;
+	uint64_t strings_size;
+	uint64_t max_strings;
+//Species of the rows in the order first seen, and for each block a
+//bitmap of species_words words with bit i set when it has a row of
+//species i, so readers can tell which blocks to skip unparsed.
+	uint32_t *species;
+	uint64_t num_species;
+	uint64_t species_words;
+	uint64_t *species_bits;
+//Open addressing table of string offsets+1, used to share strings
+//while building.
+	uint32_t *string_slots;
+	uint32_t num_slots;
+	uint32_t used_slots;
+//Set when the index was loaded from disk, entries and strings then
+//point into it.
+	char *data;
+//Built on the first overlap query.
+	index_interval intervals;
+	index_src srcs;
+	uint64_t num_srcs;
+}*maf_index;
+
+char *get_index_filename(char *maf_filename);
+maf_index build_maf_index(FILE *maf_file, char *filename);
+maf_index load_maf_index(char *index_filename);
+int write_maf_index(maf_index index, char *index_filename);
+int index_matches(maf_index index, FILE *maf_file);
+char *index_string(maf_index index, uint32_t offset);
+uint64_t *index_overlaps(maf_index index, char *src, size_t src_len,
+      uint64_t start, uint64_t end, uint64_t *count);
+uint64_t *index_species_mask(maf_index index, char **species, int num_species);
+int index_block_has_species(maf_index index, uint64_t block,
+      const uint64_t *mask);
+int64_t index_find_block(maf_index index, uint64_t offset, uint64_t hint);
+void free_maf_index(maf_index index);
+
+#endif
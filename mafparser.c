@@ -13,8 +13,23 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 #include "mafparser.h"
+#include "mafindex.h"
+#include "bgzf.h"
+#include "readahead.h"
+#include "speciesset.h"
+#include "uring.h"
+#include "blockcache.h"
 
 
 int in_list(char *needle, char **haystack, int size){
@@ -23,558 +38,1715 @@ int in_list(char *needle, char **haystack, int size){
    return 0;
 }
 
-int get_next_offset(maf_array_parser parser) {
+//Same as in_list, but the needle is a view of len bytes that need not
+//be NUL terminated.
+int in_list_n(char *needle, size_t len, char **haystack, int size){
+   for(int i = 0; i < size; ++i)
+      if(!strncmp(needle,haystack[i],len) && haystack[i][len]=='\0') return 1;
+   return 0;
+}
+
+int64_t get_next_offset(maf_array_parser parser) {
    if (parser->curr_block >= parser->size) {
 	return -1;
    }
-   return parser->alignment_blocks[parser->curr_block++];
+   return parser->index->entries[parser->curr_block++].offset;
 }
 
 void free_sequence(seq sequence){
-   if(sequence==NULL) return;
+   if(sequence==NULL || !sequence->owned) return;
+//Views point into the mapped file, only the struct itself is ours.
+   if(sequence->view){
+      free(sequence);
+      return;
+   }
    free(sequence->src);
-//BUT WHY
-   if(sequence->sequence != NULL && sequence->sequence[0]!= '\0')
    free(sequence->sequence);
    free(sequence->species);
-//   free(sequence->scaffold);
+   free(sequence->scaffold);
    free(sequence);
 }
 
+//The block, its sequence arrays and its sequences all live in the
+//block's arena, so freeing a block is just handing the arena back.
+static void free_rows(seq *rows, int max){
+   for(int i = 0; i < max; ++i) free(rows[i]);
+   free(rows);
+}
+
+//Reusable blocks keep the block and its rows outside the arena. Blocks
+//from a block cache are only released once the cache is done with them.
 void free_alignment_block(alignment_block aln){
    if(aln==NULL) return;
-   free(aln->data);
-   for(int i =0; i < aln->size; ++i){
-      free_sequence(aln->sequences[i]);
+   if(aln->cached != NULL){
+      cache_release(aln);
+      return;
+   }
+   if(aln->reusable){
+      free_rows(aln->sequences,aln->max);
+      release_arena(aln->mem);
+      free(aln);
+      return;
    }
-   free(aln->sequences);
-   free(aln);
+   release_arena(aln->mem);
+}
+void free_alignment_batch(alignment_batch batch){
+   if(batch == NULL) return;
+   release_arena(batch->mem);
 }
 void free_sorted_alignment(sorted_alignment_block aln){
    if(aln==NULL) return;
-   free(aln->data);
-   int i =0;
-   for(; i < aln->in_size; ++i){
-      free_sequence(aln->in_sequences[i]);
-   }
-   free(aln->in_sequences);
-   for(i=0; i < aln->out_size; ++i){
-      free_sequence(aln->out_sequences[i]);
+   if(aln->reusable){
+      free_rows(aln->in_sequences,aln->in_max);
+      free_rows(aln->out_sequences,aln->out_max);
+      release_arena(aln->mem);
+      free(aln);
+      return;
    }
-   free(aln->out_sequences);
-   free(aln);
+   release_arena(aln->mem);
 }
 void free_hash_alignment(hash_alignment_block aln){
    if(aln == NULL) return;
-   free(aln->data);
-   ENTRY *ret_val;
-//   ENTRY search;
-   int hc=0;
-   for(int i = 0; i < aln->size; ++i){
-      ENTRY search={aln->species[i],NULL};
-      hc = hsearch_r(search,FIND,&ret_val,aln->sequences);
-      if(hc == 0){
-         fprintf(stderr,"Failed to read hash table: %s\n", strerror(errno));
-         exit(1);
-      }
-      if(ret_val != NULL){
-	 free(ret_val->key);
-         free_sequence(ret_val->data);
-//         free(ret_val);
-      }
-   }free(aln->species);
-   hdestroy_r(aln->sequences);
-   free(aln->sequences);
-   free(aln);
+   if(aln->reusable){
+      free_rows(aln->rows,aln->rows_max);
+      free(aln->species);
+      free(aln->slots);
+      release_arena(aln->mem);
+      free(aln);
+      return;
+   }
+   release_arena(aln->mem);
 }
 
 
 seq copy_sequence(seq sequence){
    if(sequence==NULL) return NULL;
    seq copy = malloc(sizeof(*copy));
-   copy->src=strdup(sequence->src);
+   copy->src=strndup(sequence->src,sequence->src_len);
    assert(copy->src != NULL);
    copy->start = sequence->start;
    copy->size = sequence->size;
    copy->strand = sequence->strand;
    copy->srcSize = sequence->srcSize;
-   copy->sequence = strdup(sequence->sequence);
-   assert(copy->sequence!=NULL);
-   copy->species = strdup(sequence->species);
+   copy->sequence = NULL;
+   if(sequence->sequence != NULL){
+      copy->sequence = strndup(sequence->sequence,sequence->sequence_len);
+      assert(copy->sequence!=NULL);
+   }
+   copy->species = strndup(sequence->species,sequence->species_len);
    assert(copy->species != NULL);
-   copy->scaffold = strdup(sequence->scaffold);
+   copy->scaffold = strndup(sequence->scaffold,sequence->scaffold_len);
    assert(copy->scaffold != NULL);
+   copy->src_len = sequence->src_len;
+   copy->species_len = sequence->species_len;
+   copy->scaffold_len = sequence->scaffold_len;
+   copy->sequence_len = sequence->sequence_len;
+   copy->species_id = sequence->species_id;
+   copy->src_id = sequence->src_id;
+   copy->packed = copy->soft_mask = NULL;
+   copy->view = 0;
+   copy->owned = 1;
    return copy;
 }
-seq get_sequence(char *data){
-   if(data == NULL) return NULL;
-   char *seq_parse;
-   char *src_parse;
-   seq new_seq = malloc(sizeof(*new_seq));
-   assert(new_seq!=NULL);
-   new_seq->src=NULL;
-   new_seq->sequence=NULL;
-   char *temp = strdup(data);
-   assert(temp!=NULL);
-//First part of entry, is the 's', throw that away
-   char *datum =strtok_r(temp," \t\n",&seq_parse);
-   for(int i=2;i<8;++i){
-      datum = strtok_r(NULL," \t\n",&seq_parse);
-      if(datum == NULL){
-         fprintf(stderr,"Invalid sequence: %s\n", data);
-         free_sequence(new_seq);
-         return NULL;
+#ifdef __SSE2__
+//Bit i of the result is set when byte i of the 16 at data is a field
+//separator. Every byte up to and including ' ' counts as one, so a
+//single unsigned compare covers spaces, tabs, CR and LF.
+static inline unsigned int separator_mask(const char *data){
+   const __m128i space = _mm_set1_epi8(' ');
+   __m128i chunk = _mm_loadu_si128((const __m128i *)data);
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(chunk,space),space));
+}
+#endif
+
+//Find the first max fields, at most seven, of an 's' line in a single
+//pass over its bytes. Separators are classified 16 bytes at a time and
+//the field boundaries read off the transitions in the resulting bitmask,
+//so long runs inside the sequence field cost one compare per 16 bytes.
+//Returns the number of fields found.
+static int scan_fields(char *data, size_t len, char **field, size_t *field_len,
+      int max){
+   int num_fields = 0;
+   unsigned int in_field = 0;
+   size_t i = 0;
+#ifdef __SSE2__
+   for(; i+16 <= len; i += 16){
+      unsigned int sep = separator_mask(data+i);
+//Bit j of prev is set when the byte before j is a separator, so the
+//bits that differ from sep are where fields start and end.
+      unsigned int prev = ((sep << 1) | !in_field) & 0xFFFF;
+      unsigned int events = sep ^ prev;
+      while(events){
+         int bit = __builtin_ctz(events);
+         events &= events-1;
+         if((sep >> bit) & 1){
+            field_len[num_fields] = data+i+bit-field[num_fields];
+            if(++num_fields == max) return num_fields;
+         }else field[num_fields] = data+i+bit;
       }
-   switch (i){
-//Second part is species name and contig
-      case 2: 
-         new_seq->src = strdup(datum);
-         char *parse_src = strdup(datum);
-         new_seq->species = strtok_r(parse_src,".",&src_parse);
-         new_seq->scaffold = strtok_r(NULL,".",&src_parse);
-         assert(new_seq->src != NULL);
-         break;
+      in_field = !(sep >> 15);
+   }
+#endif
+   for(; i < len; ++i){
+      unsigned int is_sep = (unsigned char)data[i] <= ' ';
+      if(in_field != is_sep) continue;
+      if(is_sep){
+         field_len[num_fields] = data+i-field[num_fields];
+         if(++num_fields == max) return num_fields;
+      }else field[num_fields] = data+i;
+      in_field = !is_sep;
+   }
+   if(in_field){
+      field_len[num_fields] = data+len-field[num_fields];
+      ++num_fields;
+   }
+   return num_fields;
+}
+
+//Parse a field of decimal digits without branching on each digit, any
+//non-digit byte is folded into bad. More than 19 digits could overflow
+//and is rejected. Returns -1 if the field is not a valid number.
+static inline int parse_decimal(char *field, size_t len, unsigned long *value){
+   unsigned long total = 0;
+   unsigned int bad = (len == 0) | (len > 19);
+   for(size_t i = 0; i < len; ++i){
+      unsigned int digit = (unsigned char)field[i] - '0';
+      bad |= digit > 9;
+      total = total*10 + digit;
+   }
+   *value = total;
+   return bad ? -1 : 0;
+}
+
+//Take the sequence field of an 's' line to be everything after the sixth
+//field up to the end of the line, less surrounding blanks, so finding
+//its length doesn't touch its bytes. Returns 0 if there's nothing there.
+static int find_last_field(char *data, size_t len, char **field,
+      size_t *field_len){
+   char *start = field[5]+field_len[5];
+   char *end = data+len;
+   while(start < end && (unsigned char)*start <= ' ') ++start;
+   while(end > start && (unsigned char)end[-1] <= ' ') --end;
+   field[6] = start;
+   field_len[6] = end-start;
+   return start < end;
+}
+
+//Split an 's' line of len bytes into the fields of sequence without
+//copying it, the string fields are left as views into data. Only the
+//fields in the mask of enum row_field are decoded, the others are
+//skipped unchecked. Returns -1 if the line is malformed.
+static int split_fields(char *data, size_t len, seq sequence,
+      unsigned int fields){
+   char *field[7];
+   size_t field_len[7];
+   unsigned long value;
+//Without the text the sequence field is found from the end of the line.
+   int want = fields & FIELD_SEQUENCE ? 7 : 6;
+   if(scan_fields(data,len,field,field_len,want) != want
+         || (want == 6 && !find_last_field(data,len,field,field_len))){
+      fprintf(stderr,"Invalid sequence: %.*s\n",(int)len,data);
+      return -1;
+   }
+   memset(sequence,0,sizeof(*sequence));
+//Second part is species name and contig, split on the first '.' only
+//since scaffold names may contain dots themselves.
+   sequence->src = sequence->species = sequence->scaffold = field[1];
+   if(fields & FIELD_SRC){
+      sequence->src_len = field_len[1];
+      char *dot = memchr(field[1],'.',field_len[1]);
+      if(dot == NULL) dot = field[1]+field_len[1];
+      sequence->species_len = dot-field[1];
+      sequence->scaffold = dot < field[1]+field_len[1] ? dot+1 : dot;
+      sequence->scaffold_len = field[1]+field_len[1]-sequence->scaffold;
+   }
 //Third part is the start of the aligned region in the source sequence
-      case 3:
-        errno=0;
-        unsigned long start = strtol(datum,NULL,10);   
-        if(errno !=0){
-           fprintf(stderr, "Invalid sequence start: %s\nIn sequence: %s\n"
-             ,datum,data);
-           free_sequence(new_seq);
-           return NULL;
-        }
-       new_seq->start=start;
-       break;
+   if((fields & FIELD_START)
+         && parse_decimal(field[2],field_len[2],&value) != 0){
+      fprintf(stderr, "Invalid sequence start: %.*s\nIn sequence: %.*s\n"
+         ,(int)field_len[2],field[2],(int)len,data);
+      return -1;
+   }
+   if(fields & FIELD_START) sequence->start = value;
 //Fourth is aligned sequence length
-      case 4:
-        errno=0;
-        unsigned int size = strtol(datum,NULL,10);
-        if(errno !=0){
-           fprintf(stderr, "Invalid sequence start: %s\nIn sequence: %s\n"
-             ,datum,data);
-           free_sequence(new_seq);
-           return NULL; 
-        }
-        new_seq->size = size;
-        break;
+   if((fields & FIELD_SIZE)
+         && parse_decimal(field[3],field_len[3],&value) != 0){
+      fprintf(stderr, "Invalid sequence size: %.*s\nIn sequence: %.*s\n"
+         ,(int)field_len[3],field[3],(int)len,data);
+      return -1;
+   }
+   if(fields & FIELD_SIZE) sequence->size = value;
 //Fifth is strand
-      case 5:
-        if(datum[0] != '+' && datum[0] != '-'){
-           fprintf(stderr, "Invalid strand: %s\nIn sequence: %s\n"
-             ,datum,data);
-           free_sequence(new_seq);
-           return NULL;
-        }
-        new_seq->strand=datum[0];
-        break;
+   if((fields & FIELD_STRAND) && (field_len[4] != 1
+         || (field[4][0] != '+' && field[4][0] != '-'))){
+      fprintf(stderr, "Invalid strand: %.*s\nIn sequence: %.*s\n"
+         ,(int)field_len[4],field[4],(int)len,data);
+      return -1;
+   }
+   if(fields & FIELD_STRAND) sequence->strand = field[4][0];
 //Sixth is size of source sequence
-      case 6:
-        errno=0;
-        unsigned long srcSize = strtol(datum,NULL,10);
-        if(errno !=0){
-            fprintf(stderr, "Invalid source sequence size: %s\nIn sequence: %s\n"
-             ,datum,data);
-            free_sequence(new_seq);
-            return NULL;
-        }
-        new_seq->srcSize = srcSize;
-        break;
+   if((fields & FIELD_SRC_SIZE)
+         && parse_decimal(field[5],field_len[5],&value) != 0){
+      fprintf(stderr, "Invalid source sequence size: %.*s\nIn sequence: %.*s\n"
+         ,(int)field_len[5],field[5],(int)len,data);
+      return -1;
+   }
+   if(fields & FIELD_SRC_SIZE) sequence->srcSize = value;
 //Last is the sequence itself
-     case 7:
-         new_seq->sequence = strdup(datum);
-         assert(new_seq->sequence !=NULL);
-         break;
-     default:
-       printf("Default case\n");
-    }
-  }
-  free(temp);
-  return new_seq;
+   if(fields & FIELD_SEQUENCE) sequence->sequence = field[6];
+   if(fields & (FIELD_SEQUENCE | FIELD_SEQUENCE_LEN))
+      sequence->sequence_len = field_len[6];
+   sequence->species_id = sequence->src_id = NO_ID;
+   sequence->view = 1;
+   return 0;
+}
+
+static int split_sequence(char *data, size_t len, seq sequence){
+   return split_fields(data,len,sequence,ALL_FIELDS);
 }
 
+seq get_sequence(char *data){
+   if(data == NULL) return NULL;
+   struct _aligned_sequence fields;
+   if(split_sequence(data,strlen(data),&fields) != 0) return NULL;
+   return copy_sequence(&fields);
+}
 
-alignment_block array_next_alignment(maf_array_parser parser){
-   if(parser->curr_block==parser->size) return NULL;
-   ++parser->curr_block;
-   int check= fseek(parser->maf_file,
-        parser->alignment_blocks[parser->curr_block],SEEK_SET);
-   if(check !=0){
-      fprintf(stderr,"File seek error: %s\n",strerror(errno));
+//Parse an 's' line of len bytes without copying it. The string fields
+//of the returned sequence are views into data, so data must outlive it.
+seq get_sequence_view(char *data, size_t len){
+   if(data == NULL) return NULL;
+   seq new_seq = malloc(sizeof(*new_seq));
+   assert(new_seq!=NULL);
+   if(split_sequence(data,len,new_seq) != 0){
+      free(new_seq);
+      return NULL;
+   }
+   new_seq->owned = 1;
+   return new_seq;
+}
+
+//Code+1 of each byte that can be packed, 0 for those that can't.
+static const unsigned char base_codes[256] = {
+   ['A'] = BASE_A+1, ['C'] = BASE_C+1, ['G'] = BASE_G+1, ['T'] = BASE_T+1,
+   ['N'] = BASE_N+1, ['-'] = BASE_GAP+1, ['R'] = BASE_R+1, ['Y'] = BASE_Y+1,
+   ['K'] = BASE_K+1, ['M'] = BASE_M+1, ['S'] = BASE_S+1, ['W'] = BASE_W+1,
+   ['B'] = BASE_B+1, ['D'] = BASE_D+1, ['H'] = BASE_H+1, ['V'] = BASE_V+1,
+   ['a'] = BASE_A+1, ['c'] = BASE_C+1, ['g'] = BASE_G+1, ['t'] = BASE_T+1,
+   ['n'] = BASE_N+1, ['r'] = BASE_R+1, ['y'] = BASE_Y+1, ['k'] = BASE_K+1,
+   ['m'] = BASE_M+1, ['s'] = BASE_S+1, ['w'] = BASE_W+1, ['b'] = BASE_B+1,
+   ['d'] = BASE_D+1, ['h'] = BASE_H+1, ['v'] = BASE_V+1
+};
+
+//Pack the bases of a stored sequence into the block's arena. The row is
+//left unpacked if it holds a byte with no code, so the packed form can
+//always be turned back into the text.
+static void pack_sequence(arena mem, seq sequence){
+   unsigned int len = sequence->sequence_len;
+   size_t padded = (len+7)/8;
+   unsigned char *packed = arena_calloc(mem,padded*4);
+   unsigned char *soft_mask = arena_calloc(mem,padded);
+   const unsigned char *bases = (const unsigned char *)sequence->sequence;
+   for(unsigned int i = 0; i < len; ++i){
+      unsigned char code = base_codes[bases[i]];
+      if(code == 0) return;
+      packed[i>>1] |= (code-1) << ((i&1)<<2);
+//Lower case letters have the 0x20 bit set, '-' is the only other byte
+//with a code and it's 0x2d, so exclude it.
+      if((bases[i] & 0x20) && bases[i] != '-')
+         soft_mask[i>>3] |= 1 << (i&7);
+   }
+   sequence->packed = packed;
+   sequence->soft_mask = soft_mask;
+}
+
+//Store a split sequence in new_seq. When copy is set the string fields
+//are copied into the block's arena, otherwise they stay views. When
+//pack is set the bases are packed as well.
+static void store_sequence(arena mem, seq new_seq, seq fields, int copy,
+      int pack){
+   *new_seq = *fields;
+   if(pack && fields->sequence != NULL) pack_sequence(mem,new_seq);
+   if(!copy) return;
+   new_seq->src = arena_strndup(mem,fields->src,fields->src_len);
+   new_seq->species = arena_strndup(mem,fields->species,fields->species_len);
+   new_seq->scaffold = arena_strndup(mem,fields->scaffold,fields->scaffold_len);
+   if(fields->sequence != NULL)
+      new_seq->sequence = arena_strndup(mem,fields->sequence,
+            fields->sequence_len);
+   new_seq->view = 0;
+}
+
+//Give a split sequence the IDs of its species and src names, unless
+//src wasn't decoded.
+static void intern_sequence(intern_table species_ids, intern_table src_ids,
+      seq fields){
+   if(fields->src_len == 0) return;
+   fields->species_id = intern_string(species_ids,fields->species,
+      fields->species_len);
+   fields->src_id = intern_string(src_ids,fields->src,fields->src_len);
+}
+
+static seq arena_sequence(arena mem, seq fields, int copy){
+   seq new_seq = arena_alloc(mem,sizeof(*new_seq));
+   store_sequence(mem,new_seq,fields,copy,0);
+   return new_seq;
+}
+
+//'i', 'e' and 'q' lines describe the rows of the block they're in.
+static inline int is_span_type(char type){
+   return type == 'i' || type == 'e' || type == 'q';
+}
+
+static void clear_lines(block_lines lines){
+   lines->spans = NULL;
+   lines->size = lines->max = 0;
+}
+
+//Keep an 'i', 'e' or 'q' line of a block as a span, copied into the
+//block's arena when copy is set since the parser's buffer gets reused.
+static void add_line_span(arena mem, block_lines lines, char *line,
+      size_t len, char type, int copy){
+   if(lines->size == lines->max){
+      int new_max = lines->max > 0 ? 2*lines->max : 8;
+      lines->spans = lines->max > 0 ? arena_grow(mem,lines->spans,
+            lines->max*sizeof(*lines->spans),new_max*sizeof(*lines->spans))
+         : arena_alloc(mem,new_max*sizeof(*lines->spans));
+      lines->max = new_max;
+   }
+   line_span span = &lines->spans[lines->size++];
+   span->line = copy ? arena_strndup(mem,line,len) : line;
+   span->len = len;
+   span->type = type;
+}
+
+//First line of the type whose src is src, NULL if the block has none.
+line_span find_line_span(block_lines lines, char type, const char *src,
+      size_t src_len){
+   char *field[7];
+   size_t field_len[7];
+   for(int i = 0; i < lines->size; ++i){
+      line_span span = &lines->spans[i];
+      if(span->type != type
+            || scan_fields(span->line,span->len,field,field_len,2) < 2)
+         continue;
+      if(field_len[1] == src_len && !memcmp(field[1],src,src_len))
+         return span;
+   }
+   return NULL;
+}
+
+//Decode an 'i' line, the status and count of bases between this block
+//and the ones before and after it. Returns -1 if the line is malformed.
+int decode_info_line(line_span span, char *left_status,
+      unsigned long *left_count, char *right_status,
+      unsigned long *right_count){
+   char *field[7];
+   size_t field_len[7];
+   if(span->type != 'i' || scan_fields(span->line,span->len,field,field_len,7) != 6
+         || field_len[2] != 1 || field_len[4] != 1
+         || parse_decimal(field[3],field_len[3],left_count) != 0
+         || parse_decimal(field[5],field_len[5],right_count) != 0){
+      fprintf(stderr,"Invalid info line: %.*s\n",(int)span->len,span->line);
+      return -1;
+   }
+   *left_status = field[2][0];
+   *right_status = field[4][0];
+   return 0;
+}
+
+//Decode an 'e' line into the fields of a row with no bases, the string
+//fields are views into the line. status says why the row is empty.
+//Returns -1 if the line is malformed.
+int decode_empty_line(line_span span, seq fields, char *status){
+   if(span->type != 'e' || split_sequence(span->line,span->len,fields) != 0
+         || fields->sequence_len != 1){
+      fprintf(stderr,"Invalid empty line: %.*s\n",(int)span->len,span->line);
+      return -1;
+   }
+   *status = fields->sequence[0];
+   fields->sequence = NULL;
+   fields->sequence_len = 0;
+   return 0;
+}
+
+//Decode a 'q' line, setting quality to a view of its quality string.
+//Returns -1 if the line is malformed.
+int decode_quality_line(line_span span, char **quality, size_t *len){
+   char *field[7];
+   size_t field_len[7];
+   if(span->type != 'q'
+         || scan_fields(span->line,span->len,field,field_len,7) != 3){
+      fprintf(stderr,"Invalid quality line: %.*s\n",(int)span->len,span->line);
+      return -1;
+   }
+   *quality = field[2];
+   *len = field_len[2];
+   return 0;
+}
+
+static alignment_block parse_block(maf_array_parser parser, arena mem,
+      index_entry entry, char *data, size_t bytesread, int copy);
+
+//Read the bytes of entry into data with pread, which leaves the file
+//position alone, so threads can read one file at once. BGZF blocks are
+//inflated as they're read. Returns -1 on error.
+static int pread_block(maf_array_parser parser, index_entry entry,
+      char *data, size_t *bytesread){
+   int fd = fileno(parser->maf_file);
+   if(parser->bgzf != NULL)
+      return bgzf_pread(fd,parser->filename,entry->offset,data,entry->length,
+            bytesread);
+   *bytesread = 0;
+   while(*bytesread < entry->length){
+      ssize_t got = pread(fd,data+*bytesread,entry->length-*bytesread,
+            entry->offset+*bytesread);
+      if(got < 0 && errno == EINTR) continue;
+      if(got < 0){
+         fprintf(stderr, "File read error: %s\nError: %s\n",
+            parser->filename,strerror(errno));
+         return -1;
+      }
+      if(got == 0) break;
+      *bytesread += got;
+   }
+   return 0;
+}
+
+//Read the block'th block of the index from the file. The index gives
+//the block's length, so the whole block is read at once. BGZF files are
+//read through the parser's reader, which inflates ahead of it.
+static alignment_block read_block(maf_array_parser parser, uint64_t block){
+   index_entry entry = &parser->index->entries[block];
+   arena mem = get_arena(parser->pool);
+   char *data = arena_alloc(mem,entry->length+1);
+   size_t bytesread;
+   if(parser->bgzf != NULL){
+      if(bgzf_seek(parser->bgzf,entry->offset) != 0){
+         release_arena(mem);
+         return NULL;
+      }
+      bytesread = bgzf_read(parser->bgzf,data,entry->length);
+      if(parser->bgzf->error){
+         release_arena(mem);
+         return NULL;
+      }
+   }else if(pread_block(parser,entry,data,&bytesread) != 0){
+      release_arena(mem);
       return NULL;
    }
-   char buffer[4096];
-//First read 'a' line and initialize alignment struct
-   alignment_block new_align=malloc(sizeof(*new_align));
-   assert(new_align != NULL);
-   new_align->sequences = malloc(2*sizeof(*new_align->sequences));
-   assert(new_align->sequences != NULL);
+   return parse_block(parser,mem,entry,data,bytesread,0);
+}
+
+//Decode the block'th block of the index on its own, reading it with
+//pread into *buf, grown to fit as getline does. No state of the parser
+//changes, so any number of threads may decode blocks of one parser at
+//once, each with its own buffer. The block's rows and lines are copied
+//into its arena, so buf can be reused as soon as it returns. With a
+//block cache, cached blocks are returned without reading. Returns NULL
+//on error.
+alignment_block decode_block(maf_array_parser parser, uint64_t block,
+      char **buf, size_t *buf_size){
+   if(block >= (uint64_t)parser->size){
+      fprintf(stderr, "No block %llu in file: %s\n",
+         (unsigned long long)block,parser->filename);
+      return NULL;
+   }
+   alignment_block aln;
+   if(parser->cache != NULL
+         && (aln = cache_lookup(parser->cache,block)) != NULL)
+      return aln;
+   index_entry entry = &parser->index->entries[block];
+   if(*buf == NULL || *buf_size < entry->length+1){
+      free(*buf);
+      *buf_size = entry->length+1;
+      *buf = malloc(*buf_size);
+      assert(*buf != NULL);
+   }
+   size_t bytesread;
+   if(pread_block(parser,entry,*buf,&bytesread) != 0) return NULL;
+   aln = parse_block(parser,get_arena(parser->pool),entry,*buf,bytesread,1);
+   if(aln != NULL && parser->cache != NULL)
+      aln = cache_insert(parser->cache,block,aln);
+   return aln;
+}
+
+//Parse a block read whole into data, bytesread bytes, from mem, which
+//the block then owns. Its lines are copied into mem when copy is set,
+//otherwise data must be in mem. mem is released if the block can't be
+//parsed.
+static alignment_block parse_block(maf_array_parser parser, arena mem,
+      index_entry entry, char *data, size_t bytesread, int copy){
+   data[bytesread] = '\0';
+   if(bytesread == 0 || data[0] != 'a'){
+      fprintf(stderr, "Index does not match file: %s\n",parser->filename);
+      release_arena(mem);
+      return NULL;
+   }
+//First initialize alignment struct from the 'a' line
+   alignment_block new_align=arena_alloc(mem,sizeof(*new_align));
+   new_align->mem = mem;
+   new_align->reusable = 0;
+   new_align->cached = NULL;
+   new_align->sequences = arena_alloc(mem,2*sizeof(*new_align->sequences));
    new_align->size=new_align->curr_seq=0;
    new_align->max=2;
-   char *fc = fgets(buffer,4096,parser->maf_file);
-   if(ferror(parser->maf_file) != 0){
-          fprintf(stderr, "File stream error: %s\nError: %s",
-             parser->filename,strerror(errno));
-          return NULL;
-   }
+   new_align->seq_length=0;
+   new_align->offset = entry->offset;
+   new_align->length = entry->length;
+   clear_lines(&new_align->lines);
 //***HANDLE SCORE/PASS/DATA here***
    new_align->data = NULL;
-   seq new_seq;
-   while(!feof(parser->maf_file)){
-      char *fc = fgets(buffer,4096,parser->maf_file);
-      if(ferror(parser->maf_file) != 0){
-          fprintf(stderr, "File stream error: %s\nError: %s",
-             parser->filename,strerror(errno));
-          return NULL;
-      }
-      if(buffer[0]!='s')break;
-      new_seq = get_sequence(buffer);
-      if(new_seq == NULL){
-        fprintf(stderr, "Invalid sequence entry %s\n",buffer);
+   struct _aligned_sequence fields;
+   char *end = data+bytesread;
+   char *line = memchr(data,'\n',bytesread);
+   while(line != NULL && ++line < end){
+      char *newline = memchr(line,'\n',end-line);
+      size_t len = (newline != NULL ? newline : end)-line;
+      if(is_span_type(line[0])){
+         add_line_span(mem,&new_align->lines,line,len,line[0],copy);
+         line = newline;
+         continue;
+      }
+      if(line[0] != 's') break;
+      if(split_sequence(line,len,&fields) != 0){
+        fprintf(stderr, "Invalid sequence entry %.*s\n",(int)len,line);
+        release_arena(mem);
         return NULL;
       }
+      intern_sequence(parser->species_ids,parser->src_ids,&fields);
+      if(new_align->size == 0) new_align->seq_length=fields.sequence_len;
       if(new_align->size ==new_align->max){
-          new_align->sequences=realloc(new_align->sequences,
-             2*new_align->max*sizeof(seq));
-          assert(new_align->sequences!=NULL);
+          new_align->sequences=arena_grow(mem,new_align->sequences,
+             new_align->max*sizeof(seq),2*new_align->max*sizeof(seq));
           new_align->max *=2;
-      }new_align->sequences[new_align->size++]=new_seq;
+      }new_align->sequences[new_align->size++]=arena_sequence(mem,&fields,1);
+      line = newline;
    }
    return new_align;
 }
 
-sorted_alignment_block get_sorted_alignment(maf_linear_parser parser, 
-                    char **in_group, int in_size, char **out_group, int out_size){
-   sorted_alignment_block new_align = NULL;
+//Reads through io_uring of the blocks listed, or of every block when
+//blocks is NULL, starting at position first. NULL for BGZF files, which
+//are located by virtual offsets, or if there's no ring to be had.
+static block_reads get_block_reads(maf_array_parser parser, uint64_t *blocks,
+      uint64_t size, uint64_t first){
+   if(parser->bgzf != NULL) return NULL;
+   uring ring = get_uring(BLOCK_READS);
+   if(ring == NULL) return NULL;
+   block_reads reads = calloc(1,sizeof(*reads));
+   assert(reads != NULL);
+   reads->ring = ring;
+   reads->blocks = blocks;
+   reads->size = size;
+   reads->next_issue = reads->next_take = first;
+   return reads;
+}
+
+static inline uint64_t block_at(block_reads reads, uint64_t pos){
+   return reads->blocks != NULL ? reads->blocks[pos] : pos;
+}
+
+//Queue reads of the blocks after those in flight, up to BLOCK_READS
+//ahead of the next block taken, so the device sees many at once.
+static void issue_block_reads(maf_array_parser parser, block_reads reads){
+   while(reads->next_issue < reads->size
+         && reads->next_issue-reads->next_take < BLOCK_READS){
+      index_entry entry = &parser->index->entries[block_at(reads,
+            reads->next_issue)];
+      block_read slot = &reads->slots[reads->next_issue % BLOCK_READS];
+      slot->mem = get_arena(parser->pool);
+      slot->data = arena_alloc(slot->mem,entry->length+1);
+      slot->offset = entry->offset;
+      slot->len = entry->length;
+      slot->got = 0;
+      slot->error = slot->done = 0;
+      if(uring_read(reads->ring,fileno(parser->maf_file),slot->data,slot->len,
+            slot->offset,reads->next_issue) != 0){
+         release_arena(slot->mem);
+         break;
+      }
+      ++reads->next_issue;
+   }
+   uring_submit(reads->ring);
+}
+
+//Wait for a block read to complete, continuing it if it came up short.
+//Returns -1 if none is in flight or on error.
+static int reap_block_read(maf_array_parser parser, block_reads reads,
+      int stopping){
+   uint64_t pos;
+   int res;
+   if(uring_wait(reads->ring,&pos,&res) != 0) return -1;
+   block_read slot = &reads->slots[pos % BLOCK_READS];
+   if(res < 0) slot->error = -res;
+   else slot->got += res;
+   if(res > 0 && slot->got < slot->len && !stopping
+         && uring_read(reads->ring,fileno(parser->maf_file),
+            slot->data+slot->got,slot->len-slot->got,slot->offset+slot->got,
+            pos) == 0){
+      uring_submit(reads->ring);
+      return 0;
+   }
+   slot->done = 1;
+   return 0;
+}
+
+//The next block of reads, once its read is in. Returns NULL after the
+//last block or on error.
+static alignment_block take_block_read(maf_array_parser parser,
+      block_reads reads){
+   if(reads->next_take >= reads->size) return NULL;
+   issue_block_reads(parser,reads);
+   uint64_t pos = reads->next_take;
+   block_read slot = &reads->slots[pos % BLOCK_READS];
+   while(!slot->done){
+      if(reap_block_read(parser,reads,0) != 0){
+         fprintf(stderr, "File read error: %s\n",parser->filename);
+         return NULL;
+      }
+   }
+//The slot is reused by the next read queued, so take the block first.
+   struct _block_read done = *slot;
+   ++reads->next_take;
+   issue_block_reads(parser,reads);
+   if(done.error != 0){
+      fprintf(stderr, "File stream error: %s\nError: %s\n",
+         parser->filename,strerror(done.error));
+      release_arena(done.mem);
+      return NULL;
+   }
+   return parse_block(parser,done.mem,&parser->index->entries[block_at(reads,
+         pos)],done.data,done.got,0);
+}
+
+static void free_block_reads(maf_array_parser parser, block_reads reads){
+   if(reads == NULL) return;
+//The kernel writes to the blocks still being read, so wait for them.
+   while(reap_block_read(parser,reads,1) == 0);
+   for(uint64_t pos = reads->next_take; pos < reads->next_issue; ++pos)
+      release_arena(reads->slots[pos % BLOCK_READS].mem);
+   free_uring(reads->ring);
+   free(reads);
+}
+
+//Block block through the parser's cache, read with read_block on a miss.
+static alignment_block read_cached_block(maf_array_parser parser,
+      uint64_t block){
+   alignment_block aln = cache_lookup(parser->cache,block);
+   if(aln != NULL) return aln;
+   aln = read_block(parser,block);
+   return aln != NULL ? cache_insert(parser->cache,block,aln) : NULL;
+}
+
+alignment_block array_next_alignment(maf_array_parser parser){
+   if(parser->curr_block>=parser->size) return NULL;
+   if(parser->cache != NULL)
+      return read_cached_block(parser,parser->curr_block++);
+//Reads ahead are started at the current block, and again if the caller
+//has moved curr_block since.
+   if(parser->reads != NULL
+         && parser->reads->next_take != (uint64_t)parser->curr_block){
+      free_block_reads(parser,parser->reads);
+      parser->reads = NULL;
+   }
+   if(parser->reads == NULL && !parser->no_reads){
+      parser->reads = get_block_reads(parser,NULL,parser->size,
+            parser->curr_block);
+      parser->no_reads = parser->reads == NULL;
+   }
+   if(parser->reads != NULL){
+      ++parser->curr_block;
+      return take_block_read(parser,parser->reads);
+   }
+   return read_block(parser,parser->curr_block++);
+}
+
+//Parse a region of the form src:start-end, where src is species.scaffold
+//and start and end are 1-based and inclusive. Without :start-end the
+//region is the whole of src.
+maf_region_query get_region_query(maf_array_parser parser, char *region){
+   char *colon = strrchr(region,':');
+   size_t src_len = colon == NULL ? strlen(region) : (size_t)(colon-region);
+   unsigned long long start = 1, end = UINT64_MAX;
+   if(colon != NULL){
+      char *endptr;
+      start = strtoull(colon+1,&endptr,10);
+      if(*endptr != '-' || endptr == colon+1){
+         fprintf(stderr, "Invalid region: %s\n",region);
+         return NULL;
+      }
+      char *end_str = endptr+1;
+      end = strtoull(end_str,&endptr,10);
+      if(*endptr != '\0' || endptr == end_str || start == 0 || end < start){
+         fprintf(stderr, "Invalid region: %s\n",region);
+         return NULL;
+      }
+   }
+   maf_region_query query = malloc(sizeof(*query));
+   assert(query != NULL);
+   query->parser = parser;
+   query->curr = 0;
+   query->blocks = index_overlaps(parser->index,region,src_len,start-1,end,
+      &query->size);
+//Every block of the region is known up front, so reads are queued for
+//as many as the ring holds, unless they're read through a cache.
+   query->reads = NULL;
+   if(!parser->no_reads && parser->cache == NULL){
+      query->reads = get_block_reads(parser,query->blocks,query->size,0);
+      parser->no_reads = query->reads == NULL;
+   }
+   return query;
+}
+
+alignment_block region_next_alignment(maf_region_query query){
+   if(query->curr >= query->size) return NULL;
+   if(query->reads != NULL){
+      ++query->curr;
+      return take_block_read(query->parser,query->reads);
+   }
+   if(query->parser->cache != NULL)
+      return read_cached_block(query->parser,query->blocks[query->curr++]);
+   return read_block(query->parser,query->blocks[query->curr++]);
+}
+
+void free_region_query(maf_region_query query){
+   if(query == NULL) return;
+   free_block_reads(query->parser,query->reads);
+   free(query->blocks);
+   free(query);
+}
+
+//Refill the parser's buffer, carrying over the partial line left at the
+//end of the previous fill. Returns 0 on success and -1 on error.
+static int fill_buffer(maf_linear_parser parser);
+
+//Reject gzip input that isn't BGZF.
+static int check_not_gzip(maf_linear_parser parser, char *data, size_t len){
+   if(len >= 2 && (unsigned char)data[0] == 31
+         && (unsigned char)data[1] == 139){
+      fprintf(stderr, "Compressed input must be BGZF (bgzip): %s\n",
+         parser->filename);
+      return -1;
+   }
+   return 0;
+}
+
+//Grow the buffer to at least size bytes. The buffer keeps the larger
+//size from then on, so it ends up fitting the longest line seen.
+static void grow_buffer(maf_linear_parser parser, size_t size){
+   size_t new_size = parser->buf_size;
+   while(new_size < size) new_size *= 2;
+   if(new_size == parser->buf_size) return;
+   parser->buf = realloc(parser->buf,new_size);
+   assert(parser->buf != NULL);
+   parser->buf_size = new_size;
+}
+
+//Move on to the read-ahead thread's next buffer, copying the partial
+//line left at the end of the current one into the headroom in front of
+//it. The buffers themselves are parsed in place.
+static int next_ahead_buffer(maf_linear_parser parser){
+   size_t leftover = parser->end - parser->pos;
+   size_t len;
+   char *data = next_read_buffer(parser->ahead,&len);
+   if(data == NULL){
+      if(parser->ahead->error) return -1;
+      parser->eof = 1;
+      return 0;
+   }
+//BGZF input is read by the BGZF reader, which reads ahead itself.
+   if(!parser->format_checked){
+      parser->format_checked = 1;
+      if(is_bgzf((unsigned char *)data,len)){
+         char *pending = drain_read_ahead(parser->ahead,&len);
+         parser->bgzf = get_bgzf_reader(parser->maf_file,parser->filename,
+            pending,len,parser->threads);
+         free(pending);
+         free_read_ahead(parser->ahead);
+         parser->ahead = NULL;
+         return fill_buffer(parser);
+      }
+      if(check_not_gzip(parser,data,len) != 0) return -1;
+   }
+   parser->buf_offset += parser->pos-parser->base;
+//A partial line too long for the headroom is joined to the new buffer
+//in the parser's own buffer instead, grown to fit.
+   if(leftover > READ_AHEAD_HEADROOM){
+//The partial line may already be in the parser's buffer from the last
+//time, so move it before growing rather than after.
+      if(parser->pos >= parser->buf
+            && parser->pos < parser->buf+parser->buf_size){
+         memmove(parser->buf,parser->pos,leftover);
+         grow_buffer(parser,leftover+len+1);
+      }else{
+         grow_buffer(parser,leftover+len+1);
+         memcpy(parser->buf,parser->pos,leftover);
+      }
+      memcpy(parser->buf+leftover,data,len);
+      parser->base = parser->pos = parser->buf;
+      parser->end = parser->buf+leftover+len;
+   }else{
+      memcpy(data-leftover,parser->pos,leftover);
+      parser->base = parser->pos = data-leftover;
+      parser->end = data+len;
+   }
+   *parser->end = 0;
+   release_read_buffers(parser->ahead);
+   return 0;
+}
+
+static int fill_buffer(maf_linear_parser parser){
+   if(parser->ahead != NULL) return next_ahead_buffer(parser);
+   size_t start = parser->pos-parser->buf;
+   size_t end = parser->end-parser->buf;
+   size_t leftover = end-start;
+   parser->buf_offset += parser->pos-parser->base;
+//Lines before the partial one are done with, so their BGZF blocks will
+//never be looked up again.
+   if(parser->bgzf != NULL)
+      bgzf_release_history(parser->bgzf,parser->buf_offset);
+//The partial line left over is read onto in place. It's only moved to
+//the front once less than half the buffer is free after it, and the
+//buffer doubles when the partial line fills half of it, so each read
+//is at least half the buffer.
+   if(leftover >= parser->buf_size/2) grow_buffer(parser,2*parser->buf_size);
+   if(parser->buf_size-1-end < parser->buf_size/2){
+      memmove(parser->buf,parser->buf+start,leftover);
+      start = 0;
+      end = leftover;
+   }
+   char *data = parser->buf+end;
+   size_t room = parser->buf_size-1-end;
+   size_t bytesread;
+   if(parser->bgzf != NULL){
+      bytesread = bgzf_read(parser->bgzf,data,room);
+      if(parser->bgzf->error) return -1;
+   }else bytesread = fread(data,1,room,parser->maf_file);
+   if(ferror(parser->maf_file) != 0){
+      fprintf(stderr, "File stream error: %s\nError: %s",
+         parser->filename,strerror(errno));
+      return -1;
+   }
+//The first bytes read show whether the file is BGZF compressed, if so
+//they are handed to a BGZF reader and the buffer is filled through it.
+   if(!parser->format_checked){
+      parser->format_checked = 1;
+      if(is_bgzf((unsigned char *)data,bytesread)){
+         parser->bgzf = get_bgzf_reader(parser->maf_file,parser->filename,
+            data,bytesread,parser->threads);
+         parser->base = parser->pos = parser->end = parser->buf+start;
+         return fill_buffer(parser);
+      }
+      if(check_not_gzip(parser,data,bytesread) != 0) return -1;
+   }
+   parser->base = parser->pos = parser->buf+start;
+   parser->end = data+bytesread;
+   *parser->end = 0;
+   if(bytesread == 0) parser->eof = 1;
+   return 0;
+}
+
+static inline void add_line(maf_linear_parser parser, size_t line_end){
+   if(parser->num_lines == parser->max_lines){
+      parser->max_lines *= 2;
+      parser->line_ends = realloc(parser->line_ends,
+         parser->max_lines*sizeof(*parser->line_ends));
+      assert(parser->line_ends != NULL);
+      parser->line_types = realloc(parser->line_types,parser->max_lines);
+      assert(parser->line_types != NULL);
+   }
+   parser->line_ends[parser->num_lines++] = line_end;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static size_t index_newlines_avx2(maf_linear_parser parser, char *base,
+      size_t from, size_t len){
+   const __m256i newline = _mm256_set1_epi8('\n');
+   size_t i = from;
+   for(; i+32 <= len; i += 32){
+      __m256i chunk = _mm256_loadu_si256((const __m256i *)(base+i));
+      unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk,newline));
+      while(mask){
+         add_line(parser,i+__builtin_ctz(mask));
+         mask &= mask-1;
+      }
+   }
+   return i;
+}
+#endif
+
+//Build the parser's line index over base[0,len): the offset of every
+//newline and the first byte of every complete line, found 32 (AVX2) or
+//16 (SSE2) bytes at a time. The readers then walk the index instead of
+//searching the buffer for each line. base[0,from) is known to hold no
+//newline and isn't searched again.
+static void index_lines(maf_linear_parser parser, char *base, size_t from,
+      size_t len){
+   size_t i = from;
+   parser->index_base = base;
+   parser->num_lines = parser->curr_line = 0;
+#ifdef HAVE_AVX2_DISPATCH
+   static int have_avx2 = -1;
+   if(have_avx2 < 0) have_avx2 = __builtin_cpu_supports("avx2");
+   if(have_avx2) i = index_newlines_avx2(parser,base,i,len);
+#endif
+#ifdef __SSE2__
+   const __m128i newline = _mm_set1_epi8('\n');
+   for(; i+16 <= len; i += 16){
+      __m128i chunk = _mm_loadu_si128((const __m128i *)(base+i));
+      unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,newline));
+      while(mask){
+         add_line(parser,i+__builtin_ctz(mask));
+         mask &= mask-1;
+      }
+   }
+#endif
+   for(; i < len; ++i)
+      if(base[i] == '\n') add_line(parser,i);
+   for(int line = 0; line < parser->num_lines; ++line)
+      parser->line_types[line] = base[line ? parser->line_ends[line-1]+1 : 0];
+}
+
+//Index the next stretch of input once the current index is used up.
+//Buffered parsers refill the buffer, mapped parsers index the next
+//window of the mapping, doubling it until it holds a whole line.
+//Returns -1 at end of file or on error, setting the parser's error flag
+//for the latter.
+static int refill_index(maf_linear_parser parser){
+   if(parser->error) return -1;
+   if(parser->num_lines > 0){
+      char *next = parser->index_base+parser->line_ends[parser->num_lines-1]+1;
+      parser->pos = next < parser->end ? next : parser->end;
+   }
+   while(1){
+      size_t window = parser->end-parser->pos;
+      if(parser->map != NULL){
+         if(window == 0) return -1;
+         size_t want = LINE_WINDOW;
+         while(1){
+            if(want > window) want = window;
+            index_lines(parser,parser->pos,0,want);
+            if(parser->num_lines > 0 || want == window) break;
+            want *= 2;
+         }
+      }else{
+         index_lines(parser,parser->pos,parser->scanned,window);
+         parser->scanned = parser->num_lines > 0 ? 0 : window;
+      }
+      if(parser->num_lines > 0) return 0;
+//No newline left, so either the file ends in a line without one or
+//the buffered parser needs to read more.
+      if(parser->map != NULL || parser->eof){
+         if(window == 0) return -1;
+         add_line(parser,window);
+         parser->line_types[0] = parser->pos[0];
+         return 0;
+      }
+      if(fill_buffer(parser) != 0){
+         parser->error = 1;
+         return -1;
+      }
+   }
+}
+
+//Return the next line of the file and store its length, without the
+//newline, in len and its first byte in type. Buffered lines are NUL
+//terminated in place, mapped lines are views into the mapping and are
+//not terminated. Returns NULL at end of file or on error.
+static char *next_line(maf_linear_parser parser, size_t *len, char *type){
+   char *line;
+   if(parser->held != NULL){
+      line = parser->held;
+      *len = parser->held_len;
+      *type = *len ? line[0] : '\0';
+      parser->held = NULL;
+      return line;
+   }
+   if(parser->curr_line == parser->num_lines && refill_index(parser) != 0)
+      return NULL;
+   int curr = parser->curr_line++;
+   size_t start = curr ? parser->line_ends[curr-1]+1 : 0;
+   line = parser->index_base+start;
+   *len = parser->line_ends[curr]-start;
+   *type = *len ? parser->line_types[curr] : '\0';
+   if(parser->map == NULL) line[*len] = '\0';
+   return line;
+}
+
+//Offset of a line returned by next_line in the uncompressed file.
+static uint64_t line_offset(maf_linear_parser parser, char *line){
+   if(parser->map != NULL) return line-parser->map;
+   return parser->buf_offset+(line-parser->base);
+}
+
+//Offset to seek to for a line, a virtual offset for BGZF files.
+static uint64_t seek_offset(maf_linear_parser parser, uint64_t offset){
+   if(parser->bgzf != NULL) return bgzf_virtual_offset(parser->bgzf,offset);
+   return offset;
+}
+
+//Skip the block whose 'a' line is line if the parser's filter rules it
+//out. Lines of it already indexed are stepped over, and past them
+//indexing starts again at the end of the block, so its bytes are never
+//read. Returns 1 if the block was skipped.
+static int skip_block(maf_linear_parser parser, char *line){
+   if(parser->skip_index == NULL) return 0;
+   int64_t block = index_find_block(parser->skip_index,line-parser->map,
+         parser->skip_hint);
+   if(block < 0) return 0;
+   parser->skip_hint = block+1;
+   if(index_block_has_species(parser->skip_index,block,parser->skip_mask))
+      return 0;
+   char *end = line+parser->skip_index->entries[block].length;
+   if(end > parser->end) end = parser->end;
+   while(parser->curr_line < parser->num_lines
+         && parser->index_base+(parser->curr_line
+            ? parser->line_ends[parser->curr_line-1]+1 : 0) < end)
+      ++parser->curr_line;
+   if(parser->curr_line == parser->num_lines){
+      parser->pos = end;
+      parser->num_lines = parser->curr_line = 0;
+   }
+   return 1;
+}
+
+//Hand a line back to the parser so the next call to next_line returns
+//it again, used when the 'a' line of the following block is read.
+static void unread_line(maf_linear_parser parser, char *line, size_t len){
+   parser->held = line;
+   parser->held_len = len;
+}
+
+//Room for the next row of a block's sequence array. Rows of arena
+//blocks are allocated in the arena. Reusable blocks keep their array
+//and the rows it points to from one fill to the next, so they only
+//allocate once a block has more rows than any before it.
+static seq add_row(arena mem, int reusable, seq **rows, int *size, int *max){
+   if(*size == *max){
+      if(reusable){
+         *rows = realloc(*rows,2*(*max)*sizeof(seq));
+         assert(*rows != NULL);
+         memset(*rows+*max,0,(*max)*sizeof(seq));
+      }else *rows = arena_grow(mem,*rows,(*max)*sizeof(seq),2*(*max)*sizeof(seq));
+      *max *= 2;
+   }
+   seq *slot = &(*rows)[(*size)++];
+   if(!reusable) *slot = arena_alloc(mem,sizeof(**slot));
+   else if(*slot == NULL){
+      *slot = malloc(sizeof(**slot));
+      assert(*slot != NULL);
+   }
+   return *slot;
+}
+
+static seq *new_rows(arena mem, int reusable, int max){
+   if(!reusable) return arena_alloc(mem,max*sizeof(seq));
+   seq *rows = calloc(max,sizeof(seq));
+   assert(rows != NULL);
+   return rows;
+}
+
+//Find the species name at the start of the src field of an 's' line,
+//returning its length.
+static size_t species_token(char *data, size_t len, char **species){
+   size_t i = 1;
+   while(i < len && (unsigned char)data[i] <= ' ') ++i;
+   *species = data+i;
+   size_t start = i;
+   while(i < len && (unsigned char)data[i] > ' ' && data[i] != '.') ++i;
+   return i-start;
+}
+
+//Species set for the groups, compiled on the first call and kept on the
+//parser while the same group arrays are passed.
+static species_set parser_groups(maf_linear_parser parser, char **in_group,
+      int in_size, char **out_group, int out_size){
+   if(parser->groups == NULL || !species_set_matches(parser->groups,
+            in_group,in_size,out_group,out_size)){
+      free_species_set(parser->groups);
+      parser->groups = get_species_set(in_group,in_size,out_group,out_size);
+   }
+   return parser->groups;
+}
+
+//Read the next block's lines into aln, which has been emptied by the
+//caller. Returns 1 if a block was read, 0 at the end of the file and -1
+//on error.
+static int fill_sorted_alignment(maf_linear_parser parser,
+      sorted_alignment_block new_align, species_set groups){
    int in_block=0;
-   long bytesread;
-   int sizeLeftover=0;
-   int bLoopCompleted = 0;
    int first = 1;
    char *datum;
-   char *npos;
-   char *temp;
-   char *species;
-   do{
-      if(parser->fill_buf){
-         bytesread = fread(parser->buf+sizeLeftover, 1,
-            sizeof(parser->buf)-1-sizeLeftover, parser->maf_file);
-         if (bytesread<1){
-            bLoopCompleted = 1;
-            bytesread  = 0;
-            continue;
-         }
-        if(ferror(parser->maf_file) != 0){
-                fprintf(stderr, "File stream error: %s\nError: %s",
-                   parser->filename,strerror(errno));
-                return NULL;
-         }
-         parser->buf[sizeLeftover+bytesread]=0;
-         parser->curr_pos=0;
-         parser->pos=parser->buf;
-         --parser->fill_buf;
-     }
-     npos = strchr(parser->pos,'\n');
-
-     if(npos==NULL){
-        sizeLeftover = strlen(parser->pos);
-        memmove(parser->buf,parser->buf+(sizeof(parser->buf))-sizeLeftover-1,sizeLeftover);
-        ++parser->fill_buf;
-        continue;
-     }
-     *npos=0;
-     datum = parser->pos;
-     parser->pos = npos+1;
+   size_t len;
+   char type;
+   while((datum = next_line(parser,&len,&type)) != NULL){
 //If we've yet to enter an alignment block, and the first character
 //of the line isn't 'a', then skip over it.
-      if(!in_block && datum[0]!='a') continue;
+      if(!in_block && type!='a') continue;
 //***HANDLE SCORE/PASS/DATA here**i
-      else if(datum[0]=='a'){
+      else if(type=='a'){
 //If we find an 'a' after entering a block, then this is a new block
-//so rewind the file pointer and break out of read loop.
+//so hand the line back and break out of read loop.
          if(in_block){
-            *npos='\n';
-            parser->pos = datum;
+            unread_line(parser,datum,len);
             break;
          }
-//Else we're starting a new alignment block, initialize the data
-//structure and set in_block to true.
-         new_align=malloc(sizeof(*new_align));
-         assert(new_align != NULL);
-         new_align->in_sequences = malloc(16*sizeof(*new_align->in_sequences));
-         assert(new_align->in_sequences != NULL);
-         new_align->in_size=0;
-         new_align->in_max=16;
-         new_align->out_sequences = malloc(16*sizeof(*new_align->out_sequences));
-         assert(new_align->out_sequences != NULL);
-         new_align->out_size=0;
-         new_align->out_max=16;
-         new_align->data = NULL;
-         new_align->seq_length=0;
+//Blocks the filter rules out are passed over unread.
+         if(skip_block(parser,datum)) continue;
+//Else we're starting a new alignment block, set in_block to true.
          in_block=1;
          continue;
       }
 //If in a block and find 's', then it's a sequence to add to the
-//current alignment block, parse it, reallocate alignment block's
-//sequence array if necessary, and store the new sequence.
-      else if(datum[0]=='s'){
-         seq new_seq = get_sequence(datum);
-         if(new_seq == NULL){
-           fprintf(stderr, "Invalid sequence entry %s\n",datum);
-           return NULL;
+//current alignment block, parse it and store it in the in or out
+//group's sequence array.
+      else if(type=='s'){
+//Classify the row by its species before parsing anything else, so rows
+//in neither group are skipped unparsed. The first row is parsed anyway
+//since it gives the block's length.
+         char *species;
+         size_t species_len = species_token(datum,len,&species);
+         enum species_group group = find_species(groups,species,species_len);
+         if(group == NO_GROUP && !first) continue;
+         struct _aligned_sequence fields;
+         if(split_fields(datum,len,&fields,parser->fields | FIELD_SRC) != 0){
+           fprintf(stderr, "Invalid sequence entry %.*s\n",(int)len,datum);
+           parser->error = 1;
+           return -1;
          }
          if(first){
-            new_align->seq_length=strlen(new_seq->sequence);
+            new_align->seq_length=fields.sequence_len;
             first = 0;
          }
-         temp = strdup(new_seq->src);
-         assert(temp != NULL);
-         species = strtok(temp,".");
-         if(in_list(species,in_group,in_size)){
-            if(new_align->in_size ==new_align->in_max){
-               new_align->in_sequences=realloc(new_align->in_sequences,
-                  2*new_align->in_max*sizeof(seq));
-               assert(new_align->in_sequences!=NULL);
-               new_align->in_max *=2;
-            }new_align->in_sequences[new_align->in_size++]=new_seq;
-         }else if(in_list(species,out_group,out_size)){
-            if(new_align->out_size ==new_align->out_max){
-               new_align->out_sequences=realloc(new_align->out_sequences,
-                  2*new_align->out_max*sizeof(seq));
-               assert(new_align->out_sequences!=NULL);
-               new_align->out_max *=2;
-            }new_align->out_sequences[new_align->out_size++]=new_seq;
-//If not in in group or out group, throw away.
-         }else free_sequence(new_seq);
-         free(temp);
+         if(group != NO_GROUP)
+            intern_sequence(parser->species_ids,parser->src_ids,&fields);
+         if(group == IN_GROUP)
+            store_sequence(new_align->mem,add_row(new_align->mem,
+                  new_align->reusable,&new_align->in_sequences,
+                  &new_align->in_size,&new_align->in_max),
+               &fields,parser->map==NULL,
+               parser->pack);
+         else if(group == OUT_GROUP)
+            store_sequence(new_align->mem,add_row(new_align->mem,
+                  new_align->reusable,&new_align->out_sequences,
+                  &new_align->out_size,&new_align->out_max),
+               &fields,parser->map==NULL,
+               parser->pack);
+//If not in in group or out group, throw away without copying it.
+      }
+//'i', 'e' and 'q' lines are part of the block, keep where they are and
+//decode them only if asked.
+      else if(is_span_type(type)){
+         add_line_span(new_align->mem,&new_align->lines,datum,len,type,
+               parser->map==NULL);
+         continue;
       }
 //If we hit a character other than 'a' or 's', then we've exited
 //the current alignment block, break out of the read loop and return
 //the current alignment block.
       else break;
-   }while(!bLoopCompleted);
+   }
+   if(parser->error) return -1;
+   return in_block;
+}
+
+static sorted_alignment_block new_sorted_alignment(arena mem, int reusable){
+   sorted_alignment_block new_align;
+   if(reusable){
+      new_align = malloc(sizeof(*new_align));
+      assert(new_align != NULL);
+   }else new_align = arena_alloc(mem,sizeof(*new_align));
+   new_align->mem = mem;
+   new_align->reusable = reusable;
+   new_align->in_sequences = new_rows(mem,reusable,16);
+   new_align->in_size=0;
+   new_align->in_max=16;
+   new_align->out_sequences = new_rows(mem,reusable,16);
+   new_align->out_size=0;
+   new_align->out_max=16;
+   clear_lines(&new_align->lines);
+   new_align->data = NULL;
+   new_align->seq_length=0;
    return new_align;
 }
-   
-hash_alignment_block get_next_alignment_hash(maf_linear_parser parser){
-   hash_alignment_block new_align = NULL;
+
+sorted_alignment_block get_sorted_alignment(maf_linear_parser parser, 
+                    char **in_group, int in_size, char **out_group, int out_size){
+   sorted_alignment_block new_align = new_sorted_alignment(
+         get_arena(parser->pool),0);
+   if(fill_sorted_alignment(parser,new_align,parser_groups(parser,in_group,
+            in_size,out_group,out_size)) <= 0){
+      release_arena(new_align->mem);
+      return NULL;
+   }
+   return new_align;
+}
+
+//A sorted block owned by the caller and refilled in place by
+//refill_sorted_alignment. Free it with free_sorted_alignment.
+sorted_alignment_block get_reusable_sorted_alignment(maf_linear_parser parser){
+   return new_sorted_alignment(get_arena(parser->pool),1);
+}
+
+int refill_sorted_alignment(maf_linear_parser parser,
+      sorted_alignment_block aln, char **in_group, int in_size,
+      char **out_group, int out_size){
+   reset_arena(aln->mem);
+   clear_lines(&aln->lines);
+   aln->in_size = aln->out_size = 0;
+   aln->seq_length = 0;
+   return fill_sorted_alignment(parser,aln,parser_groups(parser,in_group,
+         in_size,out_group,out_size));
+}
+
+static uint32_t name_hash(const char *name, size_t len){
+   uint32_t hash = 2166136261u;
+   for(size_t i = 0; i < len; ++i) hash = (hash^(unsigned char)name[i])*16777619u;
+   return hash;
+}
+
+//Slot of the species in aln's table, or the empty slot it would take.
+static uint32_t find_species_slot(hash_alignment_block aln, const char *name,
+      size_t len, uint32_t hash){
+   uint32_t mask = aln->num_slots-1;
+   uint32_t slot = hash & mask;
+   while(aln->slots[slot] != 0){
+      species_entry entry = &aln->species[aln->slots[slot]-1];
+      if(entry->hash == hash && entry->len == len
+            && memcmp(entry->species,name,len) == 0) return slot;
+      slot = (slot+1) & mask;
+   }
+   return slot;
+}
+
+static uint32_t *new_slots(hash_alignment_block aln, uint32_t num_slots){
+   if(!aln->reusable) return arena_calloc(aln->mem,num_slots*sizeof(uint32_t));
+   uint32_t *slots = calloc(num_slots,sizeof(uint32_t));
+   assert(slots != NULL);
+   return slots;
+}
+
+//Double the table so it stays at most half full and put the species
+//back in.
+static void grow_species_table(hash_alignment_block aln){
+   if(aln->reusable) free(aln->slots);
+   aln->num_slots *= 2;
+   aln->slots = new_slots(aln,aln->num_slots);
+   uint32_t mask = aln->num_slots-1;
+   for(int i = 0; i < aln->size; ++i){
+      species_entry entry = &aln->species[i];
+      uint32_t slot = entry->hash & mask;
+      while(aln->slots[slot] != 0) slot = (slot+1) & mask;
+      aln->slots[slot] = i+1;
+      entry->slot = slot;
+   }
+}
+
+//Make row the row of its species, returns 0 if the species already has
+//one.
+static int add_species_row(hash_alignment_block aln, seq row){
+   uint32_t hash = name_hash(row->species,row->species_len);
+   uint32_t slot = find_species_slot(aln,row->species,row->species_len,hash);
+   if(aln->slots[slot] != 0) return 0;
+   if(aln->size == aln->max){
+      size_t old_size = aln->max*sizeof(struct _species_entry);
+      if(aln->reusable){
+         aln->species = realloc(aln->species,2*old_size);
+         assert(aln->species != NULL);
+      }else aln->species = arena_grow(aln->mem,aln->species,old_size,2*old_size);
+      aln->max *= 2;
+   }
+   species_entry entry = &aln->species[aln->size];
+   entry->species = row->species;
+   entry->len = row->species_len;
+   entry->hash = hash;
+   entry->slot = slot;
+   entry->row = row;
+   aln->slots[slot] = ++aln->size;
+   if(2*(uint32_t)aln->size > aln->num_slots) grow_species_table(aln);
+   return 1;
+}
+
+seq find_species_row(hash_alignment_block aln, const char *species, size_t len){
+   if(aln == NULL) return NULL;
+   uint32_t slot = find_species_slot(aln,species,len,name_hash(species,len));
+   if(aln->slots[slot] == 0) return NULL;
+   return aln->species[aln->slots[slot]-1].row;
+}
+
+static int fill_alignment_hash(maf_linear_parser parser,
+      hash_alignment_block new_align){
    int in_block=0;
-   int hc=0;
-   long bytesread;
-   int sizeLeftover=0;
-   int bLoopCompleted = 0;
-   char *temp;
    char *datum;
-   char *npos;
-   ENTRY *ret_val;
-   do{
-      if(parser->fill_buf){
-         bytesread = fread(parser->buf+sizeLeftover, 1,
-            sizeof(parser->buf)-1-sizeLeftover, parser->maf_file);
-         if (bytesread<1){
-            bLoopCompleted = 1;
-            bytesread  = 0;
-            continue;
-         }
-        if(ferror(parser->maf_file) != 0){
-                fprintf(stderr, "File stream error: %s\nError: %s",
-                   parser->filename,strerror(errno));
-                return NULL;
-         }
-         parser->buf[sizeLeftover+bytesread]=0;
-         parser->curr_pos=0;
-         parser->pos=parser->buf;
-         --parser->fill_buf;
-     }
-     npos = strchr(parser->pos,'\n');
-
-     if(npos==NULL){
-        sizeLeftover = strlen(parser->pos);
-        memmove(parser->buf,parser->buf+(sizeof(parser->buf))-sizeLeftover-1,sizeLeftover);
-        ++parser->fill_buf;
-        continue;
-     }
-     *npos=0;
-     datum = parser->pos;
-     parser->pos = npos+1;
+   size_t len;
+   char type;
+   while((datum = next_line(parser,&len,&type)) != NULL){
 //If we've yet to enter an alignment block, and the first character
 //of the line isn't 'a', then skip over it.
-      if(!in_block && datum[0]!='a') continue;
+      if(!in_block && type!='a') continue;
 //***HANDLE SCORE/PASS/DATA here**i
-      else if(datum[0]=='a'){
+      else if(type=='a'){
 //If we find an 'a' after entering a block, then this is a new block
-//so rewind the file pointer and break out of read loop.
+//so hand the line back and break out of read loop.
          if(in_block){
-            *npos='\n';
-            parser->pos = datum;
+            unread_line(parser,datum,len);
             break;
          }
-//Else we're starting a new alignment block, initialize the data
-//structure and set in_block to true.
-         new_align=malloc(sizeof(*new_align));
-         assert(new_align != NULL);
-	 new_align->species = malloc(256*sizeof(char *));
-         assert(new_align->species != NULL);
-         new_align->sequences = calloc(1,sizeof(struct hsearch_data));
-	 assert(new_align->sequences != NULL);
-         hc = hcreate_r(256,new_align->sequences);
-         if(hc == 0){
-           fprintf(stderr,"Failed to create hash table: %s\n", strerror(errno));
-           exit(1);
-         }
-	 new_align->size=0;
-         new_align->max=128;
-         new_align->data = NULL;
+//Blocks the filter rules out are passed over unread.
+         if(skip_block(parser,datum)) continue;
+//Else we're starting a new alignment block, set in_block to true.
          in_block=1;
          continue;
       }
 //If in a block and find 's', then it's a sequence to add to the
 //current alignment block, parse it, reallocate alignment block's
 //sequence array if necessary, and store the new sequence.
-      else if(datum[0]=='s'){
-         seq new_seq = get_sequence(datum);
-         new_align->seq_length = new_seq->size;
-         if(new_seq == NULL){
-           fprintf(stderr, "Invalid sequence entry %s\n",datum);
-           return NULL;
+      else if(type=='s'){
+         struct _aligned_sequence fields;
+         if(split_fields(datum,len,&fields,parser->fields | FIELD_SRC) != 0){
+           fprintf(stderr, "Invalid sequence entry %.*s\n",(int)len,datum);
+           parser->error = 1;
+           return -1;
          }
-         if(new_align->size >= new_align->max){
-            fprintf(stderr, "WARNING: Alignment block hash table over half full"
-		            "consider increasing max alignment hash size.\n"
-			    "Current size: %d\nMax size: %d\n",new_align->size,
-			    new_align->max);
-         }temp = strdup(new_seq->src);
-         assert(temp!=NULL);
-         char *species_name=strtok(temp,".");
-         ENTRY new_ent={species_name,new_seq};
-         hc = hsearch_r(new_ent,ENTER,&ret_val,new_align->sequences);
-         if(hc == 0){
-           fprintf(stderr,"Failed to insert into hash table: %s\n", strerror(errno));
-           exit(1);
-         }if(ret_val->data != new_ent.data){
-           fprintf(stderr, "Entry for species %s already present\n",species_name);
-           continue;
-	 }
-//         printf("Entry inserted: %s\n", genome_names[i]);
-         new_align->species[new_align->size++] = species_name;
+         intern_sequence(parser->species_ids,parser->src_ids,&fields);
+         seq new_seq = add_row(new_align->mem,new_align->reusable,
+               &new_align->rows,&new_align->rows_size,&new_align->rows_max);
+         store_sequence(new_align->mem,new_seq,&fields,parser->map==NULL,
+               parser->pack);
+         new_align->seq_length = new_seq->size;
+         if(!add_species_row(new_align,new_seq))
+           fprintf(stderr, "Entry for species %.*s already present\n",
+                 (int)new_seq->species_len,new_seq->species);
+         continue;
+      }
+//'i', 'e' and 'q' lines are part of the block, keep where they are and
+//decode them only if asked.
+      else if(is_span_type(type)){
+         add_line_span(new_align->mem,&new_align->lines,datum,len,type,
+               parser->map==NULL);
          continue;
       }
 //If we hit a character other than 'a' or 's', then we've exited
 //the current alignment block, break out of the read loop and return
 //the current alignment block.
       else break;
-   }while(!bLoopCompleted);
+   }
+   if(parser->error) return -1;
+   return in_block;
+}
+
+static hash_alignment_block new_hash_alignment(arena mem, int reusable){
+   hash_alignment_block new_align;
+   if(reusable){
+      new_align = malloc(sizeof(*new_align));
+      assert(new_align != NULL);
+      new_align->species = malloc(32*sizeof(struct _species_entry));
+      assert(new_align->species != NULL);
+   }else{
+      new_align = arena_alloc(mem,sizeof(*new_align));
+      new_align->species = arena_alloc(mem,32*sizeof(struct _species_entry));
+   }
+   new_align->mem = mem;
+   new_align->reusable = reusable;
+   new_align->num_slots = 64;
+   new_align->slots = new_slots(new_align,new_align->num_slots);
+   new_align->rows = new_rows(mem,reusable,16);
+   new_align->rows_size = 0;
+   new_align->rows_max = 16;
+   new_align->size=0;
+   new_align->max=32;
+   clear_lines(&new_align->lines);
+   new_align->data = NULL;
    return new_align;
 }
 
-alignment_block linear_next_alignment_buffer(maf_linear_parser parser){
-   alignment_block new_align = NULL;
-   int in_block=0;
+hash_alignment_block get_next_alignment_hash(maf_linear_parser parser){
+   hash_alignment_block new_align = new_hash_alignment(
+         get_arena(parser->pool),0);
+   if(fill_alignment_hash(parser,new_align) <= 0){
+      free_hash_alignment(new_align);
+      return NULL;
+   }
+   return new_align;
+}
 
-   long bytesread; 
-   int sizeLeftover=0; 
-   int bLoopCompleted = 0; 
+//A hash block owned by the caller and refilled in place by
+//refill_alignment_hash. Free it with free_hash_alignment.
+hash_alignment_block get_reusable_hash_alignment(maf_linear_parser parser){
+   return new_hash_alignment(get_arena(parser->pool),1);
+}
+
+int refill_alignment_hash(maf_linear_parser parser, hash_alignment_block aln){
+//Only the slots the last block's species took need emptying.
+   for(int i = 0; i < aln->size; ++i) aln->slots[aln->species[i].slot] = 0;
+   reset_arena(aln->mem);
+   clear_lines(&aln->lines);
+   aln->size = aln->rows_size = 0;
+   return fill_alignment_hash(parser,aln);
+}
+
+//Next row of a batch. Growing the array may move the rows, so they're
+//only pointed at once the batch is complete.
+static seq batch_row(alignment_batch batch){
+   if(batch->num_rows == batch->max_rows){
+      size_t old_size = batch->max_rows*sizeof(*batch->rows);
+      batch->rows = arena_grow(batch->mem,batch->rows,old_size,2*old_size);
+      batch->max_rows *= 2;
+   }
+   return &batch->rows[batch->num_rows++];
+}
+
+//Read the next block into new_align, putting its rows in batch's row
+//array rather than the block's own when batch isn't NULL.
+static int fill_alignment(maf_linear_parser parser, alignment_block new_align,
+      alignment_batch batch){
+   int in_block=0;
    char *datum;
-   int init=1;
-   char *npos;
+   size_t len;
+   char type;
    int first=1;
-   do{
-      if(parser->fill_buf){
-         bytesread = fread(parser->buf+sizeLeftover, 1, 
-            sizeof(parser->buf)-1-sizeLeftover, parser->maf_file);
-         if (bytesread<1){ 
-            bLoopCompleted = 1; 
-            bytesread  = 0;
-            continue; 
-         }       
-        if(ferror(parser->maf_file) != 0){
-                fprintf(stderr, "File stream error: %s\nError: %s",
-                   parser->filename,strerror(errno));
-                return NULL;
-         }
-         parser->buf[sizeLeftover+bytesread]=0;
-         parser->curr_pos=0;
-         parser->pos=parser->buf;
-         --parser->fill_buf;
-         init=1;
-     }
-     npos = strchr(parser->pos,'\n');
-     
-     if(npos==NULL){
-        sizeLeftover = strlen(parser->pos);
-        memmove(parser->buf,parser->buf+(sizeof(parser->buf))-sizeLeftover-1,sizeLeftover);
-        ++parser->fill_buf;
-        continue;
-     }
-     *npos=0;
-     datum = parser->pos;
-     parser->pos = npos+1;
+   uint64_t start=0;
+   while((datum = next_line(parser,&len,&type)) != NULL){
 //If we've yet to enter an alignment block, and the first character
 //of the line isn't 'a', then skip over it.
-      if(!in_block && datum[0]!='a') continue;
+      if(!in_block && type!='a') continue;
 //***HANDLE SCORE/PASS/DATA here**i
-      else if(datum[0]=='a'){
+      else if(type=='a'){
 //If we find an 'a' after entering a block, then this is a new block
-//so rewind the file pointer and break out of read loop.
+//so hand the line back and break out of read loop.
          if(in_block){
-            *npos='\n';
-            parser->pos = datum;
+            unread_line(parser,datum,len);
             break;
          }
-//Else we're starting a new alignment block, initialize the data
-//structure and set in_block to true.
-         new_align=malloc(sizeof(*new_align));
-         assert(new_align != NULL);
-         new_align->sequences = malloc(16*sizeof(*new_align->sequences));
-         assert(new_align->sequences != NULL);
-         new_align->size=new_align->curr_seq=0;
-         new_align->max=16;
-         new_align->data = NULL;
+//Blocks the filter rules out are passed over unread.
+         if(skip_block(parser,datum)) continue;
+//Else we're starting a new alignment block, note where it starts and
+//set in_block to true.
+         start = line_offset(parser,datum);
+         new_align->offset = seek_offset(parser,start);
+         if(new_align->offset == UINT64_MAX){
+            fprintf(stderr, "Unable to locate block at offset %llu in BGZF "
+               "file: %s\n",(unsigned long long)start,parser->filename);
+            parser->error = 1;
+            return -1;
+         }
+         new_align->length = len+1;
          in_block=1;
          continue;
       }
 //If in a block and find 's', then it's a sequence to add to the
 //current alignment block, parse it, reallocate alignment block's
 //sequence array if necessary, and store the new sequence.
-      else if(datum[0]=='s'){
-         seq new_seq = get_sequence(datum);
-         if(new_seq == NULL){
-           fprintf(stderr, "Invalid sequence entry %s\n",datum);
-           return NULL;
+      else if(type=='s'){
+         struct _aligned_sequence fields;
+         if(split_fields(datum,len,&fields,parser->fields) != 0){
+           fprintf(stderr, "Invalid sequence entry %.*s\n",(int)len,datum);
+           parser->error = 1;
+           return -1;
          }
+         intern_sequence(parser->species_ids,parser->src_ids,&fields);
+         new_align->length = line_offset(parser,datum)+len+1-start;
          if(first){
-            new_align->seq_length=strlen(new_seq->sequence);
+            new_align->seq_length=fields.sequence_len;
             first = 0;
          }
-         if(new_align->size ==new_align->max){
-             new_align->sequences=realloc(new_align->sequences,
-                2*new_align->max*sizeof(seq));
-             assert(new_align->sequences!=NULL);
-             new_align->max *=2;
-         }new_align->sequences[new_align->size++]=new_seq;
+         seq row;
+         if(batch != NULL){
+            row = batch_row(batch);
+            new_align->size++;
+         }else row = add_row(new_align->mem,new_align->reusable,
+               &new_align->sequences,&new_align->size,&new_align->max);
+         store_sequence(new_align->mem,row,&fields,parser->map==NULL,
+               parser->pack);
+         continue;
+      }
+//'i', 'e' and 'q' lines are part of the block, keep where they are and
+//decode them only if asked.
+      else if(is_span_type(type)){
+         add_line_span(new_align->mem,&new_align->lines,datum,len,type,
+               parser->map==NULL);
+         new_align->length = line_offset(parser,datum)+len+1-start;
          continue;
       }
 //If we hit a character other than 'a' or 's', then we've exited
 //the current alignment block, break out of the read loop and return
 //the current alignment block.
       else break;
-   }while(!bLoopCompleted);
+   }
+   if(parser->error) return -1;
+   return in_block;
+}
+
+static alignment_block new_alignment(arena mem, int reusable){
+   alignment_block new_align;
+   if(reusable){
+      new_align = malloc(sizeof(*new_align));
+      assert(new_align != NULL);
+   }else new_align = arena_alloc(mem,sizeof(*new_align));
+   new_align->mem = mem;
+   new_align->reusable = reusable;
+   new_align->cached = NULL;
+   new_align->sequences = new_rows(mem,reusable,16);
+   new_align->size=new_align->curr_seq=0;
+   new_align->max=16;
+   clear_lines(&new_align->lines);
+   new_align->data = NULL;
+   new_align->seq_length = 0;
+   return new_align;
+}
+
+alignment_block linear_next_alignment_buffer(maf_linear_parser parser){
+   alignment_block new_align = new_alignment(get_arena(parser->pool),0);
+   if(fill_alignment(parser,new_align,NULL) <= 0){
+      release_arena(new_align->mem);
+      return NULL;
+   }
    return new_align;
 }
 
+//A block owned by the caller and refilled in place by
+//linear_refill_alignment, for callers that are done with each block
+//before reading the next. Free it with free_alignment_block.
+alignment_block get_reusable_alignment(maf_linear_parser parser){
+   return new_alignment(get_arena(parser->pool),1);
+}
+
+//Read the next block into aln, replacing its contents. Returns 1 if a
+//block was read, 0 at the end of the file and -1 on error.
+int linear_refill_alignment(maf_linear_parser parser, alignment_block aln){
+   reset_arena(aln->mem);
+   clear_lines(&aln->lines);
+   aln->size = aln->curr_seq = 0;
+   aln->seq_length = 0;
+   return fill_alignment(parser,aln,NULL);
+}
+
+alignment_batch next_alignment_batch(maf_linear_parser parser, int max_blocks,
+      size_t max_bytes){
+   arena mem = get_arena(parser->pool);
+   alignment_batch batch = arena_alloc(mem,sizeof(*batch));
+   batch->mem = mem;
+   batch->max = 16;
+   batch->blocks = arena_alloc(mem,batch->max*sizeof(*batch->blocks));
+   batch->max_rows = 64;
+   batch->rows = arena_alloc(mem,batch->max_rows*sizeof(*batch->rows));
+   batch->size = batch->num_rows = 0;
+   batch->row_ptrs = NULL;
+   batch->bytes = 0;
+   while(max_blocks <= 0 || batch->size < max_blocks){
+      if(max_bytes > 0 && batch->bytes >= max_bytes) break;
+      if(batch->size == batch->max){
+         size_t old_size = batch->max*sizeof(*batch->blocks);
+         batch->blocks = arena_grow(mem,batch->blocks,old_size,2*old_size);
+         batch->max *= 2;
+      }
+      alignment_block aln = &batch->blocks[batch->size];
+      aln->mem = mem;
+      aln->reusable = 0;
+      aln->cached = NULL;
+      aln->sequences = NULL;
+      aln->size = aln->max = aln->curr_seq = 0;
+      aln->seq_length = 0;
+      aln->data = NULL;
+      clear_lines(&aln->lines);
+      int got = fill_alignment(parser,aln,batch);
+      if(got < 0){
+         release_arena(mem);
+         return NULL;
+      }
+      if(got == 0) break;
+      batch->bytes += aln->length;
+      batch->size++;
+   }
+   if(batch->size == 0){
+      release_arena(mem);
+      return NULL;
+   }
+//The rows have stopped moving, so point each block at its own.
+   batch->row_ptrs = arena_alloc(mem,(batch->num_rows+1)*sizeof(seq));
+   int row = 0;
+   for(int i = 0; i < batch->size; ++i){
+      alignment_block aln = &batch->blocks[i];
+      aln->sequences = batch->row_ptrs+row;
+      aln->max = aln->size;
+      for(int j = 0; j < aln->size; ++j) aln->sequences[j] = &batch->rows[row+j];
+      row += aln->size;
+   }
+   return batch;
+}
+
+static int end_block(maf_callbacks callbacks){
+   if(callbacks->on_block_end == NULL) return 0;
+   return callbacks->on_block_end(callbacks->data);
+}
+
+int parse_maf(maf_linear_parser parser, maf_callbacks callbacks){
+   int in_block=0;
+   int ret=0;
+   char *datum;
+   size_t len;
+   char type;
+   while((datum = next_line(parser,&len,&type)) != NULL){
+      if(type=='a'){
+         if(in_block && (ret = end_block(callbacks)) != 0) return ret;
+         in_block=0;
+         if(skip_block(parser,datum)) continue;
+         in_block=1;
+         if(callbacks->on_block_begin != NULL
+               && (ret = callbacks->on_block_begin(datum,len,callbacks->data)) != 0)
+            return ret;
+      }
+//Any other line outside a block is skipped.
+      else if(!in_block) continue;
+      else if(type=='s'){
+         struct _aligned_sequence fields;
+         if(split_fields(datum,len,&fields,parser->fields) != 0){
+           fprintf(stderr, "Invalid sequence entry %.*s\n",(int)len,datum);
+           parser->error = 1;
+           return -1;
+         }
+         intern_sequence(parser->species_ids,parser->src_ids,&fields);
+         if(callbacks->on_row != NULL
+               && (ret = callbacks->on_row(&fields,callbacks->data)) != 0)
+            return ret;
+      }
+      else if(is_span_type(type)){
+         if(callbacks->on_line != NULL
+               && (ret = callbacks->on_line(datum,len,type,callbacks->data)) != 0)
+            return ret;
+      }
+//Any other line ends the block.
+      else{
+         in_block=0;
+         if((ret = end_block(callbacks)) != 0) return ret;
+      }
+   }
+//A read error ends the file early, so the block it cut short isn't
+//finished.
+   if(parser->error) return -1;
+   if(in_block) return end_block(callbacks);
+   return 0;
+}
+
 alignment_block linear_next_alignment(maf_linear_parser parser){
-   char buffer[4096];
    alignment_block new_align = NULL;
    int in_block=0;
-   int file_pos;
+   off_t file_pos;
    while(!feof(parser->maf_file)){
-      file_pos = ftell(parser->maf_file);
-      char *fc = fgets(buffer,4096,parser->maf_file);
+      file_pos = ftello(parser->maf_file);
+//Lines are read into the parser's buffer, which getline grows to fit.
+      ssize_t got = getline(&parser->buf,&parser->buf_size,parser->maf_file);
       if(ferror(parser->maf_file) != 0){
              fprintf(stderr, "File stream error: %s\nError: %s",
                 parser->filename,strerror(errno));
+             parser->error = 1;
              return NULL;
       }
+      if(got < 0) break;
+      char *buffer = parser->buf;
 //If we've yet to enter an alignment block, and the first character
 //of the line isn't 'a', then skip over it.
       if(!in_block && buffer[0]!='a') continue;
@@ -583,21 +1755,25 @@ alignment_block linear_next_alignment(maf_linear_parser parser){
 //If we find an 'a' after entering a block, then this is a new block
 //so rewind the file pointer and break out of read loop.
          if(in_block){
-            int check= fseek(parser->maf_file,file_pos,SEEK_SET);
+            int check= fseeko(parser->maf_file,file_pos,SEEK_SET);
             if(check !=0){
                fprintf(stderr,"File seek error: %s\n",strerror(errno));
+               parser->error = 1;
                return NULL;
             }
             break;
          }
 //Else we're starting a new alignment block, initialize the data
 //structure and set in_block to true.
-         new_align=malloc(sizeof(*new_align));
-         assert(new_align != NULL);
-         new_align->sequences = malloc(16*sizeof(*new_align->sequences));
-         assert(new_align->sequences != NULL);
+         arena mem = get_arena(parser->pool);
+         new_align=arena_alloc(mem,sizeof(*new_align));
+         new_align->mem = mem;
+         new_align->reusable = 0;
+         new_align->cached = NULL;
+         new_align->sequences = arena_alloc(mem,16*sizeof(*new_align->sequences));
          new_align->size=new_align->curr_seq=0;
          new_align->max=16;
+         clear_lines(&new_align->lines);
          new_align->data = NULL;
          in_block=1;
          continue;
@@ -606,17 +1782,29 @@ alignment_block linear_next_alignment(maf_linear_parser parser){
 //current alignment block, parse it, reallocate alignment block's
 //sequence array if necessary, and store the new sequence.
       else if(buffer[0]=='s'){
-         seq new_seq = get_sequence(buffer);
-         if(new_seq == NULL){
+         struct _aligned_sequence fields;
+         if(split_fields(buffer,strlen(buffer),&fields,parser->fields) != 0){
            fprintf(stderr, "Invalid sequence entry %s\n",buffer);
+           release_arena(new_align->mem);
+           parser->error = 1;
            return NULL;
          }
+         intern_sequence(parser->species_ids,parser->src_ids,&fields);
          if(new_align->size ==new_align->max){
-             new_align->sequences=realloc(new_align->sequences,
-                2*new_align->max*sizeof(seq));
-             assert(new_align->sequences!=NULL);
+             new_align->sequences=arena_grow(new_align->mem,new_align->sequences,
+                new_align->max*sizeof(seq),2*new_align->max*sizeof(seq));
              new_align->max *=2;
-         }new_align->sequences[new_align->size++]=new_seq;
+         }new_align->sequences[new_align->size++]=
+               arena_sequence(new_align->mem,&fields,1);
+         continue;
+      }
+//'i', 'e' and 'q' lines are part of the block, keep them to decode
+//only if asked.
+      else if(is_span_type(buffer[0])){
+         size_t len = strlen(buffer);
+         if(len > 0 && buffer[len-1] == '\n') --len;
+         add_line_span(new_align->mem,&new_align->lines,buffer,len,
+               buffer[0],1);
          continue;
       }
 //If we hit a character other than 'a' or 's', then we've exited
@@ -629,52 +1817,207 @@ alignment_block linear_next_alignment(maf_linear_parser parser){
 
 
 
-void array_double(maf_array_parser parser){
-   parser->alignment_blocks =realloc(parser->alignment_blocks,2*parser->max*sizeof(int));
-   assert(parser->alignment_blocks!=NULL);
-   parser->max *=2;
-   printf("Doubling array to max size of %d\n", parser->max);
-}
 maf_linear_parser get_linear_parser(FILE *maf_file, char *filename){
 	maf_linear_parser parser = malloc(sizeof(*parser));
 	assert(parser!=NULL);
 	parser->maf_file = maf_file;
 	parser->filename= strdup(filename);
 	assert(filename!=NULL);
-        parser->curr_pos=0;
-        parser->fill_buf=1;
-	parser->pos=0;
+	parser->buf_size=BUFSIZE;
+	parser->buf=malloc(parser->buf_size);
+	assert(parser->buf!=NULL);
+	parser->base=parser->pos=parser->end=parser->buf;
+	parser->scanned=0;
+	parser->eof=0;
+	parser->error=0;
+	parser->held=NULL;
+	parser->held_len=0;
+	parser->buf_offset=0;
+	parser->max_lines=256;
+	parser->line_ends=malloc(parser->max_lines*sizeof(*parser->line_ends));
+	assert(parser->line_ends!=NULL);
+	parser->line_types=malloc(parser->max_lines);
+	assert(parser->line_types!=NULL);
+	parser->num_lines=parser->curr_line=0;
+	parser->index_base=parser->buf;
+	parser->map=NULL;
+	parser->map_size=0;
+	parser->pool=new_arena_pool();
+	parser->parent=NULL;
+	parser->bgzf=NULL;
+	parser->ahead=NULL;
+	parser->groups=NULL;
+	parser->species_ids=new_intern_table();
+	parser->src_ids=new_intern_table();
+	parser->ids_owner=parser;
+	parser->pack=0;
+	parser->fields=ALL_FIELDS;
+	parser->skip_index=NULL;
+	parser->skip_mask=NULL;
+	parser->skip_hint=0;
+	parser->format_checked=0;
+	parser->threads=bgzf_default_threads();
 	return parser;
 }
 
+//Same as get_linear_parser, but the whole file is memory mapped and the
+//sequences returned are views into the mapping, so no sequence data is
+//copied. Sequences must not be used after the parser is freed. Falls
+//back to buffered reads if the file can't be mapped, e.g. a pipe.
+maf_linear_parser get_mmap_parser(FILE *maf_file, char *filename){
+	maf_linear_parser parser = get_linear_parser(maf_file,filename);
+	struct stat st;
+	if(fstat(fileno(maf_file),&st) != 0 || !S_ISREG(st.st_mode)
+	      || st.st_size == 0)
+	   return parser;
+	char *map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,
+	      fileno(maf_file),0);
+	if(map == MAP_FAILED){
+	   fprintf(stderr, "Unable to map file, using buffered reads: %s\n"
+	      "Error: %s\n",filename,strerror(errno));
+	   return parser;
+	}
+//BGZF files are read through the buffered reader, which inflates them.
+	if(is_bgzf((unsigned char *)map,st.st_size)){
+	   munmap(map,st.st_size);
+	   return parser;
+	}
+	madvise(map,st.st_size,MADV_SEQUENTIAL);
+	parser->map = map;
+	parser->map_size = st.st_size;
+	parser->pos = map;
+	parser->end = map+st.st_size;
+	return parser;
+}
+
+//Read the file of a buffered parser on a separate I/O thread, which
+//fills large buffers ahead of the parser. Must be called before the
+//first read. Mapped parsers have nothing to read, so are left alone.
+void start_read_ahead(maf_linear_parser parser){
+	if(parser->map != NULL || parser->ahead != NULL
+	      || parser->format_checked)
+	   return;
+	parser->ahead = get_read_ahead(parser->maf_file,parser->filename);
+}
+
+//Also pack the rows of the blocks parser returns, see enum base_code.
+//Range parsers made afterwards inherit the setting.
+void set_pack_sequences(maf_linear_parser parser, int pack){
+	parser->pack = pack;
+}
+
+//Decode only the fields of rows in fields, a mask of enum row_field,
+//skipping the rest of each 's' line. Without FIELD_SEQUENCE the bulk of
+//the line is never read past finding its end. Blocks sorted or hashed
+//by species decode src whatever the mask. Range parsers made afterwards
+//inherit the setting.
+void set_parse_fields(maf_linear_parser parser, unsigned int fields){
+	parser->fields = fields;
+}
+
+//Skip blocks without a row of any of species, found from the species
+//bitmaps of the file's index without parsing the blocks. Only mapped
+//files with an up to date index are filtered, the index isn't built
+//for this since that takes a pass over the file. Must be called before
+//the first read, range parsers made afterwards inherit the filter.
+//Returns 1 if blocks will be skipped.
+int set_block_filter(maf_linear_parser parser, char **species,
+      int num_species){
+	if(parser->map == NULL || parser->parent != NULL) return 0;
+	char *index_filename = get_index_filename(parser->filename);
+	maf_index index = load_maf_index(index_filename);
+	free(index_filename);
+	if(index == NULL) return 0;
+	if(!index_matches(index,parser->maf_file) || (index->flags & INDEX_BGZF)){
+	   free_maf_index(index);
+	   return 0;
+	}
+	free_maf_index(parser->skip_index);
+	free(parser->skip_mask);
+	parser->skip_index = index;
+	parser->skip_mask = index_species_mask(index,species,num_species);
+	return 1;
+}
+
+//Parser over bytes [start,end) of a mapped parser's file, sharing its
+//mapping and arena pool, so ranges of one file can be parsed on
+//separate threads. start should be the beginning of an 'a' line.
+maf_linear_parser get_range_parser(maf_linear_parser parent, size_t start,
+      size_t end){
+	assert(parent->map != NULL && start <= end && end <= parent->map_size);
+	maf_linear_parser parser = get_linear_parser(parent->maf_file,
+	      parent->filename);
+	free_arena_pool(parser->pool);
+	free_intern_table(parser->species_ids);
+	free_intern_table(parser->src_ids);
+	parser->pool = parent->pool;
+	parser->species_ids = parent->species_ids;
+	parser->src_ids = parent->src_ids;
+	parser->ids_owner = parent->ids_owner;
+	parser->pack = parent->pack;
+	parser->fields = parent->fields;
+	parser->skip_index = parent->skip_index;
+	parser->skip_mask = parent->skip_mask;
+	parser->parent = parent;
+	parser->map = parent->map;
+	parser->map_size = parent->map_size;
+	parser->pos = parent->map+start;
+	parser->end = parent->map+end;
+	return parser;
+}
+
+//Give parser the intern tables of from, so rows of both files get the
+//same IDs. from must outlive parser, and must be given before the first
+//block is read.
+void share_intern_tables(maf_linear_parser parser, maf_linear_parser from){
+	if(parser->ids_owner == parser){
+	   free_intern_table(parser->species_ids);
+	   free_intern_table(parser->src_ids);
+	}
+	parser->species_ids = from->species_ids;
+	parser->src_ids = from->src_ids;
+	parser->ids_owner = from->ids_owner;
+}
+
+//Random access parser over the blocks of a MAF file. The block offsets
+//come from the file's .mafidx index when there is one that matches the
+//file, otherwise the file is scanned to build the index in memory.
 maf_array_parser get_array_parser(FILE *maf_file,char *filename){
-	char buffer[3000];
-	assert(buffer != NULL);
 	maf_array_parser parser = malloc(sizeof(*parser));
 	assert(parser != NULL);
         parser->maf_file = maf_file;
         parser->filename = strdup(filename);
         assert(parser->filename != NULL);
         parser->curr_block=0;
-        parser->size = 0;
-        parser->alignment_blocks = malloc(2*sizeof(int));
-        assert(parser->alignment_blocks != NULL);
-        parser->max = 2;
-	int pos;
-	while(!feof(maf_file)){
-		pos = ftell(maf_file);
-		char *check = fgets(buffer,3000,maf_file);
-		if(ferror(maf_file) != 0){
-			fprintf(stderr, "File stream error: %s\nError: %s",
-					filename,strerror(errno));
-			return NULL;
-		}
-		if(buffer[0]=='a'){
-			if(parser->size == parser->max)
-                           array_double(parser);
-                        parser->alignment_blocks[parser->size++]=pos;
-		}
-	}
+        parser->reads = NULL;
+        parser->cache = NULL;
+        parser->pool = new_arena_pool();
+        parser->species_ids = new_intern_table();
+        parser->src_ids = new_intern_table();
+//Blocks of BGZF files are located by virtual offsets and read one at a
+//time, so they are inflated on this thread.
+        unsigned char header[BGZF_HEADER];
+        parser->bgzf = NULL;
+        if(pread(fileno(maf_file),header,sizeof(header),0) == sizeof(header)
+              && is_bgzf(header,sizeof(header)))
+           parser->bgzf = get_bgzf_reader(maf_file,filename,NULL,0,1);
+        parser->no_reads = parser->bgzf != NULL;
+        char *index_filename = get_index_filename(filename);
+        parser->index = load_maf_index(index_filename);
+        free(index_filename);
+        if(parser->index != NULL && (!index_matches(parser->index,maf_file)
+              || !(parser->index->flags & INDEX_BGZF) != (parser->bgzf == NULL))){
+           fprintf(stderr, "Index out of date, rescanning: %s\n",filename);
+           free_maf_index(parser->index);
+           parser->index = NULL;
+        }
+        if(parser->index == NULL)
+           parser->index = build_maf_index(maf_file,filename);
+        if(parser->index == NULL){
+           free_array_parser(parser);
+           return NULL;
+        }
+        parser->size = parser->index->num_blocks;
 	return parser;
 }
 
@@ -684,21 +2027,95 @@ seq iterate_sequences(alignment_block aln){
 }
 
 void free_linear_parser(maf_linear_parser parser){
+//Range parsers borrow the mapping, pool and intern tables of their
+//parent.
+   if(parser->parent == NULL){
+      if(parser->map != NULL) munmap(parser->map,parser->map_size);
+      free_arena_pool(parser->pool);
+      free_maf_index(parser->skip_index);
+      free(parser->skip_mask);
+   }
+   if(parser->ids_owner == parser){
+      free_intern_table(parser->species_ids);
+      free_intern_table(parser->src_ids);
+   }
+   free_bgzf_reader(parser->bgzf);
+   free_read_ahead(parser->ahead);
+   free_species_set(parser->groups);
+   free(parser->buf);
+   free(parser->line_ends);
+   free(parser->line_types);
    free(parser->filename);
    free(parser);
 }
 
+//Keep up to max_bytes of the blocks the parser returns, so blocks read
+//again are served from memory. The cache is shared by every reader of
+//the parser, blocks from it are shared too and must be treated as read
+//only, and must all be freed before the parser. 0 turns it off.
+void set_block_cache(maf_array_parser parser, size_t max_bytes){
+    free_block_reads(parser,parser->reads);
+    parser->reads = NULL;
+    free_block_cache(parser->cache);
+    parser->cache = max_bytes > 0 ? new_block_cache(max_bytes) : NULL;
+}
+
 void free_array_parser(maf_array_parser parser){
+    free_block_reads(parser,parser->reads);
+    free_block_cache(parser->cache);
     free(parser->filename);
-    free(parser->alignment_blocks);
+    free_maf_index(parser->index);
+    free_bgzf_reader(parser->bgzf);
+    free_arena_pool(parser->pool);
+    free_intern_table(parser->species_ids);
+    free_intern_table(parser->src_ids);
     free(parser);
     return;
 }
+//Spread the 8 bits of a soft mask byte to the low bit of each nibble
+//of a word of packed bases.
+static inline uint32_t spread_mask(uint32_t bits){
+   bits = (bits | bits << 12) & 0x000f000f;
+   bits = (bits | bits << 6) & 0x03030303;
+   return (bits | bits << 3) & 0x11111111;
+}
+
+//Columns where two rows of a block hold the same byte, over the length
+//of the shorter row. Packed rows are compared 8 bases at a time: a base
+//differs when any bit of its nibble or its soft mask bit differs. The
+//last word is cut to the shorter row's length, since past it the longer
+//row holds bases where the shorter one only has padding.
+unsigned int count_identities(seq seq1, seq seq2){
+   unsigned int len = seq1->sequence_len < seq2->sequence_len
+      ? seq1->sequence_len : seq2->sequence_len;
+   unsigned int idents = 0;
+   if(seq1->packed == NULL || seq2->packed == NULL){
+      for(unsigned int i = 0; i < len; ++i)
+         if(seq1->sequence[i] == seq2->sequence[i]) ++idents;
+      return idents;
+   }
+   unsigned int diffs = 0;
+   unsigned int words = (len+7)/8;
+   for(unsigned int i = 0; i < words; ++i){
+      uint32_t word1, word2;
+      memcpy(&word1,seq1->packed+4*i,sizeof(word1));
+      memcpy(&word2,seq2->packed+4*i,sizeof(word2));
+      uint32_t diff = word1 ^ word2;
+      diff = (diff | diff >> 1 | diff >> 2 | diff >> 3) & 0x11111111;
+      diff |= spread_mask(seq1->soft_mask[i] ^ seq2->soft_mask[i]);
+      if(i == words-1 && (len & 7) != 0) diff &= (1u << 4*(len & 7))-1;
+      diffs += __builtin_popcount(diff);
+   }
+   return len-diffs;
+}
+
 void print_sequence(seq sequence){
    if(sequence==NULL) return;
-   printf("s %25s  %18lu  %8u  %c  %18lu  %s\n"
-      ,sequence->src,sequence->start,sequence->size
-      ,sequence->strand,sequence->srcSize,sequence->sequence);
+   printf("s %25.*s  %18lu  %8u  %c  %18lu  %.*s\n"
+      ,(int)sequence->src_len,sequence->src,sequence->start,sequence->size
+      ,sequence->strand,sequence->srcSize
+      ,sequence->sequence != NULL ? (int)sequence->sequence_len : 0
+      ,sequence->sequence != NULL ? sequence->sequence : "");
 }
 void print_alignment(alignment_block aln){
    if(aln==NULL)return;
@@ -718,15 +2135,5 @@ void print_sorted_alignment(sorted_alignment_block aln){
 void print_hash_alignment(hash_alignment_block aln){
    if(aln==NULL) return;
    printf("\na %s\n",aln->data);
-   ENTRY *ret_val;
-   int hc=0;
-   for(int i = 0; i < aln->size; ++i){
-      ENTRY search={aln->species[i],NULL};
-      hc = hsearch_r(search,FIND,&ret_val,aln->sequences);
-      if(hc == 0){
-         fprintf(stderr,"Failed to read hash table: %s\n", strerror(errno));
-         exit(1);
-      }
-      if(ret_val != NULL) print_sequence(ret_val->data);
-   }
+   for(int i = 0; i < aln->size; ++i) print_sequence(aln->species[i].row);
 }
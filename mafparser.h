@@ -2,29 +2,156 @@
 #define __MAFPARSER_H
 
 #include <search.h>
+#include <stddef.h>
+#include <stdint.h>
 
-#define BUFSIZE 50000
+#include "arena.h"
+#include "intern.h"
+
+//Initial size of a buffered parser's buffer, it doubles whenever a line
+//won't fit in half of it, so there's no limit on line length.
+#define BUFSIZE 65536
+//Bytes of a mapped file indexed for line boundaries at a time.
+#define LINE_WINDOW (1<<20)
+//Default limits on the blocks and file bytes in a batch.
+#define BATCH_BLOCKS 1024
+#define BATCH_BYTES (1<<20)
 
 typedef struct hsearch_data *hash;
 
+//Fields of 's' lines a linear parser decodes, see set_parse_fields.
+//FIELD_SEQUENCE_LEN gives the length of the sequence without its text.
+enum row_field{ FIELD_SRC = 1, FIELD_START = 2, FIELD_SIZE = 4,
+      FIELD_STRAND = 8, FIELD_SRC_SIZE = 16, FIELD_SEQUENCE = 32,
+      FIELD_SEQUENCE_LEN = 64 };
+#define ALL_FIELDS 0x7f
+//Everything but the sequence text, enough for inventories and stats.
+#define HEADER_FIELDS (ALL_FIELDS & ~FIELD_SEQUENCE)
+
+//Blocks an array parser keeps reads in flight for through io_uring.
+#define BLOCK_READS 32
+
+//A block being read whole through io_uring, into memory from mem.
+typedef struct _block_read{
+	arena mem;
+	char *data;
+	uint64_t offset;
+	size_t len;
+	size_t got;
+	int error;
+	int done;
+}*block_read;
+
+//Reads of the blocks blocks[0] to blocks[size-1], or of every block in
+//order when blocks is NULL, up to BLOCK_READS ahead of the one taken
+//next. The read of the block at position p is in slot p%BLOCK_READS.
+typedef struct _block_reads{
+	struct _uring *ring;
+	uint64_t *blocks;
+	uint64_t size;
+	uint64_t next_issue;
+	uint64_t next_take;
+	struct _block_read slots[BLOCK_READS];
+}*block_reads;
+
 typedef struct array_parser{
         FILE *maf_file;
         char *filename;
-        int *alignment_blocks;
-        int curr_block;
-        int size;
-        int max;
+        struct _maf_index *index;
+        struct _bgzf_reader *bgzf;
+        int64_t curr_block;
+        int64_t size;
+        arena_pool pool;
+        struct _intern_table *species_ids;
+        struct _intern_table *src_ids;
+//Reads ahead of curr_block, NULL until the first block is read. BGZF
+//files, and any where io_uring isn't available, set no_reads and are
+//read a block at a time.
+        block_reads reads;
+        int no_reads;
+//Set by set_block_cache, blocks read are then kept in it.
+        struct _block_cache *cache;
 }*maf_array_parser;
 
+//Blocks of an array parser overlapping a region, in file order.
+typedef struct region_query{
+        maf_array_parser parser;
+        uint64_t *blocks;
+        uint64_t size;
+        uint64_t curr;
+        block_reads reads;
+}*maf_region_query;
+
 typedef struct linear_parser{
 	FILE *maf_file;
 	char *filename;
-	char buf[BUFSIZE];
-        unsigned long curr_pos;
-        int fill_buf;
+	char *buf;
+	size_t buf_size;
         char *pos;
+        char *end;
+//Start of the data being parsed, buf or a read-ahead buffer, and its
+//offset in the file, so buffered lines can be located in the file.
+        char *base;
+        uint64_t buf_offset;
+        int eof;
+//Set once a read fails or a line can't be parsed, so a reader that
+//returns NULL or 0 can be told apart from the end of the file.
+        int error;
+//Line handed back by unread_line, returned again by the next read.
+        char *held;
+        size_t held_len;
+//When the file is memory mapped, map holds the whole file and lines
+//are returned as views into it rather than copied into buf.
+        char *map;
+        size_t map_size;
+//Index of the lines in the buffer or current window of the mapping,
+//line_ends holds each line's newline offset from index_base and
+//line_types its first byte.
+        char *index_base;
+        unsigned int *line_ends;
+        char *line_types;
+        int num_lines;
+        int curr_line;
+        int max_lines;
+//Bytes from pos already searched without finding a newline, so a long
+//line is only scanned once however many reads it takes.
+        size_t scanned;
+        arena_pool pool;
+        struct linear_parser *parent;
+//Set once the first read finds BGZF input, which is then inflated on
+//threads workers.
+        struct _bgzf_reader *bgzf;
+//Set by start_read_ahead, buffers are then filled by an I/O thread.
+        struct _read_ahead *ahead;
+//Species set compiled from the groups passed to get_sorted_alignment.
+        struct _species_set *groups;
+//Interned species and species.scaffold names, shared with range
+//parsers, giving rows dense IDs. ids_owner is the parser that frees
+//them, itself unless share_intern_tables gave it another's.
+        struct _intern_table *species_ids;
+        struct _intern_table *src_ids;
+        struct linear_parser *ids_owner;
+//Set by set_pack_sequences, rows are then also packed as they're parsed.
+        int pack;
+//Mask of enum row_field, the fields of rows that are decoded.
+        unsigned int fields;
+//Set by set_block_filter, the file's index and the species a block
+//needs a row of not to be skipped. Borrowed by range parsers. skip_hint
+//is the block expected next.
+        struct _maf_index *skip_index;
+        uint64_t *skip_mask;
+        uint64_t skip_hint;
+        int format_checked;
+        int threads;
 }*maf_linear_parser;
 
+//4-bit codes of the bases of packed sequences, the IUPAC ambiguity codes
+//after A, C, G, T, N and gap. Lower case bases have the same code as
+//upper case, with their bit in the soft mask set.
+enum base_code{ BASE_A, BASE_C, BASE_G, BASE_T, BASE_N, BASE_GAP,
+      BASE_R, BASE_Y, BASE_K, BASE_M, BASE_S, BASE_W, BASE_B, BASE_D,
+      BASE_H, BASE_V };
+
 typedef struct _aligned_sequence{
 	char *src;
 	unsigned long start;
@@ -34,8 +161,53 @@ typedef struct _aligned_sequence{
 	char *sequence;
         char *species;
 	char *scaffold;
+//Lengths of the fields above. When view is set the fields point
+//directly into the mapped file and are not NUL terminated, so these
+//lengths must be used instead of strlen. Fields a parser was told not
+//to decode are zero, empty, or NULL for the sequence text.
+	unsigned int src_len;
+	unsigned int species_len;
+	unsigned int scaffold_len;
+	unsigned int sequence_len;
+//Dense IDs of species and src in the parser's intern tables, so tools
+//can index flat arrays by them. NO_ID for rows not from a parser.
+	uint32_t species_id;
+	uint32_t src_id;
+//Packed form of sequence, two bases a byte with the first in the low
+//nibble, and a bitmap of its lower case bases. Both are zero padded
+//to a multiple of 8 bases. NULL unless the parser packs rows, or when
+//the row holds a byte that has no code.
+	unsigned char *packed;
+	unsigned char *soft_mask;
+	int view;
+//Sequences parsed into a block live in the block's arena and are
+//released with it, only owned sequences are freed by free_sequence.
+	int owned;
 }*seq;
 
+static inline enum base_code base_at(seq sequence, unsigned int i){
+   return (sequence->packed[i>>1] >> ((i&1)<<2)) & 0xf;
+}
+
+static inline int is_soft_masked(seq sequence, unsigned int i){
+   return (sequence->soft_mask[i>>3] >> (i&7)) & 1;
+}
+
+//An 'i', 'e' or 'q' line of a block, kept as the bytes of the line and
+//decoded only when a caller asks for it.
+typedef struct _line_span{
+	char *line;
+	unsigned int len;
+	char type;
+}*line_span;
+
+//The 'i', 'e' and 'q' lines of a block in file order, in its arena.
+typedef struct _block_lines{
+	line_span spans;
+	int size;
+	int max;
+}*block_lines;
+
 typedef struct _alignment_block{
 	double score;
 	int pass;
@@ -45,8 +217,37 @@ typedef struct _alignment_block{
 	int max;
         int curr_seq;
 	unsigned int seq_length;
+//Byte offset of the block's 'a' line in the file, a virtual offset for BGZF
+//files, and the length of the block up to the end of its last line.
+	uint64_t offset;
+	uint64_t length;
+	struct _block_lines lines;
+	arena mem;
+//Set for blocks from get_reusable_alignment, whose struct and rows are
+//kept across refills rather than living in the arena.
+	int reusable;
+//The block's entry in a block cache, NULL if it isn't from one.
+	struct _cache_entry *cached;
 }*alignment_block;
 
+//Consecutive blocks read at once by next_alignment_batch. The blocks
+//are one array and the rows of all of them another, each block's
+//sequences pointing at its run of rows, so a batch costs a few
+//allocations from one arena however many blocks it holds. The blocks
+//belong to the batch and go with free_alignment_batch.
+typedef struct _alignment_batch{
+	struct _alignment_block *blocks;
+	int size;
+	int max;
+	struct _aligned_sequence *rows;
+	seq *row_ptrs;
+	int num_rows;
+	int max_rows;
+//Bytes of the file the blocks span.
+	uint64_t bytes;
+	arena mem;
+}*alignment_batch;
+
 typedef struct _sorted_alignment_block{
 	double score;
 	int pass;
@@ -58,8 +259,34 @@ typedef struct _sorted_alignment_block{
 	int out_size;
 	int out_max;
 	seq *out_sequences;
+	struct _block_lines lines;
+	arena mem;
+	int reusable;
 }*sorted_alignment_block;
 
+//Callbacks run by parse_maf straight from the tokenizer, any of which
+//may be NULL. Lines and rows are views into the parser's buffer or map,
+//valid only until the callback returns, and rows are never packed; use
+//copy_sequence to keep one. A callback returning nonzero stops the parse.
+typedef struct _maf_callbacks{
+//The block's 'a' line.
+	int (*on_block_begin)(char *line, size_t len, void *data);
+	int (*on_row)(seq row, void *data);
+//'i', 'e' and 'q' lines.
+	int (*on_line)(char *line, size_t len, char type, void *data);
+	int (*on_block_end)(void *data);
+	void *data;
+}*maf_callbacks;
+
+//A species of a hash block, its first row and its slot in the table.
+typedef struct _species_entry{
+	char *species;
+	size_t len;
+	uint32_t hash;
+	uint32_t slot;
+	seq row;
+}*species_entry;
+
 typedef struct _hash_alignment_block{
         double score;
         int pass;
@@ -67,31 +294,85 @@ typedef struct _hash_alignment_block{
 	int size;
         int max;
         unsigned int seq_length;
-	char **species;
-	hash sequences;
+//Species in the order first seen, with the first row of each.
+	struct _species_entry *species;
+//Open addressing table of index+1 into species, 0 for an empty slot.
+//Refilling clears only the slots the species took.
+	uint32_t *slots;
+	uint32_t num_slots;
+//Every row read, including those of species already in the table.
+	seq *rows;
+	int rows_size;
+	int rows_max;
+	struct _block_lines lines;
+	arena mem;
+	int reusable;
 }*hash_alignment_block;
 
 
 int in_list(char *needle, char **haystack, int size);
-void array_double(maf_array_parser parser);
-
-int get_next_offset(maf_array_parser parser);
+int in_list_n(char *needle, size_t len, char **haystack, int size);
+int64_t get_next_offset(maf_array_parser parser);
 seq get_sequence(char *data);
+seq get_sequence_view(char *data, size_t len);
 seq copy_sequence(seq sequence);
 
 alignment_block array_next_alignment(maf_array_parser parser);
+alignment_block region_next_alignment(maf_region_query query);
+alignment_block decode_block(maf_array_parser parser, uint64_t block,
+      char **buf, size_t *buf_size);
 alignment_block linear_next_alignment(maf_linear_parser parser);
 alignment_block linear_next_alignment_buffer(maf_linear_parser parser);
 hash_alignment_block get_next_alignment_hash(maf_linear_parser parser);
 sorted_alignment_block get_sorted_alignment(maf_linear_parser parser,
               char **in_group, int in_size, char **out_group, int out_size);
+alignment_block get_reusable_alignment(maf_linear_parser parser);
+sorted_alignment_block get_reusable_sorted_alignment(maf_linear_parser parser);
+hash_alignment_block get_reusable_hash_alignment(maf_linear_parser parser);
+int linear_refill_alignment(maf_linear_parser parser, alignment_block aln);
+//Up to max_blocks blocks, stopping early once they span max_bytes of the
+//file, 0 for no limit. NULL at the end of the file or on error.
+alignment_batch next_alignment_batch(maf_linear_parser parser, int max_blocks,
+              size_t max_bytes);
+//Run callbacks over the rest of the file without building blocks.
+//Returns 0 at the end of the file, -1 on error or else the nonzero
+//value of the callback that stopped it.
+int parse_maf(maf_linear_parser parser, maf_callbacks callbacks);
+int refill_sorted_alignment(maf_linear_parser parser,
+              sorted_alignment_block aln, char **in_group, int in_size,
+              char **out_group, int out_size);
+int refill_alignment_hash(maf_linear_parser parser, hash_alignment_block aln);
+//First row of species, len bytes not necessarily NUL terminated, in
+//aln or NULL if it has none.
+seq find_species_row(hash_alignment_block aln, const char *species, size_t len);
 
 maf_array_parser get_array_parser(FILE *maf_file,char *filename);
+maf_region_query get_region_query(maf_array_parser parser, char *region);
+void set_block_cache(maf_array_parser parser, size_t max_bytes);
 maf_linear_parser get_linear_parser(FILE *maf_file, char *filename);
+maf_linear_parser get_mmap_parser(FILE *maf_file, char *filename);
+void share_intern_tables(maf_linear_parser parser, maf_linear_parser from);
+maf_linear_parser get_range_parser(maf_linear_parser parent, size_t start,
+      size_t end);
+void start_read_ahead(maf_linear_parser parser);
+void set_pack_sequences(maf_linear_parser parser, int pack);
+void set_parse_fields(maf_linear_parser parser, unsigned int fields);
+int set_block_filter(maf_linear_parser parser, char **species,
+      int num_species);
+line_span find_line_span(block_lines lines, char type, const char *src,
+      size_t src_len);
+int decode_info_line(line_span span, char *left_status,
+      unsigned long *left_count, char *right_status,
+      unsigned long *right_count);
+int decode_empty_line(line_span span, seq fields, char *status);
+int decode_quality_line(line_span span, char **quality, size_t *len);
+unsigned int count_identities(seq seq1, seq seq2);
 void free_array_parser(maf_array_parser parser);
+void free_region_query(maf_region_query query);
 void free_linear_parser(maf_linear_parser parser);
 void free_sequence(seq sequence);
 void free_alignment_block(alignment_block aln);
+void free_alignment_batch(alignment_batch batch);
 void free_sorted_alignment(sorted_alignment_block aln);
 void free_hash_alignment(hash_alignment_block aln);
 
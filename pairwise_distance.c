@@ -1,12 +1,15 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
 
 
 #include "mafparser.h"
+#include "parallel.h"
 
 typedef struct _pairwise_distance{
 	int length;
@@ -17,48 +20,36 @@ typedef struct _pairwise_distance{
 void species_filter(alignment_block aln, char **species, 
              int num_species){
 	if(aln==NULL) return;
-	seq *new_sequences = malloc(sizeof(**new_sequences)*num_species);
-	assert(new_sequences!=NULL);
+//Reorder the array in place, moving the kept sequences to the front in
+//the order of species, so the rows stay with the block to be reused.
 	int size=0;
-	char *species_name;
-	char *temp;
-	int cmp;
+	seq curr_seq;
 	for(int i=0; i < num_species;++i){
-		for(int j = 0; j < aln->size;++j){
-			temp=strdup(aln->sequences[j]->src);
-			assert(temp!=NULL);
-			species_name=strtok(temp,".");
-			cmp=strcmp(species_name,species[i]);
-			free(temp);
-			if(cmp==0){
-				new_sequences[size++]=copy_sequence(aln->sequences[j]);
+		for(int j = size; j < aln->size;++j){
+			curr_seq=aln->sequences[j];
+			if(in_list_n(curr_seq->species,curr_seq->species_len,
+			      &species[i],1)){
+				aln->sequences[j]=aln->sequences[size];
+				aln->sequences[size++]=curr_seq;
 				break;
 			}
 		}
 	}
-	for(int i =0; i < aln->size; ++i){
-		free_sequence(aln->sequences[i]);
-	}
-	free(aln->sequences);
-	aln->sequences=new_sequences;
 	aln->size = size;
-	aln->max = num_species;
 }
 
 dist get_pairwise_distance(seq seq1, seq seq2){
-	unsigned int seq_length=strlen(seq1->sequence);
-	if(seq_length != strlen(seq2->sequence)){
+	unsigned int seq_length=seq1->sequence_len;
+	if(seq_length != seq2->sequence_len){
 		fprintf(stderr,"Aligned sequences of different length\n"
-			"Sequence 1: %s\nSequence 2: %s\n",
-			seq1->sequence,seq2->sequence);
+			"Sequence 1: %.*s\nSequence 2: %.*s\n",
+			(int)seq1->sequence_len,seq1->sequence,
+			(int)seq2->sequence_len,seq2->sequence);
 		return NULL;
 	}
 	dist distance=malloc(sizeof(*distance));
 	distance->length = seq_length;
-	distance->num_idents=0;
-	for(unsigned int i=0;i<seq_length;++i)
-		if(seq1->sequence[i]==seq2->sequence[i])
-			++distance->num_idents;
+	distance->num_idents=count_identities(seq1,seq2);
 	distance->percent = ((double)distance->num_idents)/distance->length;
 	return distance;
 }
@@ -69,8 +60,9 @@ void print_pairwise_distances(alignment_block aln){
 	for(int i = 0; i < aln->size-1; ++i){
 		for(int j=i+1;j<aln->size;++j){
 			distance=get_pairwise_distance(aln->sequences[i],aln->sequences[j]);
-			printf("Pairwise distance between %s and %s:\n"
-				"%d/%d = %g\n",aln->sequences[i]->src,
+			printf("Pairwise distance between %.*s and %.*s:\n"
+				"%d/%d = %g\n",(int)aln->sequences[i]->src_len,
+				aln->sequences[i]->src,(int)aln->sequences[j]->src_len,
 				aln->sequences[j]->src,distance->num_idents,
 				distance->length,distance->percent);
 			free(distance);
@@ -82,31 +74,52 @@ int main(int argc, char **argv){
         clock_t start,end;
         double time_spent;
         start = clock();
-        char *filename = argv[1];
-        FILE *maf_file;
-        if((maf_file= fopen(filename, "rb")) == NULL){
-                fprintf(stderr, "Unable to open file: %s\nError: %s",
-                                filename,strerror(errno));
+        int num_threads=1;
+        int c;
+        while((c=getopt(argc,argv,"t:")) != -1){
+                if(c != 't') return 1;
+                num_threads=atoi(optarg);
+                if(num_threads < 1){
+                        fprintf(stderr, "Invalid number of threads: %s\n",optarg);
+                        return 1;
+                }
+        }
+        if(optind >= argc){
+                fprintf(stderr, "Missing required MAF filename\n");
                 return 1;
         }
-	int num_species= argc-2;
+//The first argument is a MAF file, or @ and a file listing them, as is
+//every one after it up to the first that isn't, the same as the group
+//lists of conservomatic. The rest are the species to compare.
+        int first_species = optind+1;
+        while(first_species < argc && (argv[first_species][0]=='@'
+                    || strcasestr(argv[first_species],".maf")!=NULL))
+                ++first_species;
+        int num_files;
+        char **filenames = read_file_args(argv+optind,first_species-optind,
+                    &num_files);
+        if(filenames == NULL) return 1;
+	int num_species= argc-first_species;
         char *species[num_species];
-        for(int i =2; i < argc; ++i) species[i-2]=argv[i];
-        maf_linear_parser parser = get_linear_parser(maf_file,filename);
-        while(1){
-           alignment_block aln = linear_next_alignment_buffer(parser);
-           if(aln==NULL)break;
-//           print_alignment(aln);
-           species_filter(aln,species,num_species);
-           print_alignment(aln);
-	   print_pairwise_distances(aln);
-           free_alignment_block(aln);
+        for(int i =first_species; i < argc; ++i) species[i-first_species]=argv[i];
+//Every file is parsed through one parser, on num_threads threads.
+        maf_parallel_parser parser = get_parallel_files(filenames,num_files,
+                    num_threads,1);
+        if(parser == NULL) return 1;
+        parallel_pack_sequences(parser,1);
+        alignment_block aln;
+        while((aln = parallel_next_alignment(parser)) != NULL){
+                species_filter(aln,species,num_species);
+                print_alignment(aln);
+                print_pairwise_distances(aln);
+                free_alignment_block(aln);
         }
-        free_linear_parser(parser);
-        fclose(maf_file);
+        int error = parser->error;
+        free_parallel_parser(parser);
+        free_file_args(filenames,num_files);
+        if(error) return 1;
         end=clock();
         time_spent=(double)(end-start)/CLOCKS_PER_SEC;
         printf("Time spent: %g\n",time_spent);
         return 0;
 }
-
@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "mafbin.h"
+
+static void add_range(maf_parallel_parser parser, int *max, int file,
+      size_t start, size_t end){
+   if(parser->num_ranges == *max){
+      *max *= 2;
+      parser->ranges = realloc(parser->ranges,*max*sizeof(*parser->ranges));
+      assert(parser->ranges != NULL);
+   }
+   parse_range range = &parser->ranges[parser->num_ranges++];
+   memset(range,0,sizeof(*range));
+   range->file = file;
+   range->start = start;
+   range->end = end;
+}
+
+//Split each mapped file into ranges of about RANGE_SIZE bytes, moving
+//each boundary forward to the start of the next 'a' line. Files that
+//aren't mapped are a streamed range each.
+static void split_ranges(maf_parallel_parser parser){
+   int max = 16;
+   parser->ranges = malloc(max*sizeof(*parser->ranges));
+   assert(parser->ranges != NULL);
+   parser->num_ranges = 0;
+   for(int file = 0; file < parser->num_files; ++file){
+      char *map = parser->parsers[file]->map;
+      size_t size = parser->parsers[file]->map_size;
+      if(map == NULL){
+         add_range(parser,&max,file,0,0);
+         parser->ranges[parser->num_ranges-1].stream = 1;
+         continue;
+      }
+      size_t start = 0;
+      while(start < size){
+         size_t end = size;
+         size_t target = start+RANGE_SIZE;
+         if(target < size){
+            char *found = memmem(map+target-1,size-target+1,"\na",2);
+            if(found != NULL) end = found+1-map;
+         }
+         add_range(parser,&max,file,start,end);
+         start = end;
+      }
+   }
+   parser->finished = malloc((parser->num_ranges+1)*sizeof(int));
+   assert(parser->finished != NULL);
+}
+
+static void free_block(maf_parallel_parser parser, void *aln){
+   if(parser->kind == SORTED_BLOCKS) free_sorted_alignment(aln);
+   else free_alignment_block(aln);
+}
+
+//Add a block of a streamed range, waiting while the consumer has
+//STREAM_BLOCKS of it still to take. Returns -1 once the parser stops.
+static int stream_block(maf_parallel_parser parser, parse_range range,
+      void *aln){
+   pthread_mutex_lock(&parser->lock);
+   while(!parser->stop && range->size-range->next == range->max)
+      pthread_cond_wait(&parser->range_freed,&parser->lock);
+   if(parser->stop){
+      pthread_mutex_unlock(&parser->lock);
+      free_block(parser,aln);
+      return -1;
+   }
+   range->blocks[range->size++ % range->max] = aln;
+   pthread_cond_broadcast(&parser->range_done);
+   pthread_mutex_unlock(&parser->lock);
+   return 0;
+}
+
+static void parse_range_blocks(maf_parallel_parser parser, parse_range range){
+   maf_linear_parser whole = parser->parsers[range->file];
+   maf_linear_parser sub = whole->map != NULL
+      ? get_range_parser(whole,range->start,range->end) : whole;
+   void *aln;
+   void **blocks = malloc((range->stream ? STREAM_BLOCKS : 16)*sizeof(void *));
+   assert(blocks != NULL);
+   pthread_mutex_lock(&parser->lock);
+   range->blocks = blocks;
+   range->max = range->stream ? STREAM_BLOCKS : 16;
+   pthread_mutex_unlock(&parser->lock);
+   while(1){
+      if(parser->kind == SORTED_BLOCKS)
+         aln = get_sorted_alignment(sub,parser->in_group,parser->in_size,
+               parser->out_group,parser->out_size);
+      else aln = linear_next_alignment_buffer(sub);
+      if(aln == NULL) break;
+      if(range->stream){
+         if(stream_block(parser,range,aln) != 0) break;
+         continue;
+      }
+      if(range->size == range->max){
+         range->max *= 2;
+         range->blocks = realloc(range->blocks,range->max*sizeof(void *));
+         assert(range->blocks != NULL);
+      }
+      range->blocks[range->size++] = aln;
+   }
+   range->error = sub->error;
+   if(sub != whole) free_linear_parser(sub);
+}
+
+static void *parse_worker(void *arg){
+   maf_parallel_parser parser = arg;
+   while(1){
+      pthread_mutex_lock(&parser->lock);
+      while(!parser->stop && parser->next_range < parser->num_ranges
+            && parser->in_flight >= parser->max_in_flight)
+         pthread_cond_wait(&parser->range_freed,&parser->lock);
+      if(parser->stop || parser->next_range == parser->num_ranges){
+         pthread_mutex_unlock(&parser->lock);
+         return NULL;
+      }
+      parse_range range = &parser->ranges[parser->next_range++];
+      ++parser->in_flight;
+//A streamed range can be consumed from as soon as it's started.
+      if(range->stream){
+         parser->finished[parser->num_finished++] = range-parser->ranges;
+         pthread_cond_broadcast(&parser->range_done);
+      }
+      pthread_mutex_unlock(&parser->lock);
+      parse_range_blocks(parser,range);
+      pthread_mutex_lock(&parser->lock);
+      range->done = 1;
+      if(!range->stream)
+         parser->finished[parser->num_finished++] = range-parser->ranges;
+      pthread_cond_broadcast(&parser->range_done);
+      pthread_mutex_unlock(&parser->lock);
+   }
+}
+
+static void free_range_blocks(maf_parallel_parser parser, parse_range range){
+   for(int i = range->next; i < range->size; ++i)
+      free_block(parser,range->blocks[i % range->max]);
+   free(range->blocks);
+   range->blocks = NULL;
+   range->size = range->next = 0;
+}
+
+static void start_workers(maf_parallel_parser parser){
+   split_ranges(parser);
+   parser->threads = malloc(parser->num_threads*sizeof(pthread_t));
+   assert(parser->threads != NULL);
+   for(int i = 0; i < parser->num_threads; ++i){
+      int rc = pthread_create(&parser->threads[i],NULL,parse_worker,parser);
+      if(rc != 0){
+         fprintf(stderr,"Failed to create parser thread: %s\n",strerror(rc));
+         exit(1);
+      }
+   }
+   parser->started = 1;
+}
+
+//Hand out the parsed blocks range by range, waiting for the next range
+//in file order or, when unordered, for whichever range finishes first.
+//Streamed ranges are taken from while their worker is still parsing.
+static void *next_block(maf_parallel_parser parser){
+   while(1){
+      parse_range range = parser->current;
+      if(range != NULL && !range->stream && range->next < range->size)
+         return range->blocks[range->next++];
+      pthread_mutex_lock(&parser->lock);
+      if(range != NULL && range->stream){
+         while(range->next == range->size && !range->done)
+            pthread_cond_wait(&parser->range_done,&parser->lock);
+         if(range->next < range->size){
+            void *aln = range->blocks[range->next++ % range->max];
+            pthread_cond_broadcast(&parser->range_freed);
+            pthread_mutex_unlock(&parser->lock);
+            return aln;
+         }
+      }
+      if(range != NULL){
+         if(range->error) parser->error = 1;
+         free_range_blocks(parser,range);
+         parser->current = NULL;
+         --parser->in_flight;
+         pthread_cond_broadcast(&parser->range_freed);
+      }
+//A range that failed ends the output, rather than the blocks after it
+//coming out as though it were whole.
+      if(parser->error){
+         pthread_mutex_unlock(&parser->lock);
+         return NULL;
+      }
+      if(parser->ordered){
+         if(parser->next_consume == parser->num_ranges){
+            pthread_mutex_unlock(&parser->lock);
+            return NULL;
+         }
+         range = &parser->ranges[parser->next_consume++];
+         while(!range->done && !range->stream)
+            pthread_cond_wait(&parser->range_done,&parser->lock);
+      }else{
+         if(parser->next_finished == parser->num_ranges){
+            pthread_mutex_unlock(&parser->lock);
+            return NULL;
+         }
+         while(parser->next_finished == parser->num_finished)
+            pthread_cond_wait(&parser->range_done,&parser->lock);
+         range = &parser->ranges[parser->finished[parser->next_finished++]];
+      }
+      parser->current = range;
+      pthread_mutex_unlock(&parser->lock);
+   }
+}
+
+//Blocks parsed on the calling thread come from each file in turn,
+//stopping at the first file that fails.
+static void *next_sequential(maf_parallel_parser parser){
+   while(1){
+      maf_linear_parser curr = parser->parsers[parser->curr_file];
+      void *aln = parser->kind == SORTED_BLOCKS
+         ? (void *)get_sorted_alignment(curr,parser->in_group,parser->in_size,
+               parser->out_group,parser->out_size)
+         : (void *)linear_next_alignment_buffer(curr);
+      if(aln == NULL && curr->error) parser->error = 1;
+      if(aln != NULL || parser->error
+            || parser->curr_file == parser->num_files-1)
+         return aln;
+      ++parser->curr_file;
+   }
+}
+
+static maf_parallel_parser new_parallel_parser(int num_files, int num_threads,
+      int ordered){
+   maf_parallel_parser parser = calloc(1,sizeof(*parser));
+   assert(parser != NULL);
+   parser->parsers = calloc(num_files,sizeof(*parser->parsers));
+   assert(parser->parsers != NULL);
+   parser->num_files = num_files;
+   parser->num_threads = num_threads;
+   parser->ordered = ordered;
+   parser->max_in_flight = 4*num_threads;
+   pthread_mutex_init(&parser->lock,NULL);
+   pthread_cond_init(&parser->range_done,NULL);
+   pthread_cond_init(&parser->range_freed,NULL);
+   return parser;
+}
+
+//Parse a MAF file on num_threads threads. Blocks come back in file
+//order when ordered is set, otherwise in the order their ranges finish.
+//Files that can't be mapped, and num_threads below 2, are parsed on
+//the calling thread with the mapped linear parser.
+maf_parallel_parser get_parallel_parser(FILE *maf_file, char *filename,
+      int num_threads, int ordered){
+   maf_parallel_parser parser = new_parallel_parser(1,num_threads,ordered);
+   parser->parser = parser->parsers[0] = get_mmap_parser(maf_file,filename);
+//Input that can't be mapped, e.g. BGZF, is parsed on one thread, so
+//give the threads to its decompression instead.
+   if(parser->parser->map == NULL){
+      parser->num_threads = 1;
+      if(num_threads > 1){
+         parser->parser->threads = num_threads;
+         start_read_ahead(parser->parser);
+      }
+   }
+   return parser;
+}
+
+//Same as get_parallel_parser for the blocks of several files, opened
+//here, one after another. Their ranges share one queue, files that
+//can't be mapped being streamed by one worker each. Returns NULL
+//if a file can't be opened or is a binary MAF.
+maf_parallel_parser get_parallel_files(char **filenames, int num_files,
+      int num_threads, int ordered){
+   FILE **files = calloc(num_files,sizeof(*files));
+   assert(files != NULL);
+   for(int i = 0; i < num_files; ++i){
+      if((files[i] = fopen(filenames[i],"rb")) == NULL){
+         fprintf(stderr, "Unable to open file: %s\nError: %s\n",
+            filenames[i],strerror(errno));
+         break;
+      }
+      if(is_mafbin(files[i])){
+         fprintf(stderr, "Binary MAFs can only be read on their own: %s\n",
+            filenames[i]);
+         fclose(files[i]);
+         files[i] = NULL;
+         break;
+      }
+   }
+   if(num_files == 0 || files[num_files-1] == NULL){
+      for(int i = 0; i < num_files && files[i] != NULL; ++i) fclose(files[i]);
+      free(files);
+      return NULL;
+   }
+   maf_parallel_parser parser;
+   if(num_files == 1)
+      parser = get_parallel_parser(files[0],filenames[0],num_threads,ordered);
+   else{
+      parser = new_parallel_parser(num_files,num_threads,ordered);
+      for(int i = 0; i < num_files; ++i){
+         parser->parsers[i] = get_mmap_parser(files[i],filenames[i]);
+         if(i > 0) share_intern_tables(parser->parsers[i],parser->parsers[0]);
+      }
+      parser->parser = parser->parsers[0];
+   }
+   parser->files = files;
+   return parser;
+}
+
+//Expand MAF file arguments, where @name is a file listing MAF files one
+//per line, skipping blank lines and lines starting with '#'. Relative
+//names in a list are from the list's directory. Returns a malloc'd
+//array of names, NULL if a list can't be read.
+char **read_file_args(char **args, int num_args, int *num_files){
+   int max = num_args > 0 ? num_args : 1;
+   char **files = malloc(max*sizeof(*files));
+   assert(files != NULL);
+   *num_files = 0;
+   char *line = NULL;
+   size_t line_max = 0;
+   for(int i = 0; i < num_args; ++i){
+      FILE *list = NULL;
+      char *name = args[i];
+      char *slash = strrchr(name,'/');
+      int dir_len = name[0] == '@' && slash != NULL ? slash-name : 1;
+      if(name[0] == '@' && (list = fopen(name+1,"r")) == NULL){
+         fprintf(stderr, "Unable to open file list: %s\nError: %s\n",
+            name+1,strerror(errno));
+         free(line);
+         free_file_args(files,*num_files);
+         return NULL;
+      }
+      while(1){
+         if(list != NULL){
+            ssize_t len = getline(&line,&line_max,list);
+            if(len < 0) break;
+            while(len > 0 && isspace((unsigned char)line[len-1])) line[--len] = '\0';
+            if(len == 0 || line[0] == '#') continue;
+            name = line;
+         }
+         if(*num_files == max){
+            max *= 2;
+            files = realloc(files,max*sizeof(*files));
+            assert(files != NULL);
+         }
+         if(list != NULL && name[0] != '/' && dir_len > 1){
+            files[*num_files] = malloc(dir_len+strlen(name)+1);
+            assert(files[*num_files] != NULL);
+            sprintf(files[*num_files],"%.*s/%s",dir_len-1,args[i]+1,name);
+         }else files[*num_files] = strdup(name);
+         assert(files[*num_files] != NULL);
+         ++*num_files;
+         if(list == NULL) break;
+      }
+      if(list != NULL) fclose(list);
+   }
+   free(line);
+   return files;
+}
+
+void free_file_args(char **files, int num_files){
+   if(files == NULL) return;
+   for(int i = 0; i < num_files; ++i) free(files[i]);
+   free(files);
+}
+
+//Same as set_pack_sequences, for every file.
+void parallel_pack_sequences(maf_parallel_parser parser, int pack){
+   for(int i = 0; i < parser->num_files; ++i)
+      set_pack_sequences(parser->parsers[i],pack);
+}
+
+//Same as set_parse_fields, for every file.
+void parallel_parse_fields(maf_parallel_parser parser, unsigned int fields){
+   for(int i = 0; i < parser->num_files; ++i)
+      set_parse_fields(parser->parsers[i],fields);
+}
+
+//Same as set_block_filter, for every file. Returns the number of files
+//whose blocks will be filtered.
+int parallel_block_filter(maf_parallel_parser parser, char **species,
+      int num_species){
+   int filtered = 0;
+   for(int i = 0; i < parser->num_files; ++i)
+      filtered += set_block_filter(parser->parsers[i],species,num_species);
+   return filtered;
+}
+
+alignment_block parallel_next_alignment(maf_parallel_parser parser){
+   if(parser->num_threads < 2){
+      parser->kind = LINEAR_BLOCKS;
+      return next_sequential(parser);
+   }
+   if(!parser->started){
+      parser->kind = LINEAR_BLOCKS;
+      start_workers(parser);
+   }
+   return next_block(parser);
+}
+
+//Same as get_sorted_alignment. The groups passed on the first call are
+//used for every file.
+sorted_alignment_block parallel_next_sorted(maf_parallel_parser parser,
+      char **in_group, int in_size, char **out_group, int out_size){
+   if(!parser->started && parser->kind != SORTED_BLOCKS){
+      parser->kind = SORTED_BLOCKS;
+      parser->in_group = in_group;
+      parser->in_size = in_size;
+      parser->out_group = out_group;
+      parser->out_size = out_size;
+   }
+   if(parser->num_threads < 2) return next_sequential(parser);
+   if(!parser->started) start_workers(parser);
+   return next_block(parser);
+}
+
+void free_parallel_parser(maf_parallel_parser parser){
+   if(parser->started){
+      pthread_mutex_lock(&parser->lock);
+      parser->stop = 1;
+      pthread_cond_broadcast(&parser->range_freed);
+      pthread_mutex_unlock(&parser->lock);
+      for(int i = 0; i < parser->num_threads; ++i)
+         pthread_join(parser->threads[i],NULL);
+      for(int i = 0; i < parser->num_ranges; ++i)
+         free_range_blocks(parser,&parser->ranges[i]);
+      free(parser->threads);
+      free(parser->ranges);
+      free(parser->finished);
+   }
+   pthread_cond_destroy(&parser->range_done);
+   pthread_cond_destroy(&parser->range_freed);
+   pthread_mutex_destroy(&parser->lock);
+//The first parser owns the intern tables the others use, so goes last.
+   for(int i = parser->num_files-1; i >= 0; --i){
+      free_linear_parser(parser->parsers[i]);
+      if(parser->files != NULL) fclose(parser->files[i]);
+   }
+   free(parser->parsers);
+   free(parser->files);
+   free(parser);
+}
@@ -0,0 +1,101 @@
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <pthread.h>
+
+#include "mafparser.h"
+
+//Target size in bytes of the ranges a file is split into for parallel
+//parsing. Each range is snapped forward to the next block boundary, so
+//ranges hold whole blocks and stay evenly sized however big blocks are.
+#ifndef RANGE_SIZE
+#define RANGE_SIZE (4<<20)
+#endif
+
+enum block_kind{ LINEAR_BLOCKS, SORTED_BLOCKS };
+
+//Blocks of a streamed range parsed but not yet consumed, at most.
+#ifndef STREAM_BLOCKS
+#define STREAM_BLOCKS 64
+#endif
+
+//A range of the file parsers[file]. Block i is blocks[i%max]. Files
+//that can't be mapped are one streamed range, parsed whole by one
+//worker that hands its blocks over as it goes through a ring of
+//STREAM_BLOCKS, so however big the file only those are held at once.
+//error is set when parsing stopped short of the range's end, blocks
+//holding those before the failure.
+typedef struct _parse_range{
+        int file;
+        size_t start;
+        size_t end;
+        void **blocks;
+        int size;
+        int max;
+        int next;
+        int done;
+        int error;
+        int stream;
+}*parse_range;
+
+typedef struct parallel_parser{
+        maf_linear_parser parser;
+//Parsers of every file, parsers[0] being parser. The rest share its
+//intern tables, so IDs mean the same in every file. files is set when
+//the files were opened here, to be closed on free.
+        maf_linear_parser *parsers;
+        FILE **files;
+        int num_files;
+//File read next when parsing on the calling thread.
+        int curr_file;
+        int num_threads;
+        pthread_t *threads;
+        int started;
+        int ordered;
+        enum block_kind kind;
+        char **in_group;
+        int in_size;
+        char **out_group;
+        int out_size;
+        struct _parse_range *ranges;
+        int num_ranges;
+//Ranges of every file go in one queue, claimed by workers in order,
+//at most max_in_flight of them parsed but not yet consumed at once. A
+//thread that finishes a range takes the next whatever file it's from,
+//so many small files still keep every thread busy.
+        int next_range;
+        int in_flight;
+        int max_in_flight;
+//Indices of finished ranges in the order they finished, consumed from
+//next_finished when blocks may come out of order.
+        int *finished;
+        int num_finished;
+        int next_finished;
+        int next_consume;
+        parse_range current;
+//Set once a range or file fails to parse. Its blocks up to the failure
+//are still handed out, then every call returns NULL as at the end, so
+//callers must check error once they get NULL.
+        int error;
+        int stop;
+        pthread_mutex_t lock;
+        pthread_cond_t range_done;
+        pthread_cond_t range_freed;
+}*maf_parallel_parser;
+
+maf_parallel_parser get_parallel_parser(FILE *maf_file, char *filename,
+              int num_threads, int ordered);
+maf_parallel_parser get_parallel_files(char **filenames, int num_files,
+              int num_threads, int ordered);
+char **read_file_args(char **args, int num_args, int *num_files);
+void free_file_args(char **files, int num_files);
+void parallel_pack_sequences(maf_parallel_parser parser, int pack);
+void parallel_parse_fields(maf_parallel_parser parser, unsigned int fields);
+int parallel_block_filter(maf_parallel_parser parser, char **species,
+      int num_species);
+alignment_block parallel_next_alignment(maf_parallel_parser parser);
+sorted_alignment_block parallel_next_sorted(maf_parallel_parser parser,
+              char **in_group, int in_size, char **out_group, int out_size);
+void free_parallel_parser(maf_parallel_parser parser);
+
+#endif
@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "mafparser.h"
+
+//Checks of parser interfaces no tool reads whole files through, run by
+//check.sh. Each command stops at the first thing wrong, says what, and
+//exits 1.
+
+static int failed(const char *format, ...){
+   va_list args;
+   va_start(args,format);
+   fprintf(stderr,"parser_test: ");
+   vfprintf(stderr,format,args);
+   fprintf(stderr,"\n");
+   va_end(args);
+   return 1;
+}
+
+static FILE *open_maf(char *filename){
+   FILE *maf_file = fopen(filename,"rb");
+   if(maf_file == NULL)
+      fprintf(stderr, "Unable to open file: %s\nError: %s\n",
+         filename,strerror(errno));
+   return maf_file;
+}
+
+//Fields of views aren't NUL terminated, so compare them by length.
+static int same_field(const char *a, size_t a_len, const char *b,
+      size_t b_len){
+   if((a == NULL) != (b == NULL)) return 0;
+   return a_len == b_len && (a_len == 0 || memcmp(a,b,a_len) == 0);
+}
+
+static int same_row(seq a, seq b){
+   return same_field(a->src,a->src_len,b->src,b->src_len)
+      && same_field(a->species,a->species_len,b->species,b->species_len)
+      && a->start == b->start && a->size == b->size
+      && a->strand == b->strand && a->srcSize == b->srcSize
+      && same_field(a->sequence,a->sequence_len,b->sequence,b->sequence_len);
+}
+
+static int same_lines(block_lines a, block_lines b){
+   if(a->size != b->size) return 0;
+   for(int i = 0; i < a->size; ++i){
+      line_span x = &a->spans[i], y = &b->spans[i];
+      if(x->type != y->type || !same_field(x->line,x->len,y->line,y->len))
+         return 0;
+   }
+   return 1;
+}
+
+static int same_sorted(sorted_alignment_block a, sorted_alignment_block b){
+   if(a->in_size != b->in_size || a->out_size != b->out_size
+         || a->seq_length != b->seq_length || !same_lines(&a->lines,&b->lines))
+      return 0;
+   for(int i = 0; i < a->in_size; ++i)
+      if(!same_row(a->in_sequences[i],b->in_sequences[i])) return 0;
+   for(int i = 0; i < a->out_size; ++i)
+      if(!same_row(a->out_sequences[i],b->out_sequences[i])) return 0;
+   return 1;
+}
+
+static int same_block(alignment_block a, alignment_block b){
+   if(a->offset != b->offset || a->length != b->length || a->size != b->size
+         || a->seq_length != b->seq_length || !same_lines(&a->lines,&b->lines))
+      return 0;
+   for(int i = 0; i < a->size; ++i)
+      if(!same_row(a->sequences[i],b->sequences[i])) return 0;
+   return 1;
+}
+
+//Read filename in batches of at most max_blocks blocks and max_bytes
+//bytes, mapped or buffered, checking each block against the same block
+//from linear_next_alignment_buffer and each batch against its limits.
+static int check_batches(char *filename, int max_blocks, size_t max_bytes,
+      int mapped){
+   FILE *batch_file = open_maf(filename);
+   FILE *block_file = open_maf(filename);
+   if(batch_file == NULL || block_file == NULL) return 1;
+   maf_linear_parser batches = mapped ? get_mmap_parser(batch_file,filename)
+      : get_linear_parser(batch_file,filename);
+   maf_linear_parser blocks = get_linear_parser(block_file,filename);
+   alignment_batch batch;
+   long num = 0;
+   int ret = 0;
+   while(ret == 0
+         && (batch = next_alignment_batch(batches,max_blocks,max_bytes)) != NULL){
+      uint64_t bytes = 0;
+      int row = 0;
+      for(int i = 0; ret == 0 && i < batch->size; ++i, ++num){
+         alignment_block aln = &batch->blocks[i];
+         alignment_block expected = linear_next_alignment_buffer(blocks);
+         if(expected == NULL)
+            ret = failed("batch block %ld is past the last block",num);
+         else if(!same_block(aln,expected))
+            ret = failed("batch block %ld differs from the block read alone",num);
+         for(int j = 0; ret == 0 && j < aln->size; ++j)
+            if(aln->sequences[j] != &batch->rows[row+j])
+               ret = failed("row %d of batch block %ld isn't batch row %d",
+                     j,num,row+j);
+         row += aln->size;
+         bytes += aln->length;
+         free_alignment_block(expected);
+      }
+      if(ret == 0 && row != batch->num_rows)
+         ret = failed("batch has %d rows, its blocks %d",batch->num_rows,row);
+      else if(ret == 0 && bytes != batch->bytes)
+         ret = failed("batch spans %llu bytes, its blocks %llu",
+               (unsigned long long)batch->bytes,(unsigned long long)bytes);
+      else if(ret == 0 && max_blocks > 0 && batch->size > max_blocks)
+         ret = failed("batch of %d blocks is over %d",batch->size,max_blocks);
+      else if(ret == 0 && max_bytes > 0
+            && bytes-batch->blocks[batch->size-1].length >= max_bytes)
+         ret = failed("batch goes on past %zu bytes",max_bytes);
+//A batch short of both limits must be the last.
+      int short_batch = (max_blocks <= 0 || batch->size < max_blocks)
+         && (max_bytes == 0 || bytes < max_bytes);
+      free_alignment_batch(batch);
+      if(ret == 0 && short_batch
+            && (batch = next_alignment_batch(batches,max_blocks,max_bytes)) != NULL){
+         free_alignment_batch(batch);
+         ret = failed("batch ending at block %ld is short of its limits",num);
+      }
+   }
+   if(ret == 0 && batches->error) ret = failed("reading batches failed");
+   alignment_block left;
+   if(ret == 0 && (left = linear_next_alignment_buffer(blocks)) != NULL){
+      free_alignment_block(left);
+      ret = failed("batches end before block %ld",num);
+   }
+   free_linear_parser(batches);
+   free_linear_parser(blocks);
+   fclose(batch_file);
+   fclose(block_file);
+   return ret;
+}
+
+//A block with its 'i', 'e' and 'q' lines between its rows, and the block
+//after it.
+static const char *span_maf =
+   "##maf version=1\n"
+   "\n"
+   "a score=1\n"
+   "s hg38.chr1 100 10 + 1000 ACGT-ACGTAC\n"
+   "q hg38.chr1 99999-9F999\n"
+   "i hg38.chr1 N 0 C 12\n"
+   "e rn6.chr3 300 40 - 3000 I\n"
+   "s mm10.chr2 200 11 - 2000 ACGTTACGTAC\n"
+   "i mm10.chr2 I 5 n 0\n"
+   "\n"
+   "a score=2\n"
+   "s hg38.chr1 110 4 + 1000 ACGT\n"
+   "\n";
+
+static int check_info(block_lines lines, const char *src, char left_status,
+      unsigned long left_count, char right_status, unsigned long right_count){
+   line_span span = find_line_span(lines,'i',src,strlen(src));
+   char left, right;
+   unsigned long left_n, right_n;
+   if(span == NULL) return failed("no 'i' line of %s",src);
+   if(decode_info_line(span,&left,&left_n,&right,&right_n) != 0
+         || left != left_status || left_n != left_count
+         || right != right_status || right_n != right_count)
+      return failed("'i' line of %s decoded wrong",src);
+   return 0;
+}
+
+//Read span_maf mapped or buffered, checking the first block keeps both
+//rows and all four lines, and that each line decodes to what it says.
+static int check_spans(int mapped){
+   FILE *maf_file = tmpfile();
+   if(maf_file == NULL || fputs(span_maf,maf_file) < 0
+         || fflush(maf_file) != 0){
+      fprintf(stderr,"Unable to write temporary file: %s\n",strerror(errno));
+      return 1;
+   }
+   rewind(maf_file);
+   char *filename = "spans.maf";
+   maf_linear_parser parser = mapped ? get_mmap_parser(maf_file,filename)
+      : get_linear_parser(maf_file,filename);
+   alignment_block aln = linear_next_alignment_buffer(parser);
+   alignment_block next = linear_next_alignment_buffer(parser);
+   block_lines lines = aln != NULL ? &aln->lines : NULL;
+   static const char types[] = "qiei";
+   int ret = 0;
+   if(aln == NULL || next == NULL)
+      ret = failed("expected two blocks");
+   else if(aln->size != 2 || next->size != 1 || next->sequences[0]->start != 110)
+      ret = failed("rows after the 'i', 'e' and 'q' lines went missing");
+   else if(lines->size != 4)
+      ret = failed("expected 4 lines in the block, got %d",lines->size);
+   for(int i = 0; ret == 0 && i < lines->size; ++i)
+      if(lines->spans[i].type != types[i])
+         ret = failed("line %d is '%c', not '%c'",i,lines->spans[i].type,
+               types[i]);
+   if(ret == 0) ret = check_info(lines,"hg38.chr1",'N',0,'C',12);
+   if(ret == 0) ret = check_info(lines,"mm10.chr2",'I',5,'n',0);
+   if(ret == 0 && find_line_span(lines,'i',"rn6.chr3",8) != NULL)
+      ret = failed("found an 'i' line of rn6.chr3");
+   if(ret == 0){
+      line_span span = find_line_span(lines,'q',"hg38.chr1",9);
+      char *quality;
+      size_t len;
+      if(span == NULL || decode_quality_line(span,&quality,&len) != 0
+            || !same_field(quality,len,"99999-9F999",11))
+         ret = failed("'q' line of hg38.chr1 decoded wrong");
+      else if(find_line_span(lines,'q',"mm10.chr2",9) != NULL)
+         ret = failed("found a 'q' line of mm10.chr2");
+   }
+   if(ret == 0){
+      line_span span = find_line_span(lines,'e',"rn6.chr3",8);
+      struct _aligned_sequence fields;
+      char status;
+      if(span == NULL || decode_empty_line(span,&fields,&status) != 0
+            || !same_field(fields.src,fields.src_len,"rn6.chr3",8)
+            || fields.start != 300 || fields.size != 40
+            || fields.strand != '-' || fields.srcSize != 3000
+            || status != 'I' || fields.sequence != NULL)
+         ret = failed("'e' line of rn6.chr3 decoded wrong");
+   }
+   if(ret != 0) fprintf(stderr,"parser_test: reading %s\n",
+         mapped ? "mapped" : "buffered");
+   free_alignment_block(aln);
+   free_alignment_block(next);
+   free_linear_parser(parser);
+   fclose(maf_file);
+   return ret;
+}
+
+//Groups of conservomatic's checks, for sorting blocks.
+static char *in_group[] = { "amaVit1", "croPor2", "Anc05", "Anc14", "Anc21" };
+static char *out_group[] = { "Anc10", "Anc09", "Anc07", "Anc18" };
+
+//Read filename into one reusable block and one reusable sorted block,
+//mapped or buffered, checking every refill against a block freshly
+//allocated by linear_next_alignment_buffer or get_sorted_alignment.
+static int check_refill(char *filename, int mapped){
+   FILE *files[4];
+   maf_linear_parser parsers[4];
+   for(int i = 0; i < 4; ++i){
+      if((files[i] = open_maf(filename)) == NULL) return 1;
+      parsers[i] = mapped ? get_mmap_parser(files[i],filename)
+         : get_linear_parser(files[i],filename);
+   }
+   alignment_block aln = get_reusable_alignment(parsers[0]);
+   sorted_alignment_block sorted = get_reusable_sorted_alignment(parsers[2]);
+   long num = 0;
+   int ret = 0, got;
+   while(ret == 0 && (got = linear_refill_alignment(parsers[0],aln)) > 0){
+      alignment_block fresh = linear_next_alignment_buffer(parsers[1]);
+      if(fresh == NULL || !same_block(aln,fresh))
+         ret = failed("refilled block %ld differs from a new one",num);
+      free_alignment_block(fresh);
+      ++num;
+   }
+   if(ret == 0 && got < 0) ret = failed("refilling blocks failed");
+   long num_sorted = 0;
+   while(ret == 0 && (got = refill_sorted_alignment(parsers[2],sorted,
+            in_group,5,out_group,4)) > 0){
+      sorted_alignment_block fresh = get_sorted_alignment(parsers[3],
+            in_group,5,out_group,4);
+      if(fresh == NULL || !same_sorted(sorted,fresh))
+         ret = failed("refilled sorted block %ld differs from a new one",
+               num_sorted);
+      free_sorted_alignment(fresh);
+      ++num_sorted;
+   }
+   if(ret == 0 && got < 0) ret = failed("refilling sorted blocks failed");
+   alignment_block left = ret == 0 ? linear_next_alignment_buffer(parsers[1])
+      : NULL;
+   sorted_alignment_block left_sorted = ret == 0
+      ? get_sorted_alignment(parsers[3],in_group,5,out_group,4) : NULL;
+   if(left != NULL || left_sorted != NULL)
+      ret = failed("refilling stopped before the last block");
+   else if(ret == 0 && num != num_sorted)
+      ret = failed("%ld blocks refilled, %ld sorted",num,num_sorted);
+   if(ret != 0) fprintf(stderr,"parser_test: reading %s\n",
+         mapped ? "mapped" : "buffered");
+   free_alignment_block(left);
+   free_sorted_alignment(left_sorted);
+   free_alignment_block(aln);
+   free_sorted_alignment(sorted);
+   for(int i = 0; i < 4; ++i){
+      free_linear_parser(parsers[i]);
+      fclose(files[i]);
+   }
+   return ret;
+}
+
+//Species of the blocks check_hash reads, spN being species N: 300
+//species, enough to grow the table past 256, then three, then 260 that
+//the first block didn't have.
+#define HASH_SPECIES 1260
+#define HASH_BLOCKS 3
+
+static int in_hash_block(int block, int species){
+   if(block == 0) return species < 300;
+   if(block == 1) return species == 0 || species == 299 || species == 1000;
+   return species >= 1000;
+}
+
+static FILE *write_hash_maf(){
+   FILE *maf_file = tmpfile();
+   if(maf_file == NULL){
+      fprintf(stderr,"Unable to write temporary file: %s\n",strerror(errno));
+      return NULL;
+   }
+   fprintf(maf_file,"##maf version=1\n");
+   for(int block = 0; block < HASH_BLOCKS; ++block){
+      fprintf(maf_file,"\na score=%d\n",block);
+      for(int species = 0; species < HASH_SPECIES; ++species)
+         if(in_hash_block(block,species))
+            fprintf(maf_file,"s sp%d.chr1 %d 4 + 100000 ACGT\n",species,
+               10*species+block);
+   }
+   fflush(maf_file);
+   rewind(maf_file);
+   return maf_file;
+}
+
+//Every species of the file must have its row in block and only there,
+//looked up by names that aren't NUL terminated.
+static int check_hash_block(hash_alignment_block aln, int block){
+   char name[32];
+   int count = 0;
+   for(int species = 0; species < HASH_SPECIES; ++species){
+      int len = sprintf(name,"sp%d.",species)-1;
+      seq row = find_species_row(aln,name,len);
+      if(!in_hash_block(block,species)){
+         if(row != NULL)
+            return failed("block %d has a row of sp%d",block,species);
+         continue;
+      }
+      ++count;
+      if(row == NULL || row->start != (unsigned long)10*species+block)
+         return failed("row of sp%d in block %d not found",species,block);
+   }
+   if(aln->size != count || aln->rows_size != count)
+      return failed("block %d has %d species, %d rows, not %d",block,
+            aln->size,aln->rows_size,count);
+   return 0;
+}
+
+//Read the blocks of write_hash_maf into a new hash block each and into
+//one reusable hash block, mapped or buffered.
+static int check_hash(int mapped){
+   FILE *files[2];
+   maf_linear_parser parsers[2];
+   for(int i = 0; i < 2; ++i){
+      if((files[i] = write_hash_maf()) == NULL) return 1;
+      parsers[i] = mapped ? get_mmap_parser(files[i],"hash.maf")
+         : get_linear_parser(files[i],"hash.maf");
+   }
+   hash_alignment_block reused = get_reusable_hash_alignment(parsers[1]);
+   int ret = 0;
+   for(int block = 0; ret == 0 && block < HASH_BLOCKS; ++block){
+      hash_alignment_block aln = get_next_alignment_hash(parsers[0]);
+      if(aln == NULL || refill_alignment_hash(parsers[1],reused) <= 0)
+         ret = failed("block %d missing",block);
+      if(ret == 0) ret = check_hash_block(aln,block);
+      if(ret == 0) ret = check_hash_block(reused,block);
+      free_hash_alignment(aln);
+   }
+   if(ret != 0) fprintf(stderr,"parser_test: reading %s\n",
+         mapped ? "mapped" : "buffered");
+   free_hash_alignment(reused);
+   for(int i = 0; i < 2; ++i){
+      free_linear_parser(parsers[i]);
+      fclose(files[i]);
+   }
+   return ret;
+}
+
+//Blocks decoded by each thread of check_decode.
+#define DECODES 2000
+
+typedef struct _decode_thread{
+   maf_array_parser parser;
+   alignment_block *expected;
+   unsigned int seed;
+   int ret;
+}*decode_thread;
+
+static void *decode_blocks(void *arg){
+   decode_thread thread = arg;
+   char *buf = NULL;
+   size_t buf_size = 0;
+   for(int i = 0; thread->ret == 0 && i < DECODES; ++i){
+      uint64_t block = rand_r(&thread->seed) % thread->parser->size;
+      alignment_block aln = decode_block(thread->parser,block,&buf,&buf_size);
+      if(aln == NULL)
+         thread->ret = failed("decoding block %llu failed",
+               (unsigned long long)block);
+      else if(!same_block(aln,thread->expected[block]))
+         thread->ret = failed("decoded block %llu differs from the block "
+               "read in order",(unsigned long long)block);
+      free_alignment_block(aln);
+   }
+   free(buf);
+   return NULL;
+}
+
+//Read every block of filename in order with array_next_alignment, then
+//decode random blocks of it on num_threads threads at once, in front of
+//a cache of cache_bytes if it isn't 0, checking each against the block
+//read in order.
+static int check_decode(char *filename, int num_threads, size_t cache_bytes){
+   FILE *maf_file = open_maf(filename);
+   if(maf_file == NULL) return 1;
+   maf_array_parser parser = get_array_parser(maf_file,filename);
+   if(parser == NULL) return failed("unable to index %s",filename);
+   alignment_block *expected = malloc(parser->size*sizeof(*expected));
+   assert(expected != NULL);
+   int ret = 0;
+   for(int64_t i = 0; i < parser->size; ++i)
+      if((expected[i] = array_next_alignment(parser)) == NULL && ret == 0)
+         ret = failed("reading block %lld failed",(long long)i);
+   if(cache_bytes > 0) set_block_cache(parser,cache_bytes);
+   struct _decode_thread *threads = calloc(num_threads,sizeof(*threads));
+   pthread_t *ids = malloc(num_threads*sizeof(*ids));
+   assert(threads != NULL && ids != NULL);
+   int started = 0;
+   for(int i = 0; ret == 0 && i < num_threads; ++i, ++started){
+      threads[i].parser = parser;
+      threads[i].expected = expected;
+      threads[i].seed = i+1;
+      if(pthread_create(&ids[i],NULL,decode_blocks,&threads[i]) != 0){
+         fprintf(stderr,"Failed to create decode thread\n");
+         exit(1);
+      }
+   }
+   for(int i = 0; i < started; ++i){
+      pthread_join(ids[i],NULL);
+      if(threads[i].ret != 0) ret = 1;
+   }
+   for(int64_t i = 0; i < parser->size; ++i) free_alignment_block(expected[i]);
+   free(expected);
+   free(threads);
+   free(ids);
+   free_array_parser(parser);
+   fclose(maf_file);
+   return ret;
+}
+
+static void usage(char *name){
+   fprintf(stderr,"Usage: %s batch <maf file> <max blocks> <max bytes>\n"
+      "       %s spans\n"
+      "       %s decode <maf file> <threads> <cache bytes>\n"
+      "       %s refill <maf file>\n"
+      "       %s hash\n",
+      name,name,name,name,name);
+   exit(1);
+}
+
+int main(int argc, char **argv){
+   if(argc < 2) usage(argv[0]);
+   if(!strcmp(argv[1],"batch") && argc == 5){
+      int max_blocks = atoi(argv[3]);
+      size_t max_bytes = strtoul(argv[4],NULL,10);
+      return check_batches(argv[2],max_blocks,max_bytes,1)
+         || check_batches(argv[2],max_blocks,max_bytes,0);
+   }
+   if(!strcmp(argv[1],"decode") && argc == 5)
+      return check_decode(argv[2],atoi(argv[3]),strtoul(argv[4],NULL,10));
+   if(!strcmp(argv[1],"refill") && argc == 3)
+      return check_refill(argv[2],1) || check_refill(argv[2],0);
+   if(!strcmp(argv[1],"hash") && argc == 2)
+      return check_hash(1) || check_hash(0);
+   if(!strcmp(argv[1],"spans") && argc == 2)
+      return check_spans(1) || check_spans(0);
+   usage(argv[0]);
+   return 1;
+}
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "readahead.h"
+#include "uring.h"
+
+//Queue reads into the free buffers, tagged with their position in the
+//ring, until READ_AHEAD_BUFFERS are ahead of the consumer or the whole
+//file is asked for.
+static void issue_reads(read_ahead ahead){
+   while(ahead->tail-ahead->head < READ_AHEAD_BUFFERS
+         && ahead->offset < ahead->file_size){
+      read_buffer buffer = &ahead->buffers[ahead->tail % READ_AHEAD_BUFFERS];
+      buffer->offset = ahead->offset;
+      buffer->want = ahead->file_size-ahead->offset < READ_AHEAD_SIZE
+         ? ahead->file_size-ahead->offset : READ_AHEAD_SIZE;
+      buffer->len = 0;
+      buffer->error = 0;
+      buffer->filled = 0;
+      if(uring_read(ahead->ring,ahead->fd,buffer->data,buffer->want,
+            buffer->offset,ahead->tail) != 0) break;
+      ahead->offset += buffer->want;
+      ++ahead->tail;
+   }
+   if(ahead->offset >= ahead->file_size) ahead->done = 1;
+   uring_submit(ahead->ring);
+}
+
+//Wait for a read to complete and add it to its buffer. Short reads are
+//continued unless reading is being stopped, a read of nothing means
+//the file has shrunk, so the buffer is left short. Returns -1 when no
+//read is in flight or on error.
+static int reap_read(read_ahead ahead){
+   uint64_t tag;
+   int res;
+   if(uring_wait(ahead->ring,&tag,&res) != 0) return -1;
+   read_buffer buffer = &ahead->buffers[tag % READ_AHEAD_BUFFERS];
+   if(res < 0) buffer->error = -res;
+   else buffer->len += res;
+   if(res > 0 && buffer->len < buffer->want && !ahead->stop
+         && uring_read(ahead->ring,ahead->fd,buffer->data+buffer->len,
+            buffer->want-buffer->len,buffer->offset+buffer->len,tag) == 0){
+      uring_submit(ahead->ring);
+      return 0;
+   }
+   buffer->filled = 1;
+   return 0;
+}
+
+static void *read_worker(void *arg){
+   read_ahead ahead = arg;
+   pthread_mutex_lock(&ahead->lock);
+   while(!ahead->stop){
+      while(!ahead->stop && ahead->tail-ahead->head == READ_AHEAD_BUFFERS)
+         pthread_cond_wait(&ahead->freed,&ahead->lock);
+      if(ahead->stop) break;
+      read_buffer buffer = &ahead->buffers[ahead->tail % READ_AHEAD_BUFFERS];
+      pthread_mutex_unlock(&ahead->lock);
+      buffer->len = fread(buffer->data,1,READ_AHEAD_SIZE,ahead->file);
+      buffer->error = ferror(ahead->file) ? errno : 0;
+      pthread_mutex_lock(&ahead->lock);
+      ++ahead->tail;
+//A short read is the end of the file or an error.
+      if(buffer->len < READ_AHEAD_SIZE) ahead->done = 1;
+      pthread_cond_signal(&ahead->filled);
+      if(ahead->done) break;
+   }
+   ahead->done = 1;
+   pthread_cond_signal(&ahead->filled);
+   pthread_mutex_unlock(&ahead->lock);
+   return NULL;
+}
+
+//Start reading file into a ring of buffers, from where the stream is
+//now, through io_uring for regular files and on an I/O thread otherwise.
+read_ahead get_read_ahead(FILE *file, char *filename){
+   read_ahead ahead = calloc(1,sizeof(*ahead));
+   assert(ahead != NULL);
+   ahead->file = file;
+   ahead->filename = strdup(filename);
+   assert(ahead->filename != NULL);
+   for(int i = 0; i < READ_AHEAD_BUFFERS; ++i){
+//One spare byte lets the parser terminate the last line.
+      ahead->buffers[i].mem = malloc(READ_AHEAD_HEADROOM+READ_AHEAD_SIZE+1);
+      assert(ahead->buffers[i].mem != NULL);
+      ahead->buffers[i].data = ahead->buffers[i].mem+READ_AHEAD_HEADROOM;
+   }
+   pthread_mutex_init(&ahead->lock,NULL);
+   pthread_cond_init(&ahead->filled,NULL);
+   pthread_cond_init(&ahead->freed,NULL);
+   struct stat st;
+   off_t pos = ftello(file);
+   if(pos >= 0 && fstat(fileno(file),&st) == 0 && S_ISREG(st.st_mode)
+         && (ahead->ring = get_uring(READ_AHEAD_BUFFERS)) != NULL){
+      ahead->fd = fileno(file);
+      ahead->offset = pos;
+      ahead->file_size = st.st_size;
+      issue_reads(ahead);
+      return ahead;
+   }
+   if(pthread_create(&ahead->thread,NULL,read_worker,ahead) != 0){
+      fprintf(stderr,"Failed to create thread: %s\n",strerror(errno));
+      exit(1);
+   }
+   return ahead;
+}
+
+//Wait for the next filled buffer and return its data, with len set to
+//its length. Earlier buffers stay valid until release_read_buffers.
+//Returns NULL at the end of the file, or on error after reporting it.
+char *next_read_buffer(read_ahead ahead, size_t *len){
+   *len = 0;
+   read_buffer buffer;
+   if(ahead->ring != NULL){
+      issue_reads(ahead);
+      if(ahead->next == ahead->tail) return NULL;
+      buffer = &ahead->buffers[ahead->next++ % READ_AHEAD_BUFFERS];
+      while(!buffer->filled){
+         if(reap_read(ahead) != 0){
+            ahead->error = 1;
+            return NULL;
+         }
+      }
+   }else{
+      pthread_mutex_lock(&ahead->lock);
+      while(ahead->next == ahead->tail && !ahead->done)
+         pthread_cond_wait(&ahead->filled,&ahead->lock);
+      if(ahead->next == ahead->tail){
+         pthread_mutex_unlock(&ahead->lock);
+         return NULL;
+      }
+      buffer = &ahead->buffers[ahead->next++ % READ_AHEAD_BUFFERS];
+      pthread_mutex_unlock(&ahead->lock);
+   }
+   if(buffer->error != 0){
+      ahead->error = 1;
+      fprintf(stderr, "File stream error: %s\nError: %s\n",
+         ahead->filename,strerror(buffer->error));
+      return NULL;
+   }
+   *len = buffer->len;
+   return buffer->data;
+}
+
+//Hand every buffer before the one last returned back to the I/O thread.
+void release_read_buffers(read_ahead ahead){
+   if(ahead->ring != NULL){
+      if(ahead->next > ahead->head+1) ahead->head = ahead->next-1;
+      issue_reads(ahead);
+      return;
+   }
+   pthread_mutex_lock(&ahead->lock);
+   if(ahead->next > ahead->head+1){
+      ahead->head = ahead->next-1;
+      pthread_cond_signal(&ahead->freed);
+   }
+   pthread_mutex_unlock(&ahead->lock);
+}
+
+static void stop_read_ahead(read_ahead ahead){
+//Reads still in flight are waited for, the kernel writes to the buffers.
+   if(ahead->ring != NULL){
+      ahead->stop = 1;
+      while(reap_read(ahead) == 0);
+      return;
+   }
+   pthread_mutex_lock(&ahead->lock);
+   if(ahead->stop){
+      pthread_mutex_unlock(&ahead->lock);
+      return;
+   }
+   ahead->stop = 1;
+   pthread_cond_signal(&ahead->freed);
+   pthread_mutex_unlock(&ahead->lock);
+   pthread_join(ahead->thread,NULL);
+}
+
+//Stop reading ahead and return a malloc'd copy of the buffer last
+//returned by next_read_buffer and everything read after it, with len
+//set to its length. The file is left positioned after it.
+char *drain_read_ahead(read_ahead ahead, size_t *len){
+   if(ahead->ring != NULL){
+      for(unsigned long i = ahead->next; i < ahead->tail; ++i){
+         while(!ahead->buffers[i % READ_AHEAD_BUFFERS].filled)
+            if(reap_read(ahead) != 0) break;
+      }
+//The stream hasn't moved, so put it after what was read.
+      fseeko(ahead->file,ahead->offset,SEEK_SET);
+   }
+   stop_read_ahead(ahead);
+   if(ahead->next > ahead->head) --ahead->next;
+   *len = 0;
+   for(unsigned long i = ahead->next; i < ahead->tail; ++i)
+      *len += ahead->buffers[i % READ_AHEAD_BUFFERS].len;
+   char *data = malloc(*len+1);
+   assert(data != NULL);
+   size_t pos = 0;
+   for(unsigned long i = ahead->next; i < ahead->tail; ++i){
+      read_buffer buffer = &ahead->buffers[i % READ_AHEAD_BUFFERS];
+      memcpy(data+pos,buffer->data,buffer->len);
+      pos += buffer->len;
+   }
+   ahead->next = ahead->tail;
+   return data;
+}
+
+void free_read_ahead(read_ahead ahead){
+   if(ahead == NULL) return;
+   stop_read_ahead(ahead);
+   for(int i = 0; i < READ_AHEAD_BUFFERS; ++i) free(ahead->buffers[i].mem);
+   pthread_mutex_destroy(&ahead->lock);
+   pthread_cond_destroy(&ahead->filled);
+   pthread_cond_destroy(&ahead->freed);
+   free_uring(ahead->ring);
+   free(ahead->filename);
+   free(ahead);
+}
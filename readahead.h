@@ -0,0 +1,62 @@
+#ifndef __READAHEAD_H
+#define __READAHEAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+//Size and number of the buffers an I/O thread fills ahead of the
+//parser. Each buffer has READ_AHEAD_HEADROOM bytes in front of it, so
+//the end of a line begun in the previous buffer can be copied in front
+//of the rest of the line. Longer lines are joined in the parser's own
+//buffer instead.
+#ifndef READ_AHEAD_SIZE
+#define READ_AHEAD_SIZE (4<<20)
+#endif
+#define READ_AHEAD_BUFFERS 4
+#define READ_AHEAD_HEADROOM (1<<20)
+
+typedef struct _read_buffer{
+	char *mem;
+	char *data;
+	size_t len;
+	int error;
+//With io_uring, the bytes of the file the buffer is being read from,
+//set once they're all in.
+	uint64_t offset;
+	size_t want;
+	int filled;
+}*read_buffer;
+
+//Buffers tail-1 back to head are filled, the consumer holds those from
+//head to next-1 and the I/O thread fills the buffer at tail once it is
+//free. Regular files are read through io_uring instead where it's
+//available, with no thread: reads for every free buffer are in flight
+//at once and buffers next to tail-1 are filled once the kernel is done.
+typedef struct _read_ahead{
+	FILE *file;
+	char *filename;
+	struct _uring *ring;
+	int fd;
+	uint64_t offset;
+	uint64_t file_size;
+	struct _read_buffer buffers[READ_AHEAD_BUFFERS];
+	unsigned long head;
+	unsigned long next;
+	unsigned long tail;
+	int done;
+	int error;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t freed;
+}*read_ahead;
+
+read_ahead get_read_ahead(FILE *file, char *filename);
+char *next_read_buffer(read_ahead ahead, size_t *len);
+void release_read_buffers(read_ahead ahead);
+char *drain_read_ahead(read_ahead ahead, size_t *len);
+void free_read_ahead(read_ahead ahead);
+
+#endif
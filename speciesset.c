@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "speciesset.h"
+
+static inline uint32_t species_hash(const char *name, size_t len,
+      uint32_t seed){
+   uint32_t hash = 2166136261u ^ (seed*0x9e3779b9u);
+   for(size_t i = 0; i < len; ++i) hash = (hash^(unsigned char)name[i])*16777619u;
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6bu;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35u;
+   hash ^= hash >> 16;
+   return hash;
+}
+
+static uint32_t next_power(uint32_t n){
+   uint32_t power = 1;
+   while(power < n) power *= 2;
+   return power;
+}
+
+static void add_species(species_set set, char *name, enum species_group group){
+   size_t len = strlen(name);
+   for(int i = 0; i < set->size; ++i)
+      if(set->lens[i] == len && !memcmp(set->names[i],name,len)) return;
+   set->names[set->size] = name;
+   set->lens[set->size] = len;
+   set->groups[set->size++] = group;
+}
+
+//Place every bucket, largest first, by searching for a seed that sends
+//all its names to free slots. Returns 0 if some bucket can't be placed.
+static int place_buckets(species_set set, int *bucket_of, int num_buckets){
+   int *order = malloc(num_buckets*sizeof(int));
+   int *counts = calloc(num_buckets,sizeof(int));
+   int *members = malloc((set->size+1)*sizeof(int));
+   uint32_t *tried = malloc((set->size+1)*sizeof(uint32_t));
+   assert(order != NULL && counts != NULL && members != NULL && tried != NULL);
+   for(int i = 0; i < set->size; ++i) ++counts[bucket_of[i]];
+   for(int i = 0; i < num_buckets; ++i) order[i] = i;
+   for(int i = 1; i < num_buckets; ++i){
+      int bucket = order[i], j = i;
+      for(; j > 0 && counts[order[j-1]] < counts[bucket]; --j) order[j] = order[j-1];
+      order[j] = bucket;
+   }
+   int placed = 1;
+   for(int b = 0; b < num_buckets && placed; ++b){
+      int bucket = order[b];
+      if(counts[bucket] == 0) break;
+      int size = 0;
+      for(int i = 0; i < set->size; ++i)
+         if(bucket_of[i] == bucket) members[size++] = i;
+      placed = 0;
+      for(uint32_t seed = 1; seed < (1u<<20) && !placed; ++seed){
+         int ok = 1;
+         for(int m = 0; m < size && ok; ++m){
+            tried[m] = species_hash(set->names[members[m]],set->lens[members[m]],
+               seed) & set->slot_mask;
+            if(set->slots[tried[m]] >= 0) ok = 0;
+            for(int k = 0; k < m && ok; ++k) if(tried[k] == tried[m]) ok = 0;
+         }
+         if(!ok) continue;
+         for(int m = 0; m < size; ++m) set->slots[tried[m]] = members[m];
+         set->seeds[bucket] = seed;
+         placed = 1;
+      }
+   }
+   free(order);
+   free(counts);
+   free(members);
+   free(tried);
+   return placed;
+}
+
+//Compile the groups into a species set. A species in both groups is
+//treated as in group, as get_sorted_alignment always has.
+species_set get_species_set(char **in_group, int in_size, char **out_group,
+      int out_size){
+   species_set set = calloc(1,sizeof(*set));
+   assert(set != NULL);
+   int max = in_size+out_size+1;
+   set->names = malloc(max*sizeof(*set->names));
+   set->lens = malloc(max*sizeof(*set->lens));
+   set->groups = malloc(max*sizeof(*set->groups));
+   assert(set->names != NULL && set->lens != NULL && set->groups != NULL);
+   for(int i = 0; i < in_size; ++i) add_species(set,in_group[i],IN_GROUP);
+   for(int i = 0; i < out_size; ++i) add_species(set,out_group[i],OUT_GROUP);
+   set->in_group = in_group;
+   set->in_size = in_size;
+   set->out_group = out_group;
+   set->out_size = out_size;
+   uint32_t num_buckets = next_power(set->size/4+1);
+   set->bucket_mask = num_buckets-1;
+   set->seeds = calloc(num_buckets,sizeof(*set->seeds));
+   assert(set->seeds != NULL);
+   int *bucket_of = malloc((set->size+1)*sizeof(int));
+   assert(bucket_of != NULL);
+   for(int i = 0; i < set->size; ++i)
+      bucket_of[i] = species_hash(set->names[i],set->lens[i],0) & set->bucket_mask;
+   uint32_t num_slots = next_power(2*set->size+1);
+   while(1){
+      set->slot_mask = num_slots-1;
+      set->slots = malloc(num_slots*sizeof(*set->slots));
+      assert(set->slots != NULL);
+      memset(set->slots,-1,num_slots*sizeof(*set->slots));
+      if(place_buckets(set,bucket_of,num_buckets)) break;
+      free(set->slots);
+      num_slots *= 2;
+   }
+   free(bucket_of);
+   return set;
+}
+
+//Check a set was compiled from these group arrays.
+int species_set_matches(species_set set, char **in_group, int in_size,
+      char **out_group, int out_size){
+   return set->in_group == in_group && set->in_size == in_size
+      && set->out_group == out_group && set->out_size == out_size;
+}
+
+//Group of the species name of len bytes, which need not be NUL
+//terminated.
+enum species_group find_species(species_set set, const char *name,
+      size_t len){
+   uint32_t seed = set->seeds[species_hash(name,len,0) & set->bucket_mask];
+   if(seed == 0) return NO_GROUP;
+   int slot = set->slots[species_hash(name,len,seed) & set->slot_mask];
+   if(slot < 0 || set->lens[slot] != len || memcmp(set->names[slot],name,len))
+      return NO_GROUP;
+   return set->groups[slot];
+}
+
+void free_species_set(species_set set){
+   if(set == NULL) return;
+   free(set->names);
+   free(set->lens);
+   free(set->groups);
+   free(set->seeds);
+   free(set->slots);
+   free(set);
+}
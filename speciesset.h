@@ -0,0 +1,37 @@
+#ifndef __SPECIESSET_H
+#define __SPECIESSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum species_group{ NO_GROUP, IN_GROUP, OUT_GROUP };
+
+//Perfect hash over the in and out group species. A name hashes to a
+//bucket, the bucket's seed picks its slot, and a single comparison
+//confirms it, so looking up a species costs the same whatever the
+//number of species.
+typedef struct _species_set{
+	char **names;
+	size_t *lens;
+	enum species_group *groups;
+	int size;
+	uint32_t *seeds;
+	uint32_t bucket_mask;
+	int *slots;
+	uint32_t slot_mask;
+//Arrays the set was compiled from, to tell when it can be reused.
+	char **in_group;
+	int in_size;
+	char **out_group;
+	int out_size;
+}*species_set;
+
+species_set get_species_set(char **in_group, int in_size, char **out_group,
+      int out_size);
+int species_set_matches(species_set set, char **in_group, int in_size,
+      char **out_group, int out_size);
+enum species_group find_species(species_set set, const char *name,
+      size_t len);
+void free_species_set(species_set set);
+
+#endif
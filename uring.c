@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#if !defined(NO_URING) && defined(__linux__) && defined(__NR_io_uring_setup)
+
+#include <linux/io_uring.h>
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+      unsigned flags){
+   return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,NULL,0);
+}
+
+//Set up a ring for entries reads in flight, rounded up by the kernel
+//to a power of 2. NULL if the kernel won't give us one.
+uring get_uring(unsigned entries){
+   struct io_uring_params params;
+   memset(&params,0,sizeof(params));
+   int fd = syscall(__NR_io_uring_setup,entries,&params);
+   if(fd < 0) return NULL;
+//IORING_OP_READ came with the same kernel as fast poll, older rings
+//can't do plain reads.
+   if(!(params.features & IORING_FEAT_FAST_POLL)){
+      close(fd);
+      return NULL;
+   }
+   uring ring = calloc(1,sizeof(*ring));
+   assert(ring != NULL);
+   ring->fd = fd;
+   ring->entries = params.sq_entries;
+   ring->sq_map_size = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+   ring->cq_map_size = params.cq_off.cqes
+      +params.cq_entries*sizeof(struct io_uring_cqe);
+//Newer kernels map both rings at once.
+   if(params.features & IORING_FEAT_SINGLE_MMAP){
+      if(ring->cq_map_size > ring->sq_map_size)
+         ring->sq_map_size = ring->cq_map_size;
+      ring->cq_map_size = 0;
+   }
+   ring->sq_map = mmap(NULL,ring->sq_map_size,PROT_READ|PROT_WRITE,
+         MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+   ring->cq_map = ring->sq_map;
+   if(ring->sq_map != MAP_FAILED && ring->cq_map_size != 0)
+      ring->cq_map = mmap(NULL,ring->cq_map_size,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+   ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+   ring->sqes = MAP_FAILED;
+   if(ring->sq_map != MAP_FAILED && ring->cq_map != MAP_FAILED)
+      ring->sqes = mmap(NULL,ring->sqes_size,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+   if(ring->sqes == MAP_FAILED){
+      fprintf(stderr,"Unable to map io_uring, using plain reads: %s\n",
+         strerror(errno));
+      if(ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+         munmap(ring->cq_map,ring->cq_map_size);
+      if(ring->sq_map != MAP_FAILED) munmap(ring->sq_map,ring->sq_map_size);
+      close(fd);
+      free(ring);
+      return NULL;
+   }
+   char *sq = ring->sq_map;
+   ring->sq_tail = (unsigned *)(sq+params.sq_off.tail);
+   ring->sq_mask = (unsigned *)(sq+params.sq_off.ring_mask);
+   ring->sq_array = (unsigned *)(sq+params.sq_off.array);
+   char *cq = ring->cq_map;
+   ring->cq_head = (unsigned *)(cq+params.cq_off.head);
+   ring->cq_tail = (unsigned *)(cq+params.cq_off.tail);
+   ring->cq_mask = (unsigned *)(cq+params.cq_off.ring_mask);
+   ring->cqes = cq+params.cq_off.cqes;
+   return ring;
+}
+
+//Queue a read of len bytes at offset of fd into buf, tagged with
+//user_data. Returns -1 if the ring is full.
+int uring_read(uring ring, int fd, void *buf, size_t len, uint64_t offset,
+      uint64_t user_data){
+   if(ring->queued+ring->in_flight >= ring->entries) return -1;
+   if(len > URING_MAX_READ) len = URING_MAX_READ;
+   unsigned tail = *ring->sq_tail;
+   unsigned index = tail & *ring->sq_mask;
+   struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes+index;
+   memset(sqe,0,sizeof(*sqe));
+   sqe->opcode = IORING_OP_READ;
+   sqe->fd = fd;
+   sqe->addr = (uintptr_t)buf;
+   sqe->len = len;
+   sqe->off = offset;
+   sqe->user_data = user_data;
+   ring->sq_array[index] = index;
+//The kernel must see the SQE before the new tail.
+   __atomic_store_n(ring->sq_tail,tail+1,__ATOMIC_RELEASE);
+   ++ring->queued;
+   return 0;
+}
+
+//Hand the queued reads to the kernel. Returns -1 on error.
+int uring_submit(uring ring){
+   while(ring->queued > 0){
+      int submitted = uring_enter(ring->fd,ring->queued,0,0);
+      if(submitted < 0){
+         if(errno == EINTR) continue;
+         fprintf(stderr,"io_uring submit error: %s\n",strerror(errno));
+         return -1;
+      }
+      ring->queued -= submitted;
+      ring->in_flight += submitted;
+   }
+   return 0;
+}
+
+//Take the next completed read, waiting for one if need be, setting its
+//user_data and result, the bytes read or -errno. Returns -1 if nothing
+//is in flight or on error.
+int uring_wait(uring ring, uint64_t *user_data, int *res){
+   if(uring_submit(ring) != 0) return -1;
+   while(1){
+      unsigned head = *ring->cq_head;
+      if(head != __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE)){
+         struct io_uring_cqe *cqe = (struct io_uring_cqe *)ring->cqes
+            +(head & *ring->cq_mask);
+         *user_data = cqe->user_data;
+         *res = cqe->res;
+         __atomic_store_n(ring->cq_head,head+1,__ATOMIC_RELEASE);
+         --ring->in_flight;
+         return 0;
+      }
+      if(ring->in_flight == 0) return -1;
+      if(uring_enter(ring->fd,0,1,IORING_ENTER_GETEVENTS) < 0
+            && errno != EINTR){
+         fprintf(stderr,"io_uring wait error: %s\n",strerror(errno));
+         return -1;
+      }
+   }
+}
+
+void free_uring(uring ring){
+   if(ring == NULL) return;
+   munmap(ring->sqes,ring->sqes_size);
+   if(ring->cq_map != ring->sq_map) munmap(ring->cq_map,ring->cq_map_size);
+   munmap(ring->sq_map,ring->sq_map_size);
+   close(ring->fd);
+   free(ring);
+}
+
+#else
+
+uring get_uring(unsigned entries){
+   (void)entries;
+   return NULL;
+}
+
+int uring_read(uring ring, int fd, void *buf, size_t len, uint64_t offset,
+      uint64_t user_data){
+   (void)ring; (void)fd; (void)buf; (void)len; (void)offset; (void)user_data;
+   return -1;
+}
+
+int uring_submit(uring ring){
+   (void)ring;
+   return -1;
+}
+
+int uring_wait(uring ring, uint64_t *user_data, int *res){
+   (void)ring; (void)user_data; (void)res;
+   return -1;
+}
+
+void free_uring(uring ring){
+   (void)ring;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Longest single read queued, longer reads complete short and are
+//continued by the caller.
+#define URING_MAX_READ (1u<<30)
+
+//Just enough io_uring to keep many reads of a file in flight, set up
+//through the system calls directly. Only the thread that made a ring
+//may use it. get_uring returns NULL when io_uring is missing, not
+//allowed or the build defines NO_URING, and callers fall back to plain
+//reads.
+typedef struct _uring{
+	int fd;
+	unsigned entries;
+//Submission ring, the SQEs it indexes and the completion ring, all
+//mapped from the kernel.
+	void *sq_map;
+	size_t sq_map_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	void *sqes;
+	size_t sqes_size;
+	void *cq_map;
+	size_t cq_map_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes;
+//Reads queued but not yet submitted, and submitted but not yet reaped.
+	unsigned queued;
+	unsigned in_flight;
+}*uring;
+
+uring get_uring(unsigned entries);
+int uring_read(uring ring, int fd, void *buf, size_t len, uint64_t offset,
+      uint64_t user_data);
+int uring_submit(uring ring);
+int uring_wait(uring ring, uint64_t *user_data, int *res);
+void free_uring(uring ring);
+
+#endif